@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+/*reflected Castagnoli polynomial*/
+#define CRC32C_POLY 0x82F63B78u
+
+static __uint32_t crc_table[8][256];
+static int crc_use_hw = -1;
+
+static void crc_table_init(void) {
+    for (int i = 0; i < 256; i++) {
+        __uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+    }
+}
+
+/*table lookup on 8 bytes at a time*/
+static __uint32_t crc32c_sw(__uint32_t crc, const __uint8_t *p, size_t len) {
+    while (len && ((uintptr_t) p & 7)) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        __uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xFF] ^
+              crc_table[6][(word >> 8) & 0xFF] ^
+              crc_table[5][(word >> 16) & 0xFF] ^
+              crc_table[4][(word >> 24) & 0xFF] ^
+              crc_table[3][(word >> 32) & 0xFF] ^
+              crc_table[2][(word >> 40) & 0xFF] ^
+              crc_table[1][(word >> 48) & 0xFF] ^
+              crc_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static __uint32_t crc32c_hw(__uint32_t crc, const __uint8_t *p, size_t len) {
+    __uint64_t crc64 = crc;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        __uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+    return crc64;
+}
+#endif
+
+__uint32_t crc32c(__uint32_t crc, const void *buf, size_t len) {
+    /*the table is ready before any caller can see the software path*/
+    if (crc_use_hw < 0) {
+        int use_hw = 0;
+#if defined(__x86_64__)
+        use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+        if (!use_hw)
+            crc_table_init();
+        crc_use_hw = use_hw;
+    }
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc_use_hw)
+        return ~crc32c_hw(crc, buf, len);
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,21 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Extend checksum @crc over @len bytes of @buf. The SSE4.2 crc32 instruction
+ * is used when the processor has it, and a slicing-by-8 table lookup
+ * otherwise, so a whole block costs well under a microsecond either way.
+ *
+ * Return: the updated checksum.
+ */
+__uint32_t crc32c(__uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
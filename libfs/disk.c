@@ -1,84 +1,1328 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
+/* Blocks moved per read/write when copying through memory */
+#define COPY_BLOCKS 16
+
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
-/* Disk instance description */
-struct disk {
-	/* File descriptor */
+/* Blocks held back by a plugged disk before they are submitted anyway */
+#define SCHED_MAX_BLOCKS 1024
+
+/* Disk instance description */
+struct disk {
+	/* Backend serving the disk, NULL when no disk is open */
+	const struct block_backend *ops;
+	/* Backend's private state */
+	void *dev;
+	/* Block count */
+	size_t bcount;
+};
+
+/* Currently open virtual disk (none by default) */
+static struct disk disk;
+
+/* Backend of the next disk opened */
+static const struct block_backend *disk_backend = &block_backend_posix;
+
+/*
+ * Writes held back while the disk is plugged, one slot per block: a block
+ * written again while held back gets its slot overwritten.
+ */
+struct sched {
+	/* Nesting of block_plug() calls */
+	atomic_int depth;
+	/* Block and content of every slot */
+	size_t *block;
+	char *data;
+	size_t count;
+	size_t cap;
+	/* Slot of every disk block, -1 if it is not held back */
+	int32_t *slot_of;
+	/* Slots sorted by block, and the buffers of a run, for submitting */
+	uint32_t *order;
+	struct iovec *iov;
+	pthread_mutex_t lock;
+};
+
+static struct sched sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * A cache image starts with a header block, followed by the map of its slots
+ * and by the slots themselves. Every map entry names the disk block its slot
+ * holds, with the checksum of the slot's content so that slots half-written
+ * when a crash hit can be told apart on recovery.
+ */
+#define CACHE_MAGIC "ECS150C1"
+#define CACHE_VERSION 1
+
+/* Cache image states, kept in the header */
+#define CACHE_STATE_CLEAN 0
+#define CACHE_STATE_OPEN 1
+
+/* Map entry flags */
+#define CACHE_VALID 0x1
+#define CACHE_DIRTY 0x2
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t state;
+	uint32_t slot_count;
+	uint32_t map_blocks;
+	/* Disk the image is bound to, as it was when the image was closed */
+	uint64_t disk_bcount;
+	uint64_t disk_dev;
+	uint64_t disk_ino;
+	int64_t disk_mtime;
+};
+
+struct cache_entry {
+	uint32_t block;
+	uint16_t flags;
+	uint16_t unused;
+	uint32_t crc;
+	/* Ordering of the entries, the newest copy of a block wins */
+	uint32_t gen;
+};
+
+#define CACHE_ENTRY_PER_BLOCK (BLOCK_SIZE / sizeof(struct cache_entry))
+
+/* Cache image attached to the open disk */
+struct cache {
+	/* File descriptor, INVALID_FD when no image is attached */
+	int fd;
+	int policy;
+	uint32_t slot_count;
+	uint32_t map_blocks;
+	/* Map of the slots, and its reverse by disk block (-1 if not cached) */
+	struct cache_entry *map;
+	int32_t *slot_of;
+	/* Reference bits and hand of the clock picking slots to recycle */
+	uint8_t *ref;
+	uint32_t hand;
+	uint32_t gen;
+	/* Bounce buffer for writing slots back */
+	char *bounce;
+	size_t hits;
+	size_t misses;
+	/* Readers of the disk may run in parallel, the map may not */
+	pthread_mutex_t lock;
+};
+
+static struct cache cache = {
+	.fd = INVALID_FD,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Cache image to attach to the next disk opened */
+static char *cache_name;
+static int cache_policy;
+
+/* Transfer a whole range, large requests may be split by the kernel */
+static int pread_all(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = pread(fd, p, len, off);
+
+		if (ret <= 0) {
+			perror("pread");
+			return -1;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = pwrite(fd, p, len, off);
+
+		if (ret <= 0) {
+			perror("pwrite");
+			return -1;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * POSIX backend: the disk is a file, read and written at the position of the
+ * blocks so that readers can run in parallel without sharing an offset.
+ */
+struct posix_disk {
+	int fd;
+};
+
+static void *posix_open(const char *diskname, size_t *bcount)
+{
+	struct posix_disk *pd;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	if (!(pd = malloc(sizeof(*pd)))) {
+		block_error("cannot allocate disk");
+		close(fd);
+		return NULL;
+	}
+
+	pd->fd = fd;
+	*bcount = st.st_size / BLOCK_SIZE;
+	return pd;
+}
+
+static int posix_read(void *dev, size_t block, size_t count, void *buf)
+{
+	struct posix_disk *pd = dev;
+
+	return pread_all(pd->fd, buf, count * BLOCK_SIZE,
+			 (off_t)block * BLOCK_SIZE);
+}
+
+static int posix_write(void *dev, size_t block, size_t count, const void *buf)
+{
+	struct posix_disk *pd = dev;
+
+	return pwrite_all(pd->fd, buf, count * BLOCK_SIZE,
+			  (off_t)block * BLOCK_SIZE);
+}
+
+static int posix_readv(void *dev, size_t block, const struct iovec *iov,
+		       int iovcnt)
+{
+	struct posix_disk *pd = dev;
+	off_t off = (off_t)block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt;) {
+		int n = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+		ssize_t ret = preadv(pd->fd, iov + i, n, off);
+
+		if (ret < 0) {
+			perror("preadv");
+			return -1;
+		}
+
+		/* A short transfer is finished one buffer at a time */
+		for (int end = i + n; i < end; i++) {
+			size_t len = iov[i].iov_len;
+			size_t done = (size_t)ret < len ? (size_t)ret : len;
+
+			if (done < len &&
+			    pread_all(pd->fd, (char *)iov[i].iov_base + done,
+				      len - done, off + done))
+				return -1;
+			ret -= done;
+			off += len;
+		}
+	}
+
+	return 0;
+}
+
+static int posix_writev(void *dev, size_t block, const struct iovec *iov,
+			int iovcnt)
+{
+	struct posix_disk *pd = dev;
+	off_t off = (off_t)block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt;) {
+		int n = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+		ssize_t ret = pwritev(pd->fd, iov + i, n, off);
+
+		if (ret < 0) {
+			perror("pwritev");
+			return -1;
+		}
+
+		/* A short transfer is finished one buffer at a time */
+		for (int end = i + n; i < end; i++) {
+			size_t len = iov[i].iov_len;
+			size_t done = (size_t)ret < len ? (size_t)ret : len;
+
+			if (done < len &&
+			    pwrite_all(pd->fd, (char *)iov[i].iov_base + done,
+				       len - done, off + done))
+				return -1;
+			ret -= done;
+			off += len;
+		}
+	}
+
+	return 0;
+}
+
+static int posix_flush(void *dev)
+{
+	struct posix_disk *pd = dev;
+
+	if (fdatasync(pd->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int posix_close(void *dev)
+{
+	struct posix_disk *pd = dev;
+	int ret = close(pd->fd);
+
+	if (ret)
+		perror("close");
+	free(pd);
+	return ret ? -1 : 0;
+}
+
+static int posix_copy(void *dev, size_t dst, size_t src, size_t count)
+{
+	struct posix_disk *pd = dev;
+	off_t in = (off_t)src * BLOCK_SIZE;
+	off_t out = (off_t)dst * BLOCK_SIZE;
+	size_t len = count * BLOCK_SIZE;
+	char *buf;
+
+#ifdef __linux__
+	/* Let the kernel copy, or share, the range inside the image */
+	while (len) {
+		ssize_t ret;
+
+		ret = copy_file_range(pd->fd, &in, pd->fd, &out, len, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno != ENOSYS && errno != EXDEV &&
+			    errno != EINVAL && errno != EOPNOTSUPP) {
+				perror("copy_file_range");
+				return -1;
+			}
+			break;
+		}
+		len -= ret;
+	}
+#endif
+
+	if (!len)
+		return 0;
+
+	/* Copy the rest through memory when the kernel cannot copy for us */
+	if (!(buf = malloc(COPY_BLOCKS * BLOCK_SIZE))) {
+		block_error("cannot allocate copy buffer");
+		return -1;
+	}
+
+	while (len) {
+		size_t chunk = len < COPY_BLOCKS * BLOCK_SIZE ?
+			len : COPY_BLOCKS * BLOCK_SIZE;
+
+		if (pread_all(pd->fd, buf, chunk, in) ||
+		    pwrite_all(pd->fd, buf, chunk, out)) {
+			free(buf);
+			return -1;
+		}
+		in += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int posix_stat(void *dev, struct stat *st)
+{
+	struct posix_disk *pd = dev;
+
+	if (fstat(pd->fd, st)) {
+		perror("fstat");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct block_backend block_backend_posix = {
+	.name = "posix",
+	.open = posix_open,
+	.read = posix_read,
+	.write = posix_write,
+	.readv = posix_readv,
+	.writev = posix_writev,
+	.flush = posix_flush,
+	.close = posix_close,
+	.copy = posix_copy,
+	.stat = posix_stat,
+};
+
+/*
+ * RAM backend: the disk image is loaded in memory when opened, and what is
+ * written to it is dropped when it is closed.
+ */
+struct ram_disk {
+	char *data;
+};
+
+static void *ram_open(const char *diskname, size_t *bcount)
+{
+	struct ram_disk *rd;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(diskname, O_RDONLY)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	rd = malloc(sizeof(*rd));
+	if (!rd || !(rd->data = malloc(st.st_size ? st.st_size : 1))) {
+		block_error("cannot allocate %zu bytes of RAM disk",
+			    (size_t)st.st_size);
+		free(rd);
+		close(fd);
+		return NULL;
+	}
+
+	if (pread_all(fd, rd->data, st.st_size, 0)) {
+		free(rd->data);
+		free(rd);
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	*bcount = st.st_size / BLOCK_SIZE;
+	return rd;
+}
+
+static int ram_read(void *dev, size_t block, size_t count, void *buf)
+{
+	struct ram_disk *rd = dev;
+
+	memcpy(buf, rd->data + block * BLOCK_SIZE, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_write(void *dev, size_t block, size_t count, const void *buf)
+{
+	struct ram_disk *rd = dev;
+
+	memcpy(rd->data + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_readv(void *dev, size_t block, const struct iovec *iov,
+		     int iovcnt)
+{
+	struct ram_disk *rd = dev;
+	const char *p = rd->data + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_writev(void *dev, size_t block, const struct iovec *iov,
+		      int iovcnt)
+{
+	struct ram_disk *rd = dev;
+	char *p = rd->data + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_flush(void *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+static int ram_close(void *dev)
+{
+	struct ram_disk *rd = dev;
+
+	free(rd->data);
+	free(rd);
+	return 0;
+}
+
+static int ram_copy(void *dev, size_t dst, size_t src, size_t count)
+{
+	struct ram_disk *rd = dev;
+
+	memcpy(rd->data + dst * BLOCK_SIZE, rd->data + src * BLOCK_SIZE,
+	       count * BLOCK_SIZE);
+	return 0;
+}
+
+const struct block_backend block_backend_ram = {
+	.name = "RAM",
+	.open = ram_open,
+	.read = ram_read,
+	.write = ram_write,
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.flush = ram_flush,
+	.close = ram_close,
+	.copy = ram_copy,
+};
+
+static off_t cache_slot_offset(uint32_t slot)
+{
+	return (off_t)(1 + cache.map_blocks + slot) * BLOCK_SIZE;
+}
+
+static int cache_entry_store(uint32_t slot)
+{
+	return pwrite_all(cache.fd, &cache.map[slot], sizeof(struct cache_entry),
+			  BLOCK_SIZE + (off_t)slot * sizeof(struct cache_entry));
+}
+
+static int cache_header_store(uint32_t state)
+{
+	struct cache_header *hdr = (struct cache_header *)cache.bounce;
+	struct stat st;
+
+	if (disk.ops->stat(disk.dev, &st))
+		return -1;
+
+	memset(cache.bounce, 0, BLOCK_SIZE);
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CACHE_VERSION;
+	hdr->state = state;
+	hdr->slot_count = cache.slot_count;
+	hdr->map_blocks = cache.map_blocks;
+	hdr->disk_bcount = disk.bcount;
+	hdr->disk_dev = st.st_dev;
+	hdr->disk_ino = st.st_ino;
+	hdr->disk_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	return pwrite_all(cache.fd, cache.bounce, BLOCK_SIZE, 0);
+}
+
+/* Copy a dirty slot to the disk */
+static int cache_write_back(uint32_t slot)
+{
+	struct cache_entry *e = &cache.map[slot];
+
+	if (pread_all(cache.fd, cache.bounce, BLOCK_SIZE,
+		      cache_slot_offset(slot)) ||
+	    disk.ops->write(disk.dev, e->block, 1, cache.bounce))
+		return -1;
+
+	e->flags &= ~CACHE_DIRTY;
+	return cache_entry_store(slot);
+}
+
+/* Pick a slot to recycle, never @avoid, writing its block back if needed */
+static int32_t cache_victim(int32_t avoid)
+{
+	for (uint32_t n = 0; n <= 2 * cache.slot_count; n++) {
+		uint32_t slot = cache.hand;
+		struct cache_entry *e = &cache.map[slot];
+
+		cache.hand = (cache.hand + 1) % cache.slot_count;
+		if ((int32_t)slot == avoid)
+			continue;
+		if (!(e->flags & CACHE_VALID))
+			return slot;
+		if (cache.ref[slot]) {
+			cache.ref[slot] = 0;
+			continue;
+		}
+		if ((e->flags & CACHE_DIRTY) && cache_write_back(slot))
+			return -1;
+		cache.slot_of[e->block] = -1;
+		e->flags = 0;
+		return slot;
+	}
+
+	return -1;
+}
+
+/* Drop the entry of @slot, which may not match its content anymore */
+static void cache_drop(uint32_t slot)
+{
+	struct cache_entry *e = &cache.map[slot];
+
+	if ((e->flags & CACHE_VALID) && cache.slot_of[e->block] == (int32_t)slot)
+		cache.slot_of[e->block] = -1;
+	e->flags = 0;
+	cache.ref[slot] = 0;
+	cache_entry_store(slot);
+}
+
+/* Copy @buf, the content of disk block @block, to a new slot */
+static int32_t cache_fill(size_t block, const void *buf, uint16_t flags,
+			  int32_t avoid)
+{
+	int32_t slot = cache_victim(avoid);
+	struct cache_entry *e;
+
+	if (slot < 0)
+		return -1;
+
+	e = &cache.map[slot];
+	if (pwrite_all(cache.fd, buf, BLOCK_SIZE, cache_slot_offset(slot))) {
+		cache_drop(slot);
+		return -1;
+	}
+
+	e->block = block;
+	e->flags = CACHE_VALID | flags;
+	e->crc = crc32c(0, buf, BLOCK_SIZE);
+	e->gen = ++cache.gen;
+	if (cache_entry_store(slot)) {
+		cache_drop(slot);
+		return -1;
+	}
+
+	cache.slot_of[block] = slot;
+	cache.ref[slot] = 1;
+	return slot;
+}
+
+/* Refresh the clean copy of a block written through */
+static void cache_update(int32_t slot, const void *buf)
+{
+	struct cache_entry *e = &cache.map[slot];
+
+	if (pwrite_all(cache.fd, buf, BLOCK_SIZE, cache_slot_offset(slot))) {
+		cache_drop(slot);
+		return;
+	}
+
+	e->crc = crc32c(0, buf, BLOCK_SIZE);
+	e->gen = ++cache.gen;
+	if (cache_entry_store(slot)) {
+		cache_drop(slot);
+		return;
+	}
+	cache.ref[slot] = 1;
+}
+
+static int cache_read_range(size_t block, size_t count, void *buf)
+{
+	char *p = buf;
+	size_t i = 0;
+
+	while (i < count) {
+		int32_t slot = cache.slot_of[block + i];
+		size_t run = 1;
+
+		if (slot >= 0) {
+			if (pread_all(cache.fd, p + i * BLOCK_SIZE, BLOCK_SIZE,
+				      cache_slot_offset(slot)))
+				return -1;
+			cache.ref[slot] = 1;
+			cache.hits++;
+			i++;
+			continue;
+		}
+
+		/* Read runs of missing blocks from the disk at once */
+		while (i + run < count && cache.slot_of[block + i + run] < 0)
+			run++;
+		if (disk.ops->read(disk.dev, block + i, run, p + i * BLOCK_SIZE))
+			return -1;
+		cache.misses += run;
+
+		/* Clean copies only: failing to make them loses nothing */
+		for (size_t j = 0; j < run; j++)
+			cache_fill(block + i + j, p + (i + j) * BLOCK_SIZE, 0, -1);
+		i += run;
+	}
+
+	return 0;
+}
+
+static int cache_write_range(size_t block, size_t count, const void *buf)
+{
+	const char *p = buf;
+
+	if (cache.policy == BLOCK_CACHE_WRITE_THROUGH &&
+	    disk.ops->write(disk.dev, block, count, buf))
+		return -1;
+
+	for (size_t i = 0; i < count; i++) {
+		const char *data = p + i * BLOCK_SIZE;
+		int32_t old = cache.slot_of[block + i];
+
+		if (cache.policy == BLOCK_CACHE_WRITE_THROUGH) {
+			if (old >= 0)
+				cache_update(old, data);
+			else
+				cache_fill(block + i, data, 0, -1);
+			continue;
+		}
+
+		/*
+		 * A dirty block moves to another slot before its old slot is
+		 * dropped, so that a crash leaves one of its versions whole
+		 */
+		if (cache_fill(block + i, data, CACHE_DIRTY, old) < 0)
+			return -1;
+		if (old >= 0)
+			cache_drop(old);
+	}
+
+	return 0;
+}
+
+static int cache_read(size_t block, size_t count, void *buf)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = cache_read_range(block, count, buf);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static int cache_write(size_t block, size_t count, const void *buf)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = cache_write_range(block, count, buf);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static int cache_slot_cmp(const void *a, const void *b)
+{
+	uint32_t x = cache.map[*(const uint32_t *)a].block;
+	uint32_t y = cache.map[*(const uint32_t *)b].block;
+
+	return (x > y) - (x < y);
+}
+
+/* Write every dirty slot back to the disk, in the order of the disk */
+static int cache_flush(void)
+{
+	uint32_t *dirty = malloc(cache.slot_count * sizeof(uint32_t));
+	uint32_t count = 0;
+	int ret = 0;
+
+	if (!dirty) {
+		block_error("cannot allocate flush list");
+		return -1;
+	}
+
+	for (uint32_t slot = 0; slot < cache.slot_count; slot++)
+		if (cache.map[slot].flags & CACHE_DIRTY)
+			dirty[count++] = slot;
+	qsort(dirty, count, sizeof(uint32_t), cache_slot_cmp);
+	for (uint32_t i = 0; i < count && !ret; i++)
+		ret = cache_write_back(dirty[i]);
+
+	free(dirty);
+	return ret;
+}
+
+/* Rebuild the reverse map, dropping what a crash may have left behind */
+static int cache_recover(bool crashed)
+{
+	for (uint32_t slot = 0; slot < cache.slot_count; slot++) {
+		struct cache_entry *e = &cache.map[slot];
+		bool drop;
+		int32_t other;
+
+		if (!(e->flags & CACHE_VALID))
+			continue;
+
+		drop = e->block >= disk.bcount;
+		if (!drop && crashed) {
+			if (pread_all(cache.fd, cache.bounce, BLOCK_SIZE,
+				      cache_slot_offset(slot)))
+				return -1;
+			drop = crc32c(0, cache.bounce, BLOCK_SIZE) != e->crc;
+		}
+		/* A dirty block was moved, but its old slot not dropped yet */
+		if (!drop && (other = cache.slot_of[e->block]) >= 0) {
+			if (cache.map[other].gen > e->gen)
+				drop = true;
+			else
+				cache_drop(other);
+		}
+		if (drop) {
+			cache_drop(slot);
+			continue;
+		}
+
+		cache.slot_of[e->block] = slot;
+		if (e->gen > cache.gen)
+			cache.gen = e->gen;
+	}
+
+	/* Blocks the disk missed are written back right away */
+	return cache_flush();
+}
+
+static void cache_release(void)
+{
+	close(cache.fd);
+	free(cache.map);
+	free(cache.slot_of);
+	free(cache.ref);
+	free(cache.bounce);
+	cache.map = NULL;
+	cache.slot_of = NULL;
+	cache.ref = NULL;
+	cache.bounce = NULL;
+	cache.hand = 0;
+	cache.gen = 0;
+	cache.hits = 0;
+	cache.misses = 0;
+	cache.fd = INVALID_FD;
+}
+
+static int cache_attach(void)
+{
+	struct cache_header hdr;
+	struct stat st, dst;
+	bool clean, bound;
 	int fd;
-	/* Block count */
-	size_t bcount;
-};
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+	/* The image is bound to its disk by the disk's identity */
+	if (!disk.ops->stat) {
+		block_error("%s disks cannot have a cache image", disk.ops->name);
+		return -1;
+	}
+
+	if ((fd = open(cache_name, O_RDWR)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st) || disk.ops->stat(disk.dev, &dst) ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		block_error("cannot read cache image '%s'", cache_name);
+		close(fd);
+		return -1;
+	}
 
-int block_disk_open(const char *diskname)
+	if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != CACHE_VERSION || hdr.slot_count < 2 ||
+	    hdr.map_blocks * CACHE_ENTRY_PER_BLOCK < hdr.slot_count ||
+	    st.st_size != (off_t)(1 + hdr.map_blocks + hdr.slot_count) * BLOCK_SIZE) {
+		block_error("'%s' is not a cache image", cache_name);
+		close(fd);
+		return -1;
+	}
+
+	cache.fd = fd;
+	cache.policy = cache_policy;
+	cache.slot_count = hdr.slot_count;
+	cache.map_blocks = hdr.map_blocks;
+	cache.map = calloc(hdr.slot_count, sizeof(struct cache_entry));
+	cache.slot_of = malloc(disk.bcount * sizeof(int32_t));
+	cache.ref = calloc(hdr.slot_count, 1);
+	cache.bounce = malloc(BLOCK_SIZE);
+	if (!cache.map || !cache.slot_of || !cache.ref || !cache.bounce) {
+		block_error("cannot allocate cache map");
+		goto fail;
+	}
+	memset(cache.slot_of, -1, disk.bcount * sizeof(int32_t));
+
+	/* A disk changed behind a cleanly closed image makes its copies stale */
+	clean = hdr.state == CACHE_STATE_CLEAN;
+	bound = hdr.disk_bcount == disk.bcount;
+	if (clean && (hdr.disk_dev != (uint64_t)dst.st_dev ||
+		      hdr.disk_ino != (uint64_t)dst.st_ino ||
+		      hdr.disk_mtime != dst.st_mtim.tv_sec * 1000000000LL +
+					dst.st_mtim.tv_nsec))
+		bound = false;
+
+	if (bound) {
+		if (pread_all(fd, cache.map,
+			      hdr.slot_count * sizeof(struct cache_entry),
+			      BLOCK_SIZE) ||
+		    cache_recover(!clean))
+			goto fail;
+	} else if (pwrite_all(fd, cache.map,
+			      hdr.slot_count * sizeof(struct cache_entry),
+			      BLOCK_SIZE)) {
+		goto fail;
+	}
+
+	if (cache_header_store(CACHE_STATE_OPEN))
+		goto fail;
+
+	return 0;
+
+fail:
+	cache_release();
+	return -1;
+}
+
+static int cache_detach(void)
+{
+	int ret = cache_flush();
+
+	/* The image is only clean once the disk holds what it was given */
+	if (!ret)
+		ret = disk.ops->flush(disk.dev);
+	if (!ret)
+		ret = cache_header_store(CACHE_STATE_CLEAN);
+
+	cache_release();
+	return ret;
+}
+
+int block_cache_create(const char *cachename, size_t count)
 {
+	struct cache_header hdr;
+	uint32_t slots, map_blocks;
 	int fd;
-	struct stat st;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	if (!cachename) {
+		block_error("invalid cache image name");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	if (count < 4) {
+		block_error("cache image too small (%zu blocks)", count);
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	slots = (count - 1) * CACHE_ENTRY_PER_BLOCK / (CACHE_ENTRY_PER_BLOCK + 1);
+	map_blocks = (slots + CACHE_ENTRY_PER_BLOCK - 1) / CACHE_ENTRY_PER_BLOCK;
+
+	if ((fd = open(cachename, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	/* An empty map is all zeroes, which the file starts with */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.state = CACHE_STATE_CLEAN;
+	hdr.slot_count = slots;
+	hdr.map_blocks = map_blocks;
+	if (ftruncate(fd, (off_t)(1 + map_blocks + slots) * BLOCK_SIZE) ||
+	    pwrite_all(fd, &hdr, sizeof(hdr), 0)) {
+		perror("ftruncate");
+		close(fd);
+		unlink(cachename);
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	close(fd);
+	return 0;
+}
+
+int block_cache_select(const char *cachename, int policy)
+{
+	char *name = NULL;
+
+	if (policy != BLOCK_CACHE_WRITE_THROUGH &&
+	    policy != BLOCK_CACHE_WRITE_BACK) {
+		block_error("invalid cache policy %d", policy);
+		return -1;
+	}
+
+	if (cachename && !(name = strdup(cachename))) {
+		block_error("cannot allocate cache image name");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	free(cache_name);
+	cache_name = name;
+	cache_policy = policy;
 
 	return 0;
 }
 
-int block_disk_close(void)
+int block_cache_stats(size_t *hits, size_t *misses)
+{
+	if (cache.fd == INVALID_FD) {
+		block_error("no cache image attached");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+	*hits = cache.hits;
+	*misses = cache.misses;
+	pthread_mutex_unlock(&cache.lock);
+
+	return 0;
+}
+
+/* Read buffers of whole blocks from @block, through the cache image if any */
+static int disk_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	int ret = 0;
+
+	if (cache.fd == INVALID_FD)
+		return disk.ops->readv(disk.dev, block, iov, iovcnt);
+
+	pthread_mutex_lock(&cache.lock);
+	for (int i = 0; i < iovcnt && !ret; i++) {
+		ret = cache_read_range(block, iov[i].iov_len / BLOCK_SIZE,
+				       iov[i].iov_base);
+		block += iov[i].iov_len / BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+/* Write buffers of whole blocks from @block, through the cache image if any */
+static int disk_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	int ret = 0;
+
+	if (cache.fd == INVALID_FD)
+		return disk.ops->writev(disk.dev, block, iov, iovcnt);
+
+	pthread_mutex_lock(&cache.lock);
+	for (int i = 0; i < iovcnt && !ret; i++) {
+		ret = cache_write_range(block, iov[i].iov_len / BLOCK_SIZE,
+					iov[i].iov_base);
+		block += iov[i].iov_len / BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static int sched_slot_cmp(const void *a, const void *b)
+{
+	size_t x = sched.block[*(const uint32_t *)a];
+	size_t y = sched.block[*(const uint32_t *)b];
+
+	return (x > y) - (x < y);
+}
+
+static int sched_alloc(void)
+{
+	sched.slot_of = malloc(disk.bcount * sizeof(int32_t));
+	if (!sched.slot_of)
+		return -1;
+
+	memset(sched.slot_of, -1, disk.bcount * sizeof(int32_t));
+	sched.count = 0;
+	sched.cap = 0;
+	return 0;
+}
+
+/* Make room for twice as many slots, up to %SCHED_MAX_BLOCKS */
+static int sched_grow(void)
+{
+	size_t cap = sched.cap ? sched.cap * 2 : 16;
+	void *p;
+
+	if (cap > SCHED_MAX_BLOCKS)
+		cap = SCHED_MAX_BLOCKS;
+
+	if (!(p = realloc(sched.block, cap * sizeof(size_t))))
+		return -1;
+	sched.block = p;
+	if (!(p = realloc(sched.data, cap * BLOCK_SIZE)))
+		return -1;
+	sched.data = p;
+	if (!(p = realloc(sched.order, cap * sizeof(uint32_t))))
+		return -1;
+	sched.order = p;
+	if (!(p = realloc(sched.iov, cap * sizeof(struct iovec))))
+		return -1;
+	sched.iov = p;
+
+	sched.cap = cap;
+	return 0;
+}
+
+static void sched_release(void)
+{
+	free(sched.block);
+	free(sched.data);
+	free(sched.order);
+	free(sched.iov);
+	free(sched.slot_of);
+	sched.block = NULL;
+	sched.data = NULL;
+	sched.order = NULL;
+	sched.iov = NULL;
+	sched.slot_of = NULL;
+	sched.count = 0;
+	sched.cap = 0;
+	atomic_store(&sched.depth, 0);
+}
+
+/*
+ * Write the blocks held back in the order of the disk, every run of adjacent
+ * blocks in one operation, and forget them. Called with the lock held.
+ */
+static int sched_submit(void)
+{
+	int ret = 0;
+
+	for (uint32_t slot = 0; slot < sched.count; slot++)
+		sched.order[slot] = slot;
+	qsort(sched.order, sched.count, sizeof(uint32_t), sched_slot_cmp);
+
+	for (size_t i = 0; i < sched.count;) {
+		size_t first = sched.block[sched.order[i]];
+		size_t run = 0;
+		int iovcnt = 0;
+
+		/* Slots adjacent in memory as well share a buffer */
+		for (; i + run < sched.count &&
+		       sched.block[sched.order[i + run]] == first + run; run++) {
+			uint32_t slot = sched.order[i + run];
+			char *data = sched.data + (size_t)slot * BLOCK_SIZE;
+
+			if (run && slot == sched.order[i + run - 1] + 1)
+				sched.iov[iovcnt - 1].iov_len += BLOCK_SIZE;
+			else
+				sched.iov[iovcnt++] = (struct iovec) {
+					data, BLOCK_SIZE
+				};
+		}
+
+		if (disk_writev(first, sched.iov, iovcnt))
+			ret = -1;
+		i += run;
+	}
+
+	for (uint32_t slot = 0; slot < sched.count; slot++)
+		sched.slot_of[sched.block[slot]] = -1;
+	sched.count = 0;
+
+	return ret;
+}
+
+/* Hold @count blocks from @block back. Called with the lock held. */
+static int sched_hold(size_t block, size_t count, const void *buf)
+{
+	const char *p = buf;
+
+	for (size_t i = 0; i < count; i++) {
+		int32_t slot = sched.slot_of[block + i];
+
+		if (slot < 0) {
+			/* Without room for more, write what is held back */
+			if (sched.count == sched.cap &&
+			    (sched.cap == SCHED_MAX_BLOCKS || sched_grow()) &&
+			    (!sched.cap || sched_submit()))
+				return -1;
+			slot = sched.count++;
+			sched.block[slot] = block + i;
+			sched.slot_of[block + i] = slot;
+		}
+		memcpy(sched.data + (size_t)slot * BLOCK_SIZE,
+		       p + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+
+	return 0;
+}
+
+/* Copy the blocks held back among @count blocks from @block over @buf */
+static void sched_overlay(size_t block, size_t count, void *buf)
+{
+	char *p = buf;
+
+	for (size_t i = 0; i < count; i++) {
+		int32_t slot = sched.slot_of[block + i];
+
+		if (slot >= 0)
+			memcpy(p + i * BLOCK_SIZE,
+			       sched.data + (size_t)slot * BLOCK_SIZE,
+			       BLOCK_SIZE);
+	}
+}
+
+int block_plug(void)
+{
+	int ret = 0;
+
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&sched.lock);
+	if (!sched.slot_of && sched_alloc()) {
+		block_error("cannot allocate write queue");
+		sched_release();
+		ret = -1;
+	} else {
+		atomic_fetch_add(&sched.depth, 1);
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return ret;
+}
+
+int block_unplug(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret = 0;
+
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	/* Blocks are written before readers stop looking for them */
+	pthread_mutex_lock(&sched.lock);
+	if (!atomic_load(&sched.depth)) {
+		block_error("disk not plugged");
+		ret = -1;
+	} else {
+		if (atomic_load(&sched.depth) == 1)
+			ret = sched_submit();
+		atomic_fetch_sub(&sched.depth, 1);
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return ret;
+}
+
+int block_disk_select(const struct block_backend *backend)
+{
+	disk_backend = backend ? backend : &block_backend_posix;
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	const struct block_backend *ops = disk_backend;
+	size_t bcount;
+	void *dev;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.ops) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if (!(dev = ops->open(diskname, &bcount)))
+		return -1;
+
+	disk.ops = ops;
+	disk.dev = dev;
+	disk.bcount = bcount;
 
-	disk.fd = INVALID_FD;
+	if (cache_name && cache_attach()) {
+		ops->close(dev);
+		disk.ops = NULL;
+		return -1;
+	}
 
 	return 0;
 }
 
+int block_disk_close(void)
+{
+	int ret = 0;
+
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Writes still held back go first, the cache image may take them */
+	if (sched.slot_of) {
+		if (sched_submit())
+			ret = -1;
+		sched_release();
+	}
+
+	if (cache.fd != INVALID_FD && cache_detach())
+		ret = -1;
+
+	if (disk.ops->close(disk.dev))
+		ret = -1;
+
+	disk.ops = NULL;
+	disk.dev = NULL;
+
+	return ret;
+}
+
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,59 +1330,196 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_sync(void)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Blocks only in the cache image go to the disk first */
+	if (cache.fd != INVALID_FD && cache_flush())
+		return -1;
+
+	return disk.ops->flush(disk.dev);
+}
+
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_write_range(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block + count > disk.bcount) {
+		block_error("block range out of bounds (%zu-%zu/%zu)",
+			    block, block + count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (atomic_load(&sched.depth)) {
+		int ret = 1;
+
+		pthread_mutex_lock(&sched.lock);
+		if (atomic_load(&sched.depth))
+			ret = sched_hold(block, count, buf);
+		pthread_mutex_unlock(&sched.lock);
+		if (ret <= 0)
+			return ret;
+	}
+
+	if (cache.fd != INVALID_FD)
+		return cache_write(block, count, buf);
+
+	return disk.ops->write(disk.dev, block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block + count > disk.bcount) {
+		block_error("block range out of bounds (%zu-%zu/%zu)",
+			    block, block + count, disk.bcount);
 		return -1;
 	}
 
-	return 0;
+	/* Blocks held back are newer than the disk's */
+	if (atomic_load(&sched.depth)) {
+		int ret;
+
+		pthread_mutex_lock(&sched.lock);
+		if (cache.fd != INVALID_FD)
+			ret = cache_read(block, count, buf);
+		else
+			ret = disk.ops->read(disk.dev, block, count, buf);
+		if (!ret && sched.count)
+			sched_overlay(block, count, buf);
+		pthread_mutex_unlock(&sched.lock);
+		return ret;
+	}
+
+	if (cache.fd != INVALID_FD)
+		return cache_read(block, count, buf);
+
+	return disk.ops->read(disk.dev, block, count, buf);
 }
 
-int block_read(size_t block, void *buf)
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t count = 0;
+	int ret = 0;
+
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
-		return -1;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len % BLOCK_SIZE) {
+			block_error("buffer size '%zu' is not multiple of '%d'",
+				    iov[i].iov_len, BLOCK_SIZE);
+			return -1;
+		}
+		count += iov[i].iov_len / BLOCK_SIZE;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block + count > disk.bcount) {
+		block_error("block range out of bounds (%zu-%zu/%zu)",
+			    block, block + count, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (atomic_load(&sched.depth)) {
+		pthread_mutex_lock(&sched.lock);
+		ret = disk_readv(block, iov, iovcnt);
+		for (int i = 0; i < iovcnt && !ret && sched.count; i++) {
+			sched_overlay(block, iov[i].iov_len / BLOCK_SIZE,
+				      iov[i].iov_base);
+			block += iov[i].iov_len / BLOCK_SIZE;
+		}
+		pthread_mutex_unlock(&sched.lock);
+		return ret;
+	}
+
+	return disk_readv(block, iov, iovcnt);
+}
+
+/* Copy through a bounce buffer when the backend cannot copy for us */
+static int block_copy_buffered(size_t dst, size_t src, size_t count)
+{
+	char *buf = malloc(COPY_BLOCKS * BLOCK_SIZE);
+	bool cached = cache.fd != INVALID_FD;
+	int ret = 0;
+
+	if (!buf) {
+		block_error("cannot allocate copy buffer");
 		return -1;
 	}
 
-	return 0;
+	/* Blocks go through the cache image, which may hold the newest ones */
+	if (cached)
+		pthread_mutex_lock(&cache.lock);
+	while (count && !ret) {
+		size_t chunk = count < COPY_BLOCKS ? count : COPY_BLOCKS;
+
+		if (cached)
+			ret = cache_read_range(src, chunk, buf) ||
+			      cache_write_range(dst, chunk, buf);
+		else
+			ret = disk.ops->read(disk.dev, src, chunk, buf) ||
+			      disk.ops->write(disk.dev, dst, chunk, buf);
+		src += chunk;
+		dst += chunk;
+		count -= chunk;
+	}
+	if (cached)
+		pthread_mutex_unlock(&cache.lock);
+
+	free(buf);
+	return ret ? -1 : 0;
 }
 
+int block_copy(size_t dst, size_t src, size_t count)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (dst + count > disk.bcount || src + count > disk.bcount) {
+		block_error("block range out of bounds (%zu-%zu/%zu)",
+			    dst > src ? dst : src,
+			    (dst > src ? dst : src) + count, disk.bcount);
+		return -1;
+	}
+
+	/* The copy works on the disk, which must have every block first */
+	if (atomic_load(&sched.depth)) {
+		int ret;
+
+		pthread_mutex_lock(&sched.lock);
+		ret = sched_submit();
+		pthread_mutex_unlock(&sched.lock);
+		if (ret)
+			return -1;
+	}
+
+	if (cache.fd == INVALID_FD && disk.ops->copy)
+		return disk.ops->copy(disk.dev, dst, src, count);
+
+	return block_copy_buffered(dst, src, count);
+}
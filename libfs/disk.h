@@ -2,17 +2,67 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/stat.h> /* for struct stat definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * struct block_backend - Device serving the blocks of a virtual disk
+ *
+ * Every operation takes the private state returned by @open. Block ranges are
+ * checked against the disk's size before they reach the backend, and reads
+ * may run in parallel with each other.
+ */
+struct block_backend {
+	/* Name of the backend, for messages */
+	const char *name;
+	/* Open disk @diskname and set @bcount to its size, or return NULL */
+	void *(*open)(const char *diskname, size_t *bcount);
+	/* Transfer @count blocks from @block, returning 0 or -1 */
+	int (*read)(void *dev, size_t block, size_t count, void *buf);
+	int (*write)(void *dev, size_t block, size_t count, const void *buf);
+	/* Read blocks from @block into buffers of whole blocks */
+	int (*readv)(void *dev, size_t block, const struct iovec *iov,
+		     int iovcnt);
+	/* Write blocks from @block out of buffers of whole blocks */
+	int (*writev)(void *dev, size_t block, const struct iovec *iov,
+		      int iovcnt);
+	/* Make every block written so far durable */
+	int (*flush)(void *dev);
+	int (*close)(void *dev);
+	/* Copy blocks within the disk, optional */
+	int (*copy)(void *dev, size_t dst, size_t src, size_t count);
+	/* Identity of the disk, optional: a cache image needs it */
+	int (*stat)(void *dev, struct stat *st);
+};
+
+/** Disk image file, read and written in place (the default) */
+extern const struct block_backend block_backend_posix;
+
+/** Disk image file loaded in memory, whose changes are dropped on closing */
+extern const struct block_backend block_backend_ram;
+
+/**
+ * block_disk_select - Choose the backend of the next virtual disk
+ * @backend: Backend, or NULL for %block_backend_posix
+ *
+ * Have block_disk_open(), and therefore fs_mount(), open virtual disks with
+ * @backend until another call selects another one. A disk already open keeps
+ * its backend.
+ *
+ * Return: 0.
+ */
+int block_disk_select(const struct block_backend *backend);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
  *
- * Open virtual disk file @diskname. A virtual disk file must be opened before
- * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * Open virtual disk file @diskname with the backend chosen by
+ * block_disk_select(). A virtual disk file must be opened before blocks can be
+ * read from it with block_read() or written to it with block_write().
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
@@ -26,6 +76,18 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Make the blocks written so far durable
+ *
+ * Write the blocks that only the cache image holds back to the virtual disk,
+ * then have the backend make every block written to the disk durable. Blocks
+ * still held back by block_plug() are not written.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if writing back or
+ * flushing fails. 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -53,12 +115,148 @@ int block_write(size_t block, const void *buf);
  * @buf: Data buffer to be filled with content of block
  *
  * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * buffer @buf. Blocks can be read from several threads at the same time.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the
+ * virtual disk's blocks @block to @block + @count - 1, in a single operation.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, in a single operation.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_readv - Read consecutive blocks from disk into several buffers
+ * @block: Index of the first block to read from
+ * @iov: Buffers to be filled, each holding a whole number of blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the blocks starting at @block into the buffers of @iov in turn, in a
+ * single operation when the backend supports it.
+ *
+ * Return: -1 if a buffer's size is not a multiple of %BLOCK_SIZE, if a block
+ * is out of bounds or inaccessible, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_copy - Copy blocks within the disk
+ * @dst: Index of the first block to write to
+ * @src: Index of the first block to read from
+ * @count: Number of blocks to copy
+ *
+ * Copy the content of the @count blocks starting at @src into the @count
+ * blocks starting at @dst, without going through a user buffer when the host
+ * supports it. The two ranges must not overlap.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if the copy
+ * fails. 0 otherwise.
+ */
+int block_copy(size_t dst, size_t src, size_t count);
+
+/**
+ * block_plug - Hold block writes back
+ *
+ * Keep the blocks written with block_write() and block_write_range() in
+ * memory until the matching block_unplug(), so that they reach the disk in its
+ * order. Calls nest, and reads of the disk see the blocks held back.
+ *
+ * Return: -1 if no disk is open or memory is lacking. 0 otherwise.
+ */
+int block_plug(void);
+
+/**
+ * block_unplug - Write the blocks held back
+ *
+ * On the outermost call, sort the blocks held back since block_plug() by
+ * index, keep the last write of every block, and write each run of adjacent
+ * blocks in a single operation.
+ *
+ * Return: -1 if no disk is open, if the disk is not plugged, or if a writing
+ * operation fails. 0 otherwise.
+ */
+int block_unplug(void);
+
+/** Policies of a cache image */
+enum block_cache_policy {
+	/* Writes go to the disk and to the cache image */
+	BLOCK_CACHE_WRITE_THROUGH,
+	/* Writes go to the cache image, the disk gets them on eviction */
+	BLOCK_CACHE_WRITE_BACK,
+};
+
+/**
+ * block_cache_create - Create a cache image
+ * @cachename: Name of the cache image file to create
+ * @count: Number of blocks of the cache image
+ *
+ * Create cache image @cachename, to be placed on fast storage in front of a
+ * virtual disk with block_cache_select(). The image holds a header block, a
+ * map recording which disk block every slot holds, and about @count slots.
+ * It gets bound to the first disk it is opened with.
+ *
+ * Return: -1 if @cachename is invalid or already exists, if @count is smaller
+ * than 4 or if the image cannot be created. 0 otherwise.
+ */
+int block_cache_create(const char *cachename, size_t count);
+
+/**
+ * block_cache_select - Put a cache image in front of the next virtual disk
+ * @cachename: Name of a cache image created by block_cache_create(), or NULL
+ * @policy: Write policy, one of &enum block_cache_policy
+ *
+ * Have block_disk_open() attach cache image @cachename to the virtual disk it
+ * opens, until another call selects another image or none with NULL. Blocks
+ * read or written go through the cache image, whose least recently used slots
+ * are recycled, so that hot blocks are served from it across openings.
+ *
+ * Opening recovers the image: slots whose content does not match the map
+ * after a crash are dropped, blocks only written to the cache image are
+ * written back to the disk, and an image bound to another disk, or whose disk
+ * changed since it was last closed, starts over empty. Closing the disk writes
+ * back the blocks held by the cache image only.
+ *
+ * Only disks whose backend tells their identity, such as
+ * %block_backend_posix, can have a cache image.
+ *
+ * Return: -1 if @policy is invalid. 0 otherwise.
+ */
+int block_cache_select(const char *cachename, int policy);
+
+/**
+ * block_cache_stats - Get the hit counts of the cache image
+ * @hits: Filled with the number of blocks served by the cache image
+ * @misses: Filled with the number of blocks read from the disk
+ *
+ * Return: -1 if no cache image is attached. 0 otherwise.
+ */
+int block_cache_stats(size_t *hits, size_t *misses);
+
 #endif /* _DISK_H */
 
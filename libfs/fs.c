@@ -1,16 +1,143 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <stdbool.h>
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "crc32c.h"
 
 #define FAT_EOC 0xFFFF
 #define INVALID_INDEX 0xFFFF
 #define INVALID -1
 
+/*volume features recorded in the superblock*/
+#define FS_FEATURE_CHECKSUM 0x01
+#define FS_FEATURE_REFCOUNT 0x02
+#define FS_FEATURE_SNAPSHOT 0x04
+#define FS_FEATURE_FREE_SUMMARY 0x08
+#define FS_FEATURE_ALL (FS_FEATURE_CHECKSUM | FS_FEATURE_REFCOUNT | FS_FEATURE_SNAPSHOT | FS_FEATURE_FREE_SUMMARY)
+
+/*a FAT indexes at most 65536 blocks, 2048 per FAT block*/
+#define FAT_MAX_BLOCKS 32
+#define FAT_PER_BLOCK (BLOCK_SIZE / sizeof(__uint16_t))
+
+/*state of a FAT block, read from disk the first time one of its entries is used*/
+#define FAT_BLOCK_LOADED 0x01
+#define FAT_BLOCK_DIRTY 0x02
+#define FAT_BLOCK_BAD 0x04
+
+/*checksums of data blocks, 1024 per block of the checksum chain*/
+#define CHECKSUM_PER_BLOCK (BLOCK_SIZE / sizeof(__uint32_t))
+
+/*reference counts of data blocks, 2048 per block of the refcount chain*/
+#define REFCOUNT_PER_BLOCK (BLOCK_SIZE / sizeof(__uint16_t))
+
+/*type of a directory entry, stored in the entry's first unused byte*/
+#define FS_TYPE_FILE 0
+#define FS_TYPE_DIR 1
+#define FS_TYPE_DELETED 0xFF
+
+/*data block 0 is never handed out, so it names the root directory*/
+#define DIR_ROOT 0
+
+/*number of 32-byte entries in a directory block*/
+#define DIR_ENTRY_PER_BLOCK (BLOCK_SIZE / sizeof(root_entry_class))
+
+/*per-file flags, stored next to the entry type*/
+#define FS_FLAG_COMPRESSED 0x01
+#define FS_FLAG_READONLY 0x02
+#define FS_FLAG_SPARSE 0x04
+#define FS_FLAG_EXTENT 0x08
+#define FS_FLAG_EXTENT_TREE 0x10
+
+/*files whose chain does not follow their offsets, indexed from index_chunk_block*/
+#define FS_FLAG_INDEXED (FS_FLAG_COMPRESSED | FS_FLAG_SPARSE)
+
+/*files whose second chain, from index_chunk_block, is in use*/
+#define FS_FLAG_SECOND_CHAIN (FS_FLAG_INDEXED | FS_FLAG_EXTENT_TREE)
+
+/*first path component naming the snapshots, "@name" naming one of them*/
+#define SNAPSHOT_PREFIX '@'
+
+/**
+ * compressed files are cut in chunks of CHUNK_SIZE bytes, each compressed on
+ * its own and stored in as few blocks as it needs; the chunk index gives the
+ * stored length of every chunk, CHUNK_RAW marking chunks kept uncompressed
+ */
+#define CHUNK_BLOCKS 4
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_RAW 0x8000
+#define CHUNK_PER_INDEX_BLOCK (BLOCK_SIZE / sizeof(__uint16_t))
+
+/**
+ * sparse files only chain the blocks written to; their allocation map, one
+ * bit per logical block, is chained from index_chunk_block, and a block's
+ * position in the data chain is the number of bits set before its own
+ */
+#define SPARSE_PER_MAP_BLOCK (BLOCK_SIZE * 8)
+#define SPARSE_WORDS_PER_MAP_BLOCK (BLOCK_SIZE / sizeof(__uint64_t))
+#define SPARSE_WORD_BITS 64
+
+/*blocks allocated at once when filling a hole*/
+#define SPARSE_RUN 64
+
+/**
+ * extent files keep their chain and also describe it as runs of adjacent
+ * blocks, in order: up to EXTENT_INLINE of them in the entry itself, more in a
+ * chain of extent blocks from index_chunk_block (FS_FLAG_EXTENT_TREE)
+ */
+#define EXTENT_INLINE 2
+#define EXTENT_PER_BLOCK (BLOCK_SIZE / sizeof(extent_class))
+
+/*alignment of everything carved from the mount arena, a cache line*/
+#define ARENA_ALIGN 64
+
+/*staging buffers of CHUNK_SIZE bytes kept by every mount*/
+#define BUFFER_POOL_COUNT 8
+
+/**
+ * data blocks kept in memory by every mount, and the most of them that blocks
+ * read more than once may hold, so that a scan cannot push them all out
+ */
+#define BCACHE_BLOCKS 256
+#define BCACHE_PROTECTED_MAX (BCACHE_BLOCKS * 3 / 4)
+
+/*lists of the block cache, in the order slots are recycled from*/
+#define BCACHE_ONCE 0
+#define BCACHE_PROBATION 1
+#define BCACHE_PROTECTED 2
+#define BCACHE_LISTS 3
+
+/*readahead window of a file read in order, in blocks*/
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 32
+
+/*blocks of files read once kept before they recycle their own slots*/
+#define BCACHE_ONCE_MIN (2 * READAHEAD_MAX)
+
+/*largest log segment, the most blocks the disk holds back before writing*/
+#define LOG_SEGMENT_MAX 1024
+
+/**
+ * the cleaner keeps this many free segments, taking back first the segments
+ * with the fewest blocks in use, if at most LOG_CLEAN_LIVE percent are; it
+ * looks every LOG_CLEAN_INTERVAL milliseconds, or when the log runs short
+ */
+#define LOG_CLEAN_RESERVE 4
+#define LOG_CLEAN_LIVE 50
+#define LOG_CLEAN_INTERVAL 200
+
+/*files whose chains other structures point into are written in place*/
+#define LOG_IN_PLACE (FS_FLAG_INDEXED | FS_FLAG_EXTENT | FS_FLAG_EXTENT_TREE)
+
 
 
 typedef struct super_block_class {
@@ -20,28 +147,203 @@ typedef struct super_block_class {
     __int16_t data_block_index;
     __int16_t data_block_count;
     __int8_t FAT_block_count;
-    __int8_t unused[4079];
+    __uint8_t features;
+    __uint16_t checksum_block;
+    __uint32_t root_checksum;
+    __uint32_t FAT_checksum[FAT_MAX_BLOCKS];
+    __uint16_t refcount_block;
+    __uint16_t snapshot_dir;
+    __uint16_t FAT_free[FAT_MAX_BLOCKS];
+    __int8_t unused[3876];
 } super_block_class;
 
+/*a run of @len adjacent data blocks from @start*/
+typedef struct extent_class {
+    __uint16_t start;
+    __uint16_t len;
+} extent_class;
+
 typedef struct root_entry_class {
     __uint8_t file_name[FS_FILENAME_LEN];
     __uint32_t size_of_file;
     __uint16_t index_first_data_block;
-    __uint8_t unused[10];
+    __uint8_t file_type;
+    __uint8_t file_flags;
+    union {
+        struct {
+            __uint16_t index_chunk_block;
+            __uint16_t extent_count;
+            __uint8_t unused[4];
+        };
+        /*extent files without FS_FLAG_EXTENT_TREE, unused slots of length 0*/
+        extent_class extent[EXTENT_INLINE];
+    };
 } root_entry_class;
 
 typedef struct root_dir_class {
     root_entry_class dic[FS_FILE_MAX_COUNT];
 } root_dir_class;
 
+/**
+ * A subdirectory is a regular chain of data blocks used as an open-addressing
+ * hash table of entries. Slot 0 of the first block holds this header instead
+ * of an entry; the table doubles when it gets 3/4 full.
+ */
+typedef struct dir_header_class {
+    __uint8_t name[FS_FILENAME_LEN];
+    __uint32_t entry_count;
+    __uint16_t parent_dir;
+    __uint8_t file_type;
+    __uint8_t unused_1;
+    __uint32_t tomb_count;
+    __uint32_t block_count;
+} dir_header_class;
+
+/*where a directory entry lives: its parent directory and slot*/
+typedef struct entry_loc_class {
+    __uint16_t dir;
+    __uint32_t slot;
+} entry_loc_class;
+
+/**
+ * free space index over the FAT: a segment tree recording, for every range of
+ * blocks, its longest run of free blocks and the free runs touching its ends,
+ * so that a run of any length is found in logarithmic time
+ */
+typedef struct free_tree_class {
+    int leaves;
+    __uint32_t *longest;
+    __uint32_t *prefix;
+    __uint32_t *suffix;
+} free_tree_class;
+
+/**
+ * the blocks of one directory held in memory while a batch of metadata
+ * operations runs on it; they are written back once, when the batch moves to
+ * another directory or ends
+ */
+typedef struct dir_batch_class {
+    __uint16_t dir;
+    __uint32_t block_count;
+    __uint16_t *chain;
+    root_entry_class *table;
+    bool *dirty;
+} dir_batch_class;
+
+/**
+ * per-mount state of a fixed size (superblock, FAT, root directory, free space
+ * index, buffers) is carved from one allocation, released at unmount
+ */
+typedef struct arena_class {
+    char *raw;
+    char *base;
+    size_t size;
+    size_t used;
+} arena_class;
+
+/**
+ * bounce and staging buffers for reads and writes, taken and given back
+ * without locking since positional reads run concurrently; a set bit of
+ * @free_mask marks a buffer available
+ */
+typedef struct buffer_pool_class {
+    char *buffers;
+    _Atomic __uint32_t free_mask;
+} buffer_pool_class;
+
+/**
+ * copies of data blocks, each slot on one of the lists: blocks of files read
+ * once (BCACHE_ONCE), blocks read once so far (BCACHE_PROBATION) and blocks
+ * read again (BCACHE_PROTECTED); slots are recycled from the least recently
+ * used end of the first list that can spare one, and reads may run in
+ * parallel, so everything is under @lock
+ */
+typedef struct bcache_class {
+    pthread_mutex_t lock;
+    char *data;
+    __uint16_t block[BCACHE_BLOCKS];
+    __int16_t prev[BCACHE_BLOCKS];
+    __int16_t next[BCACHE_BLOCKS];
+    __uint8_t list[BCACHE_BLOCKS];
+    /*read ahead and not used yet, so that the first use does not promote it*/
+    bool ahead[BCACHE_BLOCKS];
+    __int16_t head[BCACHE_LISTS];
+    __int16_t tail[BCACHE_LISTS];
+    int count[BCACHE_LISTS];
+    int free_head;
+    /*slot of every data block, INVALID when it is not cached*/
+    __int16_t *slot_of;
+} bcache_class;
+
+/*a resolved directory: its first data block, size and own entry*/
+typedef struct dir_handle_class {
+    __uint16_t dir;
+    __uint32_t block_count;
+    entry_loc_class self;
+    bool readonly;
+} dir_handle_class;
+
+/**
+ * state shared by every descriptor open on the same file: a cached copy of
+ * its entry and a map from logical block to data block, so seeking does not
+ * walk the FAT
+ */
+typedef struct file_node_class {
+    entry_loc_class loc;
+    root_entry_class entry;
+    int ref_count;
+    __uint16_t *chain;
+    int chain_len;
+    int chain_cap;
+    /*compressed files: chunk index, first block of each chunk, and the
+     *chunk being worked on, written back when another one is needed*/
+    __uint16_t *chunk_len;
+    __uint32_t *chunk_start;
+    int chunk_count;
+    int chunk_cap;
+    char *chunk_buf;
+    int chunk_cached;
+    bool chunk_dirty;
+    __uint32_t stored_size;
+    /*sparse files: allocation map, and the number of blocks allocated
+     *before every word of it*/
+    __uint64_t *sparse_map;
+    __uint32_t *sparse_rank;
+    int sparse_words;
+    /*extent files: their extents, the logical block every one starts at
+     *(and the length of the file last), and whether the stored ones were
+     *found not to match the file*/
+    extent_class *extent;
+    __uint32_t *extent_lblock;
+    int extent_count;
+    bool extent_stale;
+    /*hint given with fs_advise(), and readahead: the block a read in order
+     *starts at, the end of what was read ahead and the last window size*/
+    int advice;
+    __uint32_t ra_next;
+    __uint32_t ra_end;
+    int ra_window;
+    struct file_node_class *next;
+} file_node_class;
+
 typedef struct open_file_class {
-    int root_entry_index;
+    file_node_class *node;
     int offset;
+    int next_free;
 } open_file_class;
 
+/**
+ * descriptors come from a free list threaded through the table, and the
+ * table doubles when it runs out; nodes are hashed by entry location
+ */
 typedef struct user_define_open_table {
     int count;
-    open_file_class open_files[FS_OPEN_MAX_COUNT];
+    int capacity;
+    int free_head;
+    open_file_class *open_files;
+    int node_count;
+    int bucket_count;
+    file_node_class **buckets;
 } user_define_open_file_table;
 
 user_define_open_file_table *open_table;
@@ -49,15 +351,169 @@ super_block_class *super_block = NULL;
 root_dir_class *root_block;
 __uint16_t *FAT_ptr;
 
-/*helper function to calculate the fat_free_ratio*/
-int FAT_unused_block() {
-    int count_unused_block = 0;
-    for (int i = 0; i < super_block->data_block_count; ++i) {
-        if ((FAT_ptr[i]) == 0) {
-            count_unused_block++;
+/**
+ * the FAT is read one block at a time on first use; the number of free entries
+ * of every FAT block is kept up to date once the block is read, and comes from
+ * the superblock before that when the volume records it
+ */
+__uint8_t FAT_state[FAT_MAX_BLOCKS];
+__uint16_t FAT_free_count[FAT_MAX_BLOCKS];
+bool FAT_summary_valid;
+
+/**
+ * CRC32C of every data block when the volume has checksums, 0 meaning not
+ * known yet (the block was just allocated, or belongs to the checksum chain)
+ */
+__uint32_t *checksum_ptr = NULL;
+
+/**
+ * number of references to every data block beyond the first, once blocks
+ * can be shared; references are entries and FAT links pointing at a block,
+ * so every block after a shared one is shared as well
+ */
+__uint16_t *refcount_ptr = NULL;
+
+free_tree_class *free_tree = NULL;
+
+arena_class mount_arena;
+buffer_pool_class *buffer_pool = NULL;
+
+bcache_class *bcache = NULL;
+
+dir_batch_class *dir_batch = NULL;
+
+/**
+ * calls may come from several threads, and everything that reads or changes
+ * the volume holds this lock: positional reads of files whose chain map is
+ * loaded share it, everything else holds it alone. Like mount_lock, a thread
+ * counts how many times it took the lock, so that callbacks of fs_readdir()
+ * can read files
+ */
+static pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
+static _Thread_local int io_lock_depth;
+
+/**
+ * calls that resolve paths, walk directories or add and remove entries hold
+ * this lock, and so do fs_umount(), the flusher and the cleaner; entries of
+ * open files are updated under io_lock alone, which every holder of this lock
+ * takes next. Callbacks of fs_readdir() call back in, so a thread counts how
+ * many times it took the lock and only the outermost call locks
+ */
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int mount_lock_depth;
+
+/**
+ * bumped by every change to the volume, in memory or on disk: nothing needs
+ * writing back while it matches the value of the last write-back
+ */
+static __uint64_t mount_gen;
+static __uint64_t mount_synced_gen;
+
+static void mount_lock_take(void) {
+    if (mount_lock_depth++ == 0)
+        pthread_mutex_lock(&mount_lock);
+}
+
+static void mount_lock_drop(void) {
+    if (--mount_lock_depth == 0)
+        pthread_mutex_unlock(&mount_lock);
+}
+
+/*take io_lock, shared if @shared; a thread already holding it keeps its hold*/
+static void io_lock_take(bool shared) {
+    if (io_lock_depth++ == 0) {
+        if (shared)
+            pthread_rwlock_rdlock(&io_lock);
+        else
+            pthread_rwlock_wrlock(&io_lock);
+    }
+}
+
+static void io_lock_drop(void) {
+    if (--io_lock_depth == 0)
+        pthread_rwlock_unlock(&io_lock);
+}
+
+/**
+ * a background thread running @pass every @interval milliseconds, or sooner
+ * when woken, with mount_lock and io_lock held; changes made during a pass
+ * wait for the next one
+ */
+typedef struct worker_class {
+    const char *name;
+    int (*pass)(void);
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned int interval;
+    bool running;
+    bool stop;
+    bool kick;
+} worker_class;
+
+static void *worker_run(void *arg) {
+    worker_class *worker = arg;
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += worker->interval / 1000;
+        until.tv_nsec += (worker->interval % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
         }
+        while (!worker->stop && !worker->kick &&
+               pthread_cond_timedwait(&worker->wake, &worker->lock, &until) != ETIMEDOUT)
+            ;
+        if (worker->stop)
+            break;
+        worker->kick = false;
+        pthread_mutex_unlock(&worker->lock);
+
+        mount_lock_take();
+        io_lock_take(false);
+        if (worker->pass())
+            fprintf(stderr, "%s: pass failed\n", worker->name);
+        io_lock_drop();
+        mount_lock_drop();
+
+        pthread_mutex_lock(&worker->lock);
     }
-    return count_unused_block;
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+static int worker_start(worker_class *worker, unsigned int interval) {
+    pthread_mutex_lock(&worker->lock);
+    worker->interval = interval;
+    worker->stop = false;
+    worker->kick = false;
+    worker->running = !pthread_create(&worker->thread, NULL, worker_run, worker);
+    pthread_mutex_unlock(&worker->lock);
+    return worker->running ? 0 : -1;
+}
+
+/*have @worker run its next pass now rather than when it is due*/
+static void worker_wake(worker_class *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->kick = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/*stop @worker if it runs, once it is done with its pass*/
+static void worker_stop(worker_class *worker) {
+    pthread_mutex_lock(&worker->lock);
+    bool running = worker->running;
+    worker->stop = true;
+    worker->running = false;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    if (running)
+        pthread_join(worker->thread, NULL);
 }
 
 /*helper function to calculate the rdir_free_ratio*/
@@ -70,548 +526,5103 @@ int rdir_unused_block() {
     return count_unused_block;
 }
 
-/*find the empty fat block for the file*/
-int find_empty_data_block() {
-    for (int i = 1; i < super_block->data_block_count; i++) {
-        if (FAT_ptr[i] == 0){
-            FAT_ptr[i] = FAT_EOC;
-            return i;
-        }
+/*@size bytes of the mount arena, zeroed, or NULL when it is used up*/
+static void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (mount_arena.size - mount_arena.used < size)
+        return NULL;
+
+    void *ptr = mount_arena.base + mount_arena.used;
+    mount_arena.used += size;
+    return ptr;
+}
+
+/*room for @size bytes plus alignment in the arena*/
+static size_t arena_size(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static int arena_init(size_t size) {
+    /*calloc hands large zeroed areas out without touching them*/
+    mount_arena.raw = calloc(1, size + ARENA_ALIGN);
+    if (!mount_arena.raw)
+        return -1;
+    mount_arena.base = (char *) (((uintptr_t) mount_arena.raw + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1));
+    mount_arena.size = size;
+    mount_arena.used = 0;
+    return 0;
+}
+
+static void arena_destroy(void) {
+    free(mount_arena.raw);
+    memset(&mount_arena, 0, sizeof(mount_arena));
+}
+
+/*a CHUNK_SIZE buffer, from the pool unless every pooled buffer is in use*/
+static void *buffer_get(void) {
+    __uint32_t mask = atomic_load_explicit(&buffer_pool->free_mask, memory_order_relaxed);
+
+    while (mask) {
+        __uint32_t bit = mask & -mask;
+        if (atomic_compare_exchange_weak_explicit(&buffer_pool->free_mask, &mask, mask & ~bit,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return buffer_pool->buffers + __builtin_ctz(bit) * CHUNK_SIZE;
+    }
+    return malloc(CHUNK_SIZE);
+}
+
+static void buffer_put(void *buf) {
+    char *ptr = buf;
+
+    if (ptr < buffer_pool->buffers || ptr >= buffer_pool->buffers + BUFFER_POOL_COUNT * CHUNK_SIZE) {
+        free(buf);
+        return;
+    }
+    atomic_fetch_or_explicit(&buffer_pool->free_mask, 1u << (ptr - buffer_pool->buffers) / CHUNK_SIZE,
+                             memory_order_release);
+}
+
+static int bcache_init(void) {
+    bcache = arena_alloc(sizeof(bcache_class));
+    if (!bcache)
+        return -1;
+
+    bcache->data = arena_alloc(BCACHE_BLOCKS * BLOCK_SIZE);
+    bcache->slot_of = arena_alloc(super_block->data_block_count * sizeof(__int16_t));
+    if (!bcache->data || !bcache->slot_of || pthread_mutex_init(&bcache->lock, NULL)) {
+        bcache = NULL;
+        return -1;
+    }
+
+    memset(bcache->slot_of, 0xff, super_block->data_block_count * sizeof(__int16_t));
+    for (int l = 0; l < BCACHE_LISTS; l++)
+        bcache->head[l] = bcache->tail[l] = INVALID;
+    for (int slot = 0; slot < BCACHE_BLOCKS; slot++)
+        bcache->next[slot] = slot + 1 < BCACHE_BLOCKS ? slot + 1 : INVALID;
+    bcache->free_head = 0;
+    return 0;
+}
+
+static void bcache_unlink(int slot) {
+    int l = bcache->list[slot];
+    int prev = bcache->prev[slot];
+    int next = bcache->next[slot];
+
+    if (prev == INVALID)
+        bcache->head[l] = next;
+    else
+        bcache->next[prev] = next;
+    if (next == INVALID)
+        bcache->tail[l] = prev;
+    else
+        bcache->prev[next] = prev;
+    bcache->count[l]--;
+}
+
+/*put @slot at the most recently used end of list @l*/
+static void bcache_push(int slot, int l) {
+    bcache->list[slot] = l;
+    bcache->prev[slot] = INVALID;
+    bcache->next[slot] = bcache->head[l];
+    if (bcache->head[l] == INVALID)
+        bcache->tail[l] = slot;
+    else
+        bcache->prev[bcache->head[l]] = slot;
+    bcache->head[l] = slot;
+    bcache->count[l]++;
+
+    /*blocks read again beyond the cap go back on probation*/
+    if (l == BCACHE_PROTECTED && bcache->count[l] > BCACHE_PROTECTED_MAX) {
+        int old = bcache->tail[l];
+        bcache_unlink(old);
+        bcache_push(old, BCACHE_PROBATION);
+    }
+}
+
+/**
+ * a slot to fill, on no list: a free one, or the least recently used one of
+ * blocks read once when they have enough, then of blocks on probation; INVALID
+ * if every slot is being filled
+ */
+static int bcache_take(void) {
+    int slot = bcache->free_head;
+
+    if (slot != INVALID) {
+        bcache->free_head = bcache->next[slot];
+        return slot;
+    }
+
+    int l = bcache->count[BCACHE_ONCE] >= BCACHE_ONCE_MIN ? BCACHE_ONCE : BCACHE_PROBATION;
+    for (int i = 0; i < BCACHE_LISTS; i++, l = (l + 1) % BCACHE_LISTS) {
+        slot = bcache->tail[l];
+        if (slot != INVALID) {
+            bcache_unlink(slot);
+            bcache->slot_of[bcache->block[slot]] = INVALID;
+            return slot;
+        }
+    }
+    return INVALID;
+}
+
+static void bcache_release(int slot) {
+    bcache->next[slot] = bcache->free_head;
+    bcache->free_head = slot;
+}
+
+/*give @slot, just filled, to data block @index on list @l unless it got cached meanwhile*/
+static void bcache_publish(int slot, int index, int l, bool ahead) {
+    if (bcache->slot_of[index] != INVALID) {
+        bcache_release(slot);
+        return;
+    }
+    bcache->ahead[slot] = ahead;
+    bcache->block[slot] = index;
+    bcache->slot_of[index] = slot;
+    bcache_push(slot, l);
+}
+
+/**
+ * copy data block @index into @buf if it is cached; a block found again by a
+ * reader that keeps its blocks on list @l is promoted unless @l says it is read
+ * once
+ */
+static bool bcache_lookup(int index, void *buf, int l) {
+    pthread_mutex_lock(&bcache->lock);
+    int slot = bcache->slot_of[index];
+    if (slot != INVALID) {
+        memcpy(buf, bcache->data + slot * BLOCK_SIZE, BLOCK_SIZE);
+        if (bcache->ahead[slot]) {
+            bcache->ahead[slot] = false;
+        } else if (l != BCACHE_ONCE) {
+            bcache_unlink(slot);
+            bcache_push(slot, BCACHE_PROTECTED);
+        }
+    }
+    pthread_mutex_unlock(&bcache->lock);
+    return slot != INVALID;
+}
+
+static bool bcache_cached(int index) {
+    pthread_mutex_lock(&bcache->lock);
+    bool cached = bcache->slot_of[index] != INVALID;
+    pthread_mutex_unlock(&bcache->lock);
+    return cached;
+}
+
+/*keep a copy of @count adjacent data blocks from @index, read as @buf, on list @l*/
+static void bcache_insert(int index, int count, const void *buf, int l) {
+    pthread_mutex_lock(&bcache->lock);
+    for (int i = 0; i < count; i++) {
+        if (bcache->slot_of[index + i] != INVALID)
+            continue;
+        int slot = bcache_take();
+        if (slot == INVALID)
+            break;
+        memcpy(bcache->data + slot * BLOCK_SIZE, (const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        bcache_publish(slot, index + i, l, false);
+    }
+    pthread_mutex_unlock(&bcache->lock);
+}
+
+/*refresh the copies of @count adjacent data blocks from @index, just written from @buf*/
+static void bcache_update(int index, int count, const void *buf) {
+    pthread_mutex_lock(&bcache->lock);
+    for (int i = 0; i < count; i++) {
+        int slot = bcache->slot_of[index + i];
+        if (slot != INVALID)
+            memcpy(bcache->data + slot * BLOCK_SIZE, (const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&bcache->lock);
+}
+
+/*drop the copies of @count adjacent data blocks from @index*/
+static void bcache_forget(int index, int count) {
+    pthread_mutex_lock(&bcache->lock);
+    for (int i = 0; i < count; i++) {
+        int slot = bcache->slot_of[index + i];
+        if (slot == INVALID)
+            continue;
+        bcache_unlink(slot);
+        bcache->slot_of[index + i] = INVALID;
+        bcache_release(slot);
+    }
+    pthread_mutex_unlock(&bcache->lock);
+}
+
+/*recompute tree node @node, whose children each cover @half blocks*/
+static void free_tree_pull(int node, __uint32_t half) {
+    int l = 2 * node;
+    int r = l + 1;
+    __uint32_t across = free_tree->suffix[l] + free_tree->prefix[r];
+
+    free_tree->prefix[node] = free_tree->prefix[l] == half ? half + free_tree->prefix[r] : free_tree->prefix[l];
+    free_tree->suffix[node] = free_tree->suffix[r] == half ? half + free_tree->suffix[l] : free_tree->suffix[r];
+    free_tree->longest[node] = free_tree->longest[l] > free_tree->longest[r] ? free_tree->longest[l] : free_tree->longest[r];
+    if (across > free_tree->longest[node])
+        free_tree->longest[node] = across;
+}
+
+/*record that data block @index became free or used*/
+static void free_tree_set(int index, bool free) {
+    int node = free_tree->leaves + index;
+
+    free_tree->longest[node] = free_tree->prefix[node] = free_tree->suffix[node] = free;
+    for (__uint32_t half = 1; node > 1; half *= 2) {
+        node /= 2;
+        free_tree_pull(node, half);
+    }
+}
+
+/**
+ * set up the index with every block counted as used: the blocks indexed by a
+ * FAT block are added when it is read, block 0 and the padding staying used
+ */
+static int free_tree_leaves(int block_count) {
+    int leaves = 1;
+
+    while (leaves < block_count)
+        leaves *= 2;
+    return leaves;
+}
+
+static int free_tree_build(void) {
+    free_tree = arena_alloc(sizeof(free_tree_class));
+    if (!free_tree)
+        return -1;
+
+    free_tree->leaves = free_tree_leaves(super_block->data_block_count);
+    free_tree->longest = arena_alloc(2 * free_tree->leaves * sizeof(__uint32_t));
+    free_tree->prefix = arena_alloc(2 * free_tree->leaves * sizeof(__uint32_t));
+    free_tree->suffix = arena_alloc(2 * free_tree->leaves * sizeof(__uint32_t));
+    if (!free_tree->longest || !free_tree->prefix || !free_tree->suffix)
+        return -1;
+    return 0;
+}
+
+/*record the free blocks among the @count blocks starting at @first*/
+static void free_tree_fill(int first, int count) {
+    int lo = free_tree->leaves + first;
+    int hi = lo + count - 1;
+
+    for (int i = first; i < first + count; i++) {
+        int node = free_tree->leaves + i;
+        free_tree->longest[node] = free_tree->prefix[node] = free_tree->suffix[node] = i && FAT_ptr[i] == 0;
+    }
+    for (__uint32_t half = 1; lo > 1; half *= 2) {
+        lo /= 2;
+        hi /= 2;
+        for (int node = lo; node <= hi; node++)
+            free_tree_pull(node, half);
+    }
+}
+
+/*first block of the leftmost run of at least @count free blocks, or -1*/
+static int free_tree_find(__uint32_t count) {
+    if (free_tree->longest[1] < count)
+        return -1;
+
+    int node = 1;
+    int start = 0;
+    for (__uint32_t half = free_tree->leaves / 2; node < free_tree->leaves; half /= 2) {
+        int l = 2 * node;
+        int r = l + 1;
+        if (free_tree->longest[l] >= count) {
+            node = l;
+        } else if (free_tree->suffix[l] + free_tree->prefix[r] >= count) {
+            return start + half - free_tree->suffix[l];
+        } else {
+            node = r;
+            start += half;
+        }
+    }
+    return start;
+}
+
+/**
+ * read FAT block @b and index its free entries; a block that cannot be read or
+ * fails its checksum has all its entries marked used and is never written back
+ */
+static void fat_fault(int b) {
+    __uint16_t *entries = FAT_ptr + b * FAT_PER_BLOCK;
+    int first = b * FAT_PER_BLOCK;
+    int count = super_block->data_block_count - first;
+
+    if (count > (int) FAT_PER_BLOCK)
+        count = FAT_PER_BLOCK;
+
+    FAT_state[b] = FAT_BLOCK_LOADED;
+    if (block_read(1 + b, entries) == -1 ||
+        ((super_block->features & FS_FEATURE_CHECKSUM) &&
+         super_block->FAT_checksum[b] != crc32c(0, entries, BLOCK_SIZE))) {
+        fprintf(stderr, "FAT block %d: read error or checksum mismatch\n", b);
+        for (size_t i = 0; i < FAT_PER_BLOCK; i++)
+            entries[i] = FAT_EOC;
+        FAT_state[b] |= FAT_BLOCK_BAD;
+    }
+
+    FAT_free_count[b] = 0;
+    for (int i = 0; i < count; i++)
+        FAT_free_count[b] += entries[i] == 0;
+    free_tree_fill(first, count);
+}
+
+static inline __uint16_t fat_get(int index) {
+    int b = index / FAT_PER_BLOCK;
+
+    if (!(FAT_state[b] & FAT_BLOCK_LOADED))
+        fat_fault(b);
+    return FAT_ptr[index];
+}
+
+static inline void fat_set(int index, __uint16_t value) {
+    int b = index / FAT_PER_BLOCK;
+
+    if (!(FAT_state[b] & FAT_BLOCK_LOADED))
+        fat_fault(b);
+    if ((FAT_ptr[index] == 0) != (value == 0))
+        FAT_free_count[b] += value ? -1 : 1;
+    FAT_ptr[index] = value;
+    FAT_state[b] |= FAT_BLOCK_DIRTY;
+    mount_gen++;
+}
+
+/**
+ * read the first FAT block not read yet that indexes a block below @limit and
+ * may have free entries; return whether there was one
+ */
+static bool fat_load_below(int limit) {
+    for (int b = 0; b < super_block->FAT_block_count && b * (int) FAT_PER_BLOCK < limit; b++) {
+        if (!(FAT_state[b] & FAT_BLOCK_LOADED) && (!FAT_summary_valid || FAT_free_count[b])) {
+            fat_fault(b);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*helper function to calculate the fat_free_ratio*/
+int FAT_unused_block() {
+    int count_unused_block = 0;
+    for (int b = 0; b < super_block->FAT_block_count; ++b) {
+        if (!(FAT_state[b] & FAT_BLOCK_LOADED) && !FAT_summary_valid)
+            fat_fault(b);
+        count_unused_block += FAT_free_count[b];
+    }
+    return count_unused_block;
+}
+
+/*find the empty fat block for the file*/
+int find_empty_data_block() {
+    int i = free_tree_find(1);
+
+    /*a lower free block may be indexed by a FAT block not read yet*/
+    while (fat_load_below(i < 0 ? super_block->data_block_count : i))
+        i = free_tree_find(1);
+    if (i < 0)
+        return -1;
+    fat_set(i, FAT_EOC);
+    free_tree_set(i, false);
+    if (checksum_ptr)
+        checksum_ptr[i] = 0;
+    return i;
+}
+
+/*allocate data block @index if it is free, as the end of a chain*/
+static bool claim_data_block(int index) {
+    if (index <= 0 || index >= super_block->data_block_count || fat_get(index) != 0)
+        return false;
+    fat_set(index, FAT_EOC);
+    free_tree_set(index, false);
+    if (checksum_ptr)
+        checksum_ptr[index] = 0;
+    return true;
+}
+
+/**
+ * allocate a run of up to @count adjacent free blocks, linked as a chain,
+ * preferring the first run long enough and else the longest one; the length
+ * of the run is stored in @got
+ */
+static int find_empty_run(int count, int *got) {
+    int best_len, best;
+
+    for (;;) {
+        best_len = (__uint32_t) count < free_tree->longest[1] ? count : (int) free_tree->longest[1];
+        best = best_len ? free_tree_find(best_len) : -1;
+        if (!fat_load_below(best_len == count ? best + count - 1 : super_block->data_block_count))
+            break;
+    }
+    if (best < 0)
+        return -1;
+
+    for (int i = best; i < best + best_len; i++) {
+        fat_set(i, i + 1 < best + best_len ? i + 1 : FAT_EOC);
+        free_tree_set(i, false);
+        if (checksum_ptr)
+            checksum_ptr[i] = 0;
+    }
+    *got = best_len;
+    return best;
+}
+
+/*give data block @index back to the free pool*/
+static void release_block(int index) {
+    fat_set(index, 0);
+    free_tree_set(index, true);
+    if (checksum_ptr)
+        checksum_ptr[index] = 0;
+}
+
+/*free every block of the chain starting at @first*/
+void free_chain(__uint16_t first) {
+
+    while (first != FAT_EOC) {
+        /*a shared block keeps its tail for its other owners*/
+        if (refcount_ptr && refcount_ptr[first]) {
+            refcount_ptr[first]--;
+            return;
+        }
+        int temp = fat_get(first);
+        release_block(first);
+        first = temp;
+    }
+}
+
+/*free the blocks owned by the file described by @entry*/
+static void free_file(const root_entry_class *entry) {
+    free_chain(entry->index_first_data_block);
+    if (entry->file_flags & FS_FLAG_SECOND_CHAIN)
+        free_chain(entry->index_chunk_block);
+}
+
+/**
+ * in log mode, blocks of plain files are not rewritten in place but at the
+ * head of the log: a segment of free blocks filled in order and held back by
+ * the disk while it fills, so that random writes reach the disk as a few
+ * large ones. The FAT keeps mapping file blocks to where they now live, and
+ * the cleaner moves what is left in sparse segments to make room for more
+ */
+typedef struct log_class {
+    /*blocks per segment, 0 outside log mode*/
+    __uint32_t segment;
+    /*next block of the open segment and the blocks left in it*/
+    int head;
+    __uint32_t left;
+    bool plugged;
+    /*blocks in use in every segment when the cleaner last gave up on it*/
+    __uint16_t *stuck;
+} log_class;
+
+static log_class log_state;
+
+static int log_clean(void);
+
+static worker_class cleaner = {
+    .name = "cleaner",
+    .pass = log_clean,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/*whether writes to the file described by @entry go to the log*/
+static bool log_writes(const root_entry_class *entry) {
+    return log_state.segment && !(entry->file_flags & LOG_IN_PLACE);
+}
+
+/*submit the blocks of the open segment; the log goes on where it stopped*/
+static int log_seal(void) {
+    if (!log_state.plugged)
+        return 0;
+    log_state.plugged = false;
+    return block_unplug();
+}
+
+/**
+ * allocate the next block of the log, as the end of a chain; a new segment is
+ * opened when the current one is full or its next block was taken meanwhile,
+ * from the longest free run if there is no free segment left
+ */
+static int log_alloc(void) {
+    if (!log_state.left || fat_get(log_state.head) != 0) {
+        __uint32_t want;
+        int first;
+
+        if (log_seal())
+            return -1;
+        for (;;) {
+            want = log_state.segment < free_tree->longest[1] ? log_state.segment : free_tree->longest[1];
+            first = want ? free_tree_find(want) : -1;
+            if (!fat_load_below(want == log_state.segment ? first + (int) want - 1 : super_block->data_block_count))
+                break;
+        }
+        if (want < log_state.segment)
+            worker_wake(&cleaner);
+        if (first < 0)
+            return -1;
+
+        log_state.head = first;
+        log_state.left = want;
+        log_state.plugged = block_plug() == 0;
+    }
+
+    claim_data_block(log_state.head);
+    log_state.left--;
+    return log_state.head++;
+}
+
+/**
+ * move logical block @lblock of a file from @old to a new block of the log,
+ * @prev being the block before it and @entry the entry of the file, stored
+ * by the caller; @node is the file's node if it is open. The contents are
+ * left to the caller, and the new block is returned
+ */
+static int log_move(file_node_class *node, root_entry_class *entry, size_t lblock,
+                    __uint16_t prev, __uint16_t old) {
+    int index = log_alloc();
+    if (index < 0)
+        return -1;
+
+    fat_set(index, fat_get(old));
+    if (prev == FAT_EOC)
+        entry->index_first_data_block = index;
+    else
+        fat_set(prev, index);
+    if (node && (int) lblock < node->chain_len)
+        node->chain[lblock] = index;
+
+    bcache_forget(old, 1);
+    release_block(old);
+    return index;
+}
+
+/*check @count adjacent data blocks read from @index against their checksums*/
+static int data_block_verify(int index, int count, const void *buf) {
+    for (int i = 0; checksum_ptr && i < count; i++) {
+        const char *block = (const char *) buf + i * BLOCK_SIZE;
+        if (checksum_ptr[index + i] && checksum_ptr[index + i] != crc32c(0, block, BLOCK_SIZE)) {
+            fprintf(stderr, "data block %d: checksum mismatch\n", index + i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*read @count adjacent data blocks from @index in one operation, straight from the disk*/
+static int data_block_read_range(int index, int count, void *buf) {
+    if (block_read_range(super_block->data_block_index + index, count, buf))
+        return -1;
+    return data_block_verify(index, count, buf);
+}
+
+/*read data block @index through the block cache, where it is kept on list @l*/
+static int data_block_fetch(int index, void *buf, int l) {
+    if (bcache_lookup(index, buf, l))
+        return 0;
+    if (data_block_read_range(index, 1, buf))
+        return -1;
+    bcache_insert(index, 1, buf, l);
+    return 0;
+}
+
+/*read data block @index, checking it against its checksum if it has one*/
+static int data_block_read(int index, void *buf) {
+    return data_block_fetch(index, buf, BCACHE_PROBATION);
+}
+
+static int data_block_write(int index, const void *buf) {
+    mount_gen++;
+    if (checksum_ptr)
+        checksum_ptr[index] = crc32c(0, buf, BLOCK_SIZE);
+    bcache_update(index, 1, buf);
+    return block_write(super_block->data_block_index + index, buf);
+}
+
+/*read adjacent data blocks from @index into buffers of whole blocks in one operation*/
+static int data_block_readv(int index, const struct iovec *iov, int iovcnt) {
+    if (block_readv(super_block->data_block_index + index, iov, iovcnt))
+        return -1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (data_block_verify(index, iov[i].iov_len / BLOCK_SIZE, iov[i].iov_base))
+            return -1;
+        index += iov[i].iov_len / BLOCK_SIZE;
+    }
+    return 0;
+}
+
+static int data_block_write_range(int index, int count, const void *buf) {
+    mount_gen++;
+    for (int i = 0; checksum_ptr && i < count; i++)
+        checksum_ptr[index + i] = crc32c(0, (const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    bcache_update(index, count, buf);
+    return block_write_range(super_block->data_block_index + index, count, buf);
+}
+
+/*data block holding the @lblock-th block of the chain, or FAT_EOC*/
+static __uint16_t chain_block(__uint16_t first, int lblock) {
+    while (lblock-- > 0 && first != FAT_EOC)
+        first = fat_get(first);
+    return first;
+}
+
+/*FNV-1a, used to place names in directory blocks*/
+static __uint32_t name_hash(const char *name) {
+    __uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (__uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool entry_is_free(const root_entry_class *entry) {
+    return entry->file_name[0] == '\0';
+}
+
+static bool entry_matches(const root_entry_class *entry, const char *name) {
+    return !strncmp((char *) entry->file_name, name, FS_FILENAME_LEN);
+}
+
+/*read logical block @lblock of directory @dir, from the batch if it holds it*/
+static int dir_block_read(__uint16_t dir, __uint32_t lblock, void *buf) {
+    if (dir_batch && dir_batch->dir == dir && lblock < dir_batch->block_count) {
+        memcpy(buf, dir_batch->table + lblock * DIR_ENTRY_PER_BLOCK, BLOCK_SIZE);
+        return 0;
+    }
+
+    __uint16_t index = chain_block(dir, lblock);
+    if (index == FAT_EOC)
+        return -1;
+    return data_block_read(index, buf);
+}
+
+static int dir_block_write(__uint16_t dir, __uint32_t lblock, const void *buf) {
+    if (dir_batch && dir_batch->dir == dir && lblock < dir_batch->block_count) {
+        memcpy(dir_batch->table + lblock * DIR_ENTRY_PER_BLOCK, buf, BLOCK_SIZE);
+        dir_batch->dirty[lblock] = true;
+        return 0;
+    }
+
+    __uint16_t index = chain_block(dir, lblock);
+    if (index == FAT_EOC)
+        return -1;
+    return data_block_write(index, buf);
+}
+
+/*write back the blocks the batch changed and stop batching*/
+static int dir_batch_end(void) {
+    int ret = 0;
+
+    if (!dir_batch)
+        return 0;
+    /*the chain is mostly contiguous, write it in disk order*/
+    int plugged = block_plug() == 0;
+    for (__uint32_t i = 0; i < dir_batch->block_count; i++) {
+        if (dir_batch->dirty[i] && data_block_write(dir_batch->chain[i], dir_batch->table + i * DIR_ENTRY_PER_BLOCK))
+            ret = -1;
+    }
+    if (plugged && block_unplug())
+        ret = -1;
+    free(dir_batch->chain);
+    free(dir_batch->table);
+    free(dir_batch->dirty);
+    free(dir_batch);
+    dir_batch = NULL;
+    return ret;
+}
+
+/**
+ * keep the blocks of directory @dir, @block_count long, in memory until
+ * dir_batch_end(); without memory for them, operations go to disk as usual
+ */
+static int dir_batch_begin(__uint16_t dir, __uint32_t block_count) {
+    if (dir == DIR_ROOT || (dir_batch && dir_batch->dir == dir))
+        return 0;
+    if (dir_batch_end())
+        return -1;
+
+    dir_batch_class *batch = calloc(1, sizeof(dir_batch_class));
+    if (!batch)
+        return 0;
+    batch->chain = malloc(block_count * sizeof(__uint16_t));
+    batch->table = malloc(block_count * BLOCK_SIZE);
+    batch->dirty = calloc(block_count, sizeof(bool));
+    if (!batch->chain || !batch->table || !batch->dirty) {
+        free(batch->chain);
+        free(batch->table);
+        free(batch->dirty);
+        free(batch);
+        return 0;
+    }
+
+    batch->dir = dir;
+    batch->block_count = block_count;
+    __uint16_t index = dir;
+    for (__uint32_t i = 0; i < block_count; i++) {
+        if (index == FAT_EOC || data_block_read(index, batch->table + i * DIR_ENTRY_PER_BLOCK)) {
+            free(batch->chain);
+            free(batch->table);
+            free(batch->dirty);
+            free(batch);
+            return -1;
+        }
+        batch->chain[i] = index;
+        index = fat_get(index);
+    }
+    dir_batch = batch;
+    return 0;
+}
+
+/*read the entry stored at @loc*/
+static int entry_load(const entry_loc_class *loc, root_entry_class *entry) {
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+
+    if (loc->dir == DIR_ROOT) {
+        *entry = root_block->dic[loc->slot];
+        return 0;
+    }
+
+    if (dir_block_read(loc->dir, loc->slot / DIR_ENTRY_PER_BLOCK, block))
+        return -1;
+    *entry = block[loc->slot % DIR_ENTRY_PER_BLOCK];
+    return 0;
+}
+
+/*write @entry back to @loc*/
+static int entry_store(const entry_loc_class *loc, const root_entry_class *entry) {
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+
+    if (loc->dir == DIR_ROOT) {
+        root_block->dic[loc->slot] = *entry;
+        mount_gen++;
+        return 0;
+    }
+
+    if (dir_block_read(loc->dir, loc->slot / DIR_ENTRY_PER_BLOCK, block))
+        return -1;
+    block[loc->slot % DIR_ENTRY_PER_BLOCK] = *entry;
+    return dir_block_write(loc->dir, loc->slot / DIR_ENTRY_PER_BLOCK, block);
+}
+
+static __uint32_t loc_hash(const entry_loc_class *loc) {
+    return (loc->dir * 2654435761u) ^ loc->slot;
+}
+
+static file_node_class **node_bucket(const entry_loc_class *loc) {
+    return &open_table->buckets[loc_hash(loc) & (open_table->bucket_count - 1)];
+}
+
+/*the node of the open file whose entry lives at @loc, if any*/
+static file_node_class *node_find(const entry_loc_class *loc) {
+    file_node_class *node = *node_bucket(loc);
+
+    while (node && (node->loc.dir != loc->dir || node->loc.slot != loc->slot))
+        node = node->next;
+    return node;
+}
+
+static void node_link(file_node_class *node) {
+    file_node_class **bucket = node_bucket(&node->loc);
+
+    node->next = *bucket;
+    *bucket = node;
+}
+
+static void node_unlink(file_node_class *node) {
+    file_node_class **link = node_bucket(&node->loc);
+
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+}
+
+/*double the node hash table once it holds more nodes than buckets*/
+static void node_table_grow(void) {
+    int old_count = open_table->bucket_count;
+    file_node_class **old_buckets = open_table->buckets;
+    file_node_class **new_buckets = calloc(old_count * 2, sizeof(file_node_class *));
+
+    if (!new_buckets)
+        return;
+
+    open_table->buckets = new_buckets;
+    open_table->bucket_count = old_count * 2;
+    for (int i = 0; i < old_count; i++) {
+        file_node_class *node = old_buckets[i];
+        while (node) {
+            file_node_class *next = node->next;
+            node_link(node);
+            node = next;
+        }
+    }
+    free(old_buckets);
+}
+
+/*take a reference on the node of the file at @loc, creating it if needed*/
+static file_node_class *node_get(const entry_loc_class *loc, const root_entry_class *entry) {
+    file_node_class *node = node_find(loc);
+
+    if (node) {
+        node->ref_count++;
+        return node;
+    }
+
+    node = calloc(1, sizeof(file_node_class));
+    if (!node)
+        return NULL;
+    node->loc = *loc;
+    node->entry = *entry;
+    node->ref_count = 1;
+    node->chain_len = -1;
+    node->chunk_cached = INVALID;
+    node_link(node);
+
+    if (++open_table->node_count > open_table->bucket_count)
+        node_table_grow();
+    return node;
+}
+
+static int zfile_flush(file_node_class *node);
+static int efile_flush(file_node_class *node);
+static void efile_unload(file_node_class *node);
+
+/*write back a pending compressed chunk of @node, or its changed extents*/
+static int node_flush(file_node_class *node) {
+    int ret = zfile_flush(node);
+    if (!(node->entry.file_flags & FS_FLAG_READONLY) && efile_flush(node))
+        ret = -1;
+    return ret;
+}
+
+static int node_put(file_node_class *node) {
+    if (--node->ref_count > 0)
+        return 0;
+
+    /*the last close writes back what the node still holds*/
+    int ret = node_flush(node);
+
+    node_unlink(node);
+    open_table->node_count--;
+    free(node->chain);
+    free(node->chunk_len);
+    free(node->chunk_start);
+    free(node->chunk_buf);
+    free(node->sparse_map);
+    free(node->sparse_rank);
+    efile_unload(node);
+    free(node);
+    return ret;
+}
+
+/*move the nodes of directory @dir after it was rehashed, @slot_map giving new slots*/
+static void node_rehash_dir(__uint16_t dir, const __uint32_t *slot_map) {
+    file_node_class *moved = NULL;
+
+    for (int i = 0; i < open_table->bucket_count; i++) {
+        file_node_class **link = &open_table->buckets[i];
+        while (*link) {
+            file_node_class *node = *link;
+            if (node->loc.dir == dir) {
+                *link = node->next;
+                node->next = moved;
+                moved = node;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+
+    while (moved) {
+        file_node_class *next = moved->next;
+        moved->loc.slot = slot_map[moved->loc.slot];
+        node_link(moved);
+        moved = next;
+    }
+}
+
+/*drop the extents cached by the extent file @node*/
+static void efile_unload(file_node_class *node) {
+    free(node->extent);
+    free(node->extent_lblock);
+    node->extent = NULL;
+    node->extent_lblock = NULL;
+    node->extent_count = 0;
+}
+
+/**
+ * load the extents of the extent file @node; extents that do not account for
+ * the size of the file, as left by implementations that only know its chain,
+ * are not used again until the extents are stored anew
+ */
+static int efile_load(file_node_class *node) {
+    const root_entry_class *entry = &node->entry;
+
+    if (node->extent)
+        return 0;
+    if (!(entry->file_flags & FS_FLAG_EXTENT) || node->extent_stale)
+        return -1;
+
+    int count = EXTENT_INLINE;
+    if (entry->file_flags & FS_FLAG_EXTENT_TREE)
+        count = entry->extent_count;
+    else
+        while (count > 0 && !entry->extent[count - 1].len)
+            count--;
+
+    /*extent blocks are read whole*/
+    extent_class *extent = malloc((count + EXTENT_PER_BLOCK) * sizeof(extent_class));
+    __uint32_t *lblock = malloc((count + 1) * sizeof(__uint32_t));
+    if (!extent || !lblock) {
+        free(extent);
+        free(lblock);
+        return -1;
+    }
+
+    bool valid = true;
+    if (entry->file_flags & FS_FLAG_EXTENT_TREE) {
+        __uint16_t index = entry->index_chunk_block;
+        for (int i = 0; valid && i < count; i += EXTENT_PER_BLOCK) {
+            valid = index != FAT_EOC && !data_block_read(index, extent + i);
+            index = valid ? fat_get(index) : FAT_EOC;
+        }
+    } else {
+        memcpy(extent, entry->extent, count * sizeof(extent_class));
+    }
+
+    lblock[0] = 0;
+    for (int i = 0; valid && i < count; i++) {
+        valid = extent[i].len && extent[i].start &&
+                extent[i].start + extent[i].len <= super_block->data_block_count;
+        lblock[i + 1] = lblock[i] + extent[i].len;
+    }
+    valid = valid && lblock[count] == (entry->size_of_file + BLOCK_SIZE - 1) / BLOCK_SIZE &&
+            (count ? extent[0].start : FAT_EOC) == entry->index_first_data_block;
+    if (!valid) {
+        fprintf(stderr, "file '%s': extents do not match its chain\n", entry->file_name);
+        free(extent);
+        free(lblock);
+        node->extent_stale = true;
+        return -1;
+    }
+
+    node->extent = extent;
+    node->extent_lblock = lblock;
+    node->extent_count = count;
+    return 0;
+}
+
+/**
+ * data block of logical block @lblock of @node, whose extents are loaded, by
+ * binary search, and in @avail the number of blocks left in its extent
+ */
+static __uint16_t efile_map(const file_node_class *node, size_t lblock, size_t *avail) {
+    int lo = 0;
+    int hi = node->extent_count;
+
+    *avail = 0;
+    if (lblock >= node->extent_lblock[hi])
+        return FAT_EOC;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (node->extent_lblock[mid] <= lblock)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    size_t within = lblock - node->extent_lblock[lo];
+    *avail = node->extent[lo].len - within;
+    return node->extent[lo].start + within;
+}
+
+/*switch the extent file @node back to a plain chain, its extent blocks freed*/
+static void efile_drop(file_node_class *node) {
+    if (node->entry.file_flags & FS_FLAG_EXTENT_TREE)
+        free_chain(node->entry.index_chunk_block);
+    node->entry.file_flags &= ~(FS_FLAG_EXTENT | FS_FLAG_EXTENT_TREE);
+    memset(node->entry.extent, 0, sizeof(node->entry.extent));
+    node->extent_stale = false;
+    efile_unload(node);
+}
+
+/*build the chain map of @node if it is not cached yet*/
+static int node_chain_load(file_node_class *node) {
+    if (node->chain_len >= 0)
+        return 0;
+
+    /*extent files are mapped without walking the FAT*/
+    if (!efile_load(node)) {
+        int len = node->extent_lblock[node->extent_count];
+        if (len > node->chain_cap) {
+            __uint16_t *chain = realloc(node->chain, len * sizeof(__uint16_t));
+            if (!chain)
+                return -1;
+            node->chain = chain;
+            node->chain_cap = len;
+        }
+        len = 0;
+        for (int i = 0; i < node->extent_count; i++) {
+            for (int j = 0; j < node->extent[i].len; j++)
+                node->chain[len++] = node->extent[i].start + j;
+        }
+        node->chain_len = len;
+        return 0;
+    }
+
+    int len = 0;
+    for (__uint16_t index = node->entry.index_first_data_block; index != FAT_EOC; index = fat_get(index)) {
+        if (len == node->chain_cap) {
+            int cap = node->chain_cap ? node->chain_cap * 2 : 16;
+            __uint16_t *chain = realloc(node->chain, cap * sizeof(__uint16_t));
+            if (!chain)
+                return -1;
+            node->chain = chain;
+            node->chain_cap = cap;
+        }
+        node->chain[len++] = index;
+    }
+    node->chain_len = len;
+    return 0;
+}
+
+/*data block of logical block @lblock of @node, or FAT_EOC past the end*/
+static __uint16_t node_block(file_node_class *node, size_t lblock) {
+    if (node_chain_load(node))
+        return chain_block(node->entry.index_first_data_block, lblock);
+    return lblock < (size_t) node->chain_len ? node->chain[lblock] : FAT_EOC;
+}
+
+/**
+ * replace @remove blocks at position @pos of the chain of @node by the
+ * @insert_count blocks of @insert, relinking the FAT and the chain map;
+ * removed blocks are freed
+ */
+static int node_chain_splice(file_node_class *node, int pos, int remove,
+                             const __uint16_t *insert, int insert_count) {
+    if (node_chain_load(node))
+        return -1;
+
+    int len = node->chain_len + insert_count - remove;
+    if (len > node->chain_cap) {
+        int cap = node->chain_cap ? node->chain_cap : 16;
+        while (cap < len)
+            cap *= 2;
+        __uint16_t *chain = realloc(node->chain, cap * sizeof(__uint16_t));
+        if (!chain)
+            return -1;
+        node->chain = chain;
+        node->chain_cap = cap;
+    }
+
+    __uint16_t next = pos + remove < node->chain_len ? node->chain[pos + remove] : FAT_EOC;
+    for (int i = 0; i < remove; i++)
+        release_block(node->chain[pos + i]);
+
+    memmove(node->chain + pos + insert_count, node->chain + pos + remove,
+            (node->chain_len - pos - remove) * sizeof(__uint16_t));
+    memcpy(node->chain + pos, insert, insert_count * sizeof(__uint16_t));
+    node->chain_len = len;
+
+    /*relink from the block before @pos through the new ones*/
+    for (int i = pos; i < pos + insert_count; i++)
+        fat_set(node->chain[i], i + 1 < len ? node->chain[i + 1] : FAT_EOC);
+    __uint16_t first = insert_count ? insert[0] : next;
+    if (pos == 0)
+        node->entry.index_first_data_block = first;
+    else
+        fat_set(node->chain[pos - 1], first);
+    return 0;
+}
+
+/**
+ * give the chain @chain of @len blocks, starting at *@head, private copies of
+ * its shared blocks up to position @last before they are written; the copies
+ * link back into the shared tail, so only the blocks from the first shared
+ * one through @last are copied
+ */
+static int chain_unshare(__uint16_t *head, __uint16_t *chain, size_t len, size_t last) {
+    if (!refcount_ptr || !len)
+        return 0;
+    if (last >= len)
+        last = len - 1;
+
+    size_t first = 0;
+    while (first <= last && !refcount_ptr[chain[first]])
+        first++;
+    if (first > last)
+        return 0;
+
+    /*a saturated tail cannot take one more link, copy it whole*/
+    __uint16_t next = fat_get(chain[last]);
+    if (next != FAT_EOC && refcount_ptr[next] == UINT16_MAX) {
+        if (fat_get(chain[len - 1]) != FAT_EOC)
+            return -1;
+        last = len - 1;
+        next = FAT_EOC;
+    }
+
+    size_t count = last - first + 1;
+    __uint16_t *copy = malloc(count * sizeof(__uint16_t));
+    char *block = buffer_get();
+    size_t done = 0;
+    bool failed = !copy || !block;
+
+    while (!failed && done < count) {
+        int index = find_empty_data_block();
+        if (index < 0)
+            break;
+        copy[done++] = index;
+        failed = data_block_read(chain[first + done - 1], block) || data_block_write(index, block);
+    }
+    if (failed || done < count) {
+        for (size_t i = 0; copy && i < done; i++)
+            release_block(copy[i]);
+        free(copy);
+        buffer_put(block);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        fat_set(copy[i], i + 1 < count ? copy[i + 1] : next);
+    if (next != FAT_EOC)
+        refcount_ptr[next]++;
+    refcount_ptr[chain[first]]--;
+    if (first == 0)
+        *head = copy[0];
+    else
+        fat_set(chain[first - 1], copy[0]);
+    memcpy(chain + first, copy, count * sizeof(__uint16_t));
+
+    free(copy);
+    buffer_put(block);
+    return 0;
+}
+
+/*unshare the data blocks of @node up to logical block @last*/
+static int node_unshare(file_node_class *node, size_t last) {
+    if (!refcount_ptr)
+        return 0;
+    if (node_chain_load(node))
+        return -1;
+
+    __uint16_t head = node->entry.index_first_data_block;
+    if (chain_unshare(&node->entry.index_first_data_block, node->chain, node->chain_len, last))
+        return -1;
+    if (node->entry.index_first_data_block != head && entry_store(&node->loc, &node->entry))
+        return -1;
+    return 0;
+}
+
+/*take one more reference on the chains of @entry*/
+static int entry_share(const root_entry_class *entry) {
+    __uint16_t heads[2] = { entry->index_first_data_block, FAT_EOC };
+
+    if (entry->file_flags & FS_FLAG_SECOND_CHAIN)
+        heads[1] = entry->index_chunk_block;
+    for (int i = 0; i < 2; i++) {
+        if (heads[i] != FAT_EOC && refcount_ptr[heads[i]] == UINT16_MAX)
+            return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (heads[i] != FAT_EOC)
+            refcount_ptr[heads[i]]++;
+    }
+    return 0;
+}
+
+/*record that @index was linked as the next block of @node*/
+static void node_chain_append(file_node_class *node, __uint16_t index) {
+    if (node->chain_len < 0)
+        return;
+    if (node->chain_len == node->chain_cap) {
+        int cap = node->chain_cap ? node->chain_cap * 2 : 16;
+        __uint16_t *chain = realloc(node->chain, cap * sizeof(__uint16_t));
+        if (!chain) {
+            node->chain_len = -1;
+            return;
+        }
+        node->chain = chain;
+        node->chain_cap = cap;
+    }
+    node->chain[node->chain_len++] = index;
+}
+
+/**
+ * append @count blocks to the chain of @node, taken from the largest runs of
+ * free blocks so that they stay adjacent; return the number of blocks added
+ */
+static int node_chain_extend(file_node_class *node, int count) {
+    if (node_chain_load(node))
+        return 0;
+
+    __uint16_t last = node->chain_len ? node->chain[node->chain_len - 1] : FAT_EOC;
+    int added = 0;
+
+    /*extent files grow in place while they can*/
+    while ((node->entry.file_flags & FS_FLAG_EXTENT) && last != FAT_EOC && added < count &&
+           claim_data_block(last + 1)) {
+        fat_set(last, last + 1);
+        node_chain_append(node, ++last);
+        added++;
+    }
+
+    /*in log mode, files grow at the head of the log*/
+    while (log_writes(&node->entry) && added < count) {
+        int index = log_alloc();
+        if (index < 0)
+            break;
+        if (last == FAT_EOC)
+            node->entry.index_first_data_block = index;
+        else
+            fat_set(last, index);
+        node_chain_append(node, index);
+        last = index;
+        added++;
+    }
+
+    while (added < count) {
+        int got;
+        int first = find_empty_run(count - added, &got);
+        if (first < 0)
+            break;
+        if (last == FAT_EOC)
+            node->entry.index_first_data_block = first;
+        else
+            fat_set(last, first);
+        for (int i = 0; i < got; i++)
+            node_chain_append(node, first + i);
+        last = first + got - 1;
+        added += got;
+    }
+    return added;
+}
+
+static void dir_handle_root(dir_handle_class *handle) {
+    handle->dir = DIR_ROOT;
+    handle->block_count = 1;
+    handle->self.dir = DIR_ROOT;
+    handle->self.slot = INVALID_INDEX;
+    handle->readonly = false;
+}
+
+static void dir_handle_set(dir_handle_class *handle, const entry_loc_class *loc,
+                           const root_entry_class *entry) {
+    handle->dir = entry->index_first_data_block;
+    handle->block_count = entry->size_of_file / BLOCK_SIZE;
+    handle->self = *loc;
+    handle->readonly = entry->file_flags & FS_FLAG_READONLY;
+}
+
+/*the @n-th slot of the probe sequence for @hash; slot 0 is the header*/
+static __uint32_t dir_probe(__uint32_t hash, __uint32_t n, __uint32_t block_count) {
+    __uint32_t slots = block_count * DIR_ENTRY_PER_BLOCK - 1;
+    return 1 + (hash + n) % slots;
+}
+
+/**
+ * look up @name in directory @handle
+ * on success fill @loc and @entry and return 0, otherwise return -1
+ */
+static int dir_lookup(const dir_handle_class *handle, const char *name,
+                      entry_loc_class *loc, root_entry_class *entry) {
+    if (handle->dir == DIR_ROOT) {
+        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+            if (!entry_is_free(&root_block->dic[i]) && entry_matches(&root_block->dic[i], name)) {
+                loc->dir = DIR_ROOT;
+                loc->slot = i;
+                *entry = root_block->dic[i];
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+    __uint32_t hash = name_hash(name);
+    __uint32_t slots = handle->block_count * DIR_ENTRY_PER_BLOCK - 1;
+    int loaded = -1;
+
+    /*walk the probe sequence until the name or a never-used slot*/
+    for (__uint32_t n = 0; n < slots; n++) {
+        __uint32_t slot = dir_probe(hash, n, handle->block_count);
+        int lblock = slot / DIR_ENTRY_PER_BLOCK;
+
+        if (lblock != loaded) {
+            if (dir_block_read(handle->dir, lblock, block))
+                return -1;
+            loaded = lblock;
+        }
+
+        root_entry_class *cur = &block[slot % DIR_ENTRY_PER_BLOCK];
+        if (entry_is_free(cur)) {
+            if (cur->file_type != FS_TYPE_DELETED)
+                return -1;
+            continue;
+        }
+        if (entry_matches(cur, name)) {
+            loc->dir = handle->dir;
+            loc->slot = slot;
+            *entry = *cur;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*place @entry in the first free slot of its probe sequence in @table*/
+static __uint32_t dir_table_place(root_entry_class *table, __uint32_t block_count,
+                                  const root_entry_class *entry) {
+    __uint32_t hash = name_hash((char *) entry->file_name);
+
+    for (__uint32_t n = 0; ; n++) {
+        __uint32_t slot = dir_probe(hash, n, block_count);
+        if (entry_is_free(&table[slot])) {
+            table[slot] = *entry;
+            return slot;
+        }
+    }
+}
+
+/**
+ * double the hash table of directory @handle and rehash its entries
+ * the first block does not move, so the directory keeps its identity
+ */
+static int dir_grow(dir_handle_class *handle) {
+    __uint32_t old_count = handle->block_count;
+    __uint32_t new_count = old_count * 2;
+    root_entry_class *old_table = malloc(old_count * BLOCK_SIZE);
+    root_entry_class *new_table = calloc(new_count, BLOCK_SIZE);
+    __uint32_t *slot_map = malloc(old_count * DIR_ENTRY_PER_BLOCK * sizeof(__uint32_t));
+
+    if (!old_table || !new_table || !slot_map) {
+        free(old_table);
+        free(new_table);
+        free(slot_map);
+        return -1;
+    }
+
+    for (__uint32_t i = 0; i < old_count; i++) {
+        if (data_block_read(chain_block(handle->dir, i), (char *) old_table + i * BLOCK_SIZE)) {
+            free(old_table);
+            free(new_table);
+            free(slot_map);
+            return -1;
+        }
+    }
+
+    /*extend the chain by as many blocks as it already has*/
+    __uint16_t last = chain_block(handle->dir, old_count - 1);
+    __uint32_t added = 0;
+    for (; added < new_count - old_count; added++) {
+        int index = find_empty_data_block();
+        if (index < 0)
+            break;
+        fat_set(last, index);
+        last = index;
+    }
+    if (added < new_count - old_count) {
+        free_chain(fat_get(chain_block(handle->dir, old_count - 1)));
+        fat_set(chain_block(handle->dir, old_count - 1), FAT_EOC);
+        free(old_table);
+        free(new_table);
+        free(slot_map);
+        return -1;
+    }
+
+    dir_header_class *header = (dir_header_class *) new_table;
+    *header = *(dir_header_class *) old_table;
+    header->tomb_count = 0;
+    header->block_count = new_count;
+
+    for (__uint32_t slot = 1; slot < old_count * DIR_ENTRY_PER_BLOCK; slot++) {
+        if (entry_is_free(&old_table[slot]))
+            continue;
+        slot_map[slot] = dir_table_place(new_table, new_count, &old_table[slot]);
+    }
+
+    /*files open in this directory follow their entry*/
+    node_rehash_dir(handle->dir, slot_map);
+    free(slot_map);
+
+    int ret = 0;
+    for (__uint32_t i = 0; i < new_count; i++) {
+        if (data_block_write(chain_block(handle->dir, i), (char *) new_table + i * BLOCK_SIZE))
+            ret = -1;
+    }
+    free(old_table);
+    free(new_table);
+    if (ret)
+        return -1;
+
+    /*the directory's own entry records its size, if it has one*/
+    root_entry_class self;
+    handle->block_count = new_count;
+    if (handle->self.slot == INVALID_INDEX)
+        return 0;
+    if (entry_load(&handle->self, &self))
+        return -1;
+    self.size_of_file = new_count * BLOCK_SIZE;
+    return entry_store(&handle->self, &self);
+}
+
+/*add @entry to directory @handle, the name must not exist yet*/
+static int dir_insert(dir_handle_class *handle, const root_entry_class *entry,
+                      entry_loc_class *loc) {
+    if (handle->dir == DIR_ROOT) {
+        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+            if (entry_is_free(&root_block->dic[i])) {
+                root_block->dic[i] = *entry;
+                mount_gen++;
+                loc->dir = DIR_ROOT;
+                loc->slot = i;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+    dir_header_class header;
+
+    if (dir_block_read(handle->dir, 0, block))
+        return -1;
+    header = *(dir_header_class *) block;
+
+    __uint32_t slots = handle->block_count * DIR_ENTRY_PER_BLOCK - 1;
+    if ((header.entry_count + header.tomb_count + 1) * 4 > slots * 3) {
+        /*the table is rewritten as a whole, so a batch on it restarts*/
+        bool batched = dir_batch && dir_batch->dir == handle->dir;
+        if ((batched && dir_batch_end()) || dir_grow(handle))
+            return -1;
+        if (batched && dir_batch_begin(handle->dir, handle->block_count))
+            return -1;
+        if (dir_block_read(handle->dir, 0, block))
+            return -1;
+        header = *(dir_header_class *) block;
+    }
+
+    __uint32_t hash = name_hash((char *) entry->file_name);
+    int loaded = 0;
+    for (__uint32_t n = 0; ; n++) {
+        __uint32_t slot = dir_probe(hash, n, handle->block_count);
+        int lblock = slot / DIR_ENTRY_PER_BLOCK;
+
+        if (lblock != loaded) {
+            if (dir_block_read(handle->dir, lblock, block))
+                return -1;
+            loaded = lblock;
+        }
+
+        root_entry_class *cur = &block[slot % DIR_ENTRY_PER_BLOCK];
+        if (!entry_is_free(cur))
+            continue;
+
+        if (cur->file_type == FS_TYPE_DELETED)
+            header.tomb_count--;
+        header.entry_count++;
+        *cur = *entry;
+
+        if (lblock == 0) {
+            *(dir_header_class *) block = header;
+        } else {
+            if (dir_block_write(handle->dir, lblock, block))
+                return -1;
+            if (dir_block_read(handle->dir, 0, block))
+                return -1;
+            *(dir_header_class *) block = header;
+        }
+        loc->dir = handle->dir;
+        loc->slot = slot;
+        return dir_block_write(handle->dir, 0, block);
+    }
+}
+
+/*remove the entry at @loc, leaving a tombstone in hashed directories*/
+static int dir_remove(const entry_loc_class *loc) {
+    if (loc->dir == DIR_ROOT) {
+        memset(&root_block->dic[loc->slot], 0, sizeof(root_entry_class));
+        mount_gen++;
+        return 0;
+    }
+
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+    root_entry_class tomb;
+
+    memset(&tomb, 0, sizeof(tomb));
+    tomb.file_type = FS_TYPE_DELETED;
+    if (entry_store(loc, &tomb))
+        return -1;
+
+    if (dir_block_read(loc->dir, 0, block))
+        return -1;
+    dir_header_class *header = (dir_header_class *) block;
+    header->entry_count--;
+    header->tomb_count++;
+    return dir_block_write(loc->dir, 0, block);
+}
+
+/*call @visit on every entry of directory @handle, stopping at its first failure*/
+static int dir_walk(const dir_handle_class *handle,
+                    int (*visit)(const entry_loc_class *, root_entry_class *, void *), void *arg) {
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+    __uint32_t count = handle->dir == DIR_ROOT ? 1 : handle->block_count;
+
+    for (__uint32_t i = 0; i < count; i++) {
+        if (handle->dir == DIR_ROOT)
+            memcpy(block, root_block->dic, BLOCK_SIZE);
+        else if (data_block_read(chain_block(handle->dir, i), block))
+            return -1;
+
+        for (__uint32_t j = handle->dir == DIR_ROOT || i ? 0 : 1; j < DIR_ENTRY_PER_BLOCK; j++) {
+            entry_loc_class loc = { handle->dir, i * DIR_ENTRY_PER_BLOCK + j };
+            if (!entry_is_free(&block[j]) && visit(&loc, &block[j], arg))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*create directory @leaf in @parent, filling @handle with the new directory*/
+static int dir_make(dir_handle_class *parent, const char *leaf, __uint8_t flags, dir_handle_class *handle) {
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+    root_entry_class entry;
+    entry_loc_class loc;
+
+    if (!dir_lookup(parent, leaf, &loc, &entry))
+        return -1;
+
+    int index = find_empty_data_block();
+    if (index < 0)
+        return -1;
+
+    /*a new directory is a single block holding only its header*/
+    memset(block, 0, sizeof(block));
+    dir_header_class *header = (dir_header_class *) block;
+    strcpy((char *) header->name, ".");
+    header->parent_dir = parent->dir;
+    header->file_type = FS_TYPE_DIR;
+    header->block_count = 1;
+
+    memset(&entry, 0, sizeof(entry));
+    strcpy((char *) entry.file_name, leaf);
+    entry.size_of_file = BLOCK_SIZE;
+    entry.index_first_data_block = index;
+    entry.file_type = FS_TYPE_DIR;
+    entry.file_flags = flags;
+
+    if (data_block_write(index, block) || dir_insert(parent, &entry, &loc)) {
+        free_chain(index);
+        return -1;
+    }
+    if (handle)
+        dir_handle_set(handle, &loc, &entry);
+    return 0;
+}
+
+/**
+ * the directory holding the snapshots, which has no entry of its own;
+ * with @create, make it if there is none yet
+ */
+static int snapshot_dir_handle(dir_handle_class *handle, bool create) {
+    dir_header_class header[DIR_ENTRY_PER_BLOCK];
+
+    if (!super_block->snapshot_dir) {
+        if (!create)
+            return -1;
+
+        int index = find_empty_data_block();
+        if (index < 0)
+            return -1;
+        memset(header, 0, sizeof(header));
+        strcpy((char *) header[0].name, ".");
+        header[0].parent_dir = DIR_ROOT;
+        header[0].file_type = FS_TYPE_DIR;
+        header[0].block_count = 1;
+        if (data_block_write(index, header)) {
+            free_chain(index);
+            return -1;
+        }
+        super_block->snapshot_dir = index;
+        super_block->features |= FS_FEATURE_SNAPSHOT;
+    }
+
+    if (data_block_read(super_block->snapshot_dir, header))
+        return -1;
+    handle->dir = super_block->snapshot_dir;
+    handle->block_count = header[0].block_count;
+    handle->self.dir = DIR_ROOT;
+    handle->self.slot = INVALID_INDEX;
+    handle->readonly = true;
+    return 0;
+}
+
+/*resolve "@" to the snapshot directory and "@name" to snapshot @name*/
+static int resolve_snapshot(const char *name, dir_handle_class *handle) {
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    if (snapshot_dir_handle(handle, false))
+        return -1;
+    if (!*name)
+        return 0;
+    if (dir_lookup(handle, name, &loc, &entry))
+        return -1;
+    dir_handle_set(handle, &loc, &entry);
+    return 0;
+}
+
+/*whether @leaf can be added to @parent, snapshot names being reserved*/
+static bool dir_writable(const dir_handle_class *parent, const char *leaf) {
+    return !parent->readonly && !(parent->dir == DIR_ROOT && leaf[0] == SNAPSHOT_PREFIX);
+}
+
+/**
+ * walk @path down to the directory holding its last component
+ * the last component is copied into @leaf
+ */
+static int resolve_parent(const char *path, dir_handle_class *parent, char *leaf) {
+    if (!path)
+        return -1;
+
+    dir_handle_root(parent);
+    while (*path == '/')
+        path++;
+    if (!*path)
+        return -1;
+
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t) (end - path) : strlen(path);
+
+        if (len >= FS_FILENAME_LEN)
+            return -1;
+        memcpy(leaf, path, len);
+        leaf[len] = '\0';
+
+        path += len;
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return 0;
+
+        /*snapshots hang off the root under their prefix*/
+        if (parent->dir == DIR_ROOT && leaf[0] == SNAPSHOT_PREFIX) {
+            if (resolve_snapshot(leaf + 1, parent))
+                return -1;
+            continue;
+        }
+
+        entry_loc_class loc;
+        root_entry_class entry;
+        if (dir_lookup(parent, leaf, &loc, &entry) || entry.file_type != FS_TYPE_DIR)
+            return -1;
+        dir_handle_set(parent, &loc, &entry);
+    }
+}
+
+/*resolve @path to a directory, an empty path or "/" being the root*/
+static int resolve_dir(const char *path, dir_handle_class *handle) {
+    char leaf[FS_FILENAME_LEN];
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    if (!path)
+        return -1;
+    if (!path[strspn(path, "/")]) {
+        dir_handle_root(handle);
+        return 0;
+    }
+
+    if (resolve_parent(path, handle, leaf))
+        return -1;
+    if (handle->dir == DIR_ROOT && leaf[0] == SNAPSHOT_PREFIX)
+        return resolve_snapshot(leaf + 1, handle);
+    if (dir_lookup(handle, leaf, &loc, &entry) || entry.file_type != FS_TYPE_DIR)
+        return -1;
+    dir_handle_set(handle, &loc, &entry);
+    return 0;
+}
+
+/*the open file behind @fd, or NULL if @fd is not a valid descriptor*/
+static open_file_class *get_open_file(int fd) {
+    if (!open_table || fd < 0 || fd >= open_table->capacity)
+        return NULL;
+    if (open_table->open_files[fd].offset == -1)
+        return NULL;
+    return &open_table->open_files[fd];
+}
+
+/*check whether any descriptor refers to the entry at @loc*/
+static bool is_open(const entry_loc_class *loc) {
+    return node_find(loc) != NULL;
+}
+
+/**
+ * read @count bytes from the @run adjacent data blocks at @index into @buf,
+ * starting @skip bytes into the first one, in one operation: partial blocks at
+ * either end land in @bounce, which holds two blocks, and the rest in @buf;
+ * the blocks are kept in the block cache on list @l
+ */
+static size_t data_block_read_span(int index, size_t run, size_t skip, char *buf, size_t count, char *bounce, int l) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (count > run * BLOCK_SIZE - skip)
+        count = run * BLOCK_SIZE - skip;
+
+    size_t head = skip ? BLOCK_SIZE - skip : 0;
+    size_t tail = (skip + count) % BLOCK_SIZE;
+    size_t whole = run - (skip != 0) - (tail != 0);
+
+    if (skip)
+        iov[iovcnt++] = (struct iovec) {bounce, BLOCK_SIZE};
+    if (whole)
+        iov[iovcnt++] = (struct iovec) {buf + head, whole * BLOCK_SIZE};
+    if (tail)
+        iov[iovcnt++] = (struct iovec) {bounce + BLOCK_SIZE, BLOCK_SIZE};
+    if (data_block_readv(index, iov, iovcnt))
+        return 0;
+
+    if (skip)
+        bcache_insert(index, 1, bounce, l);
+    if (whole)
+        bcache_insert(index + (skip != 0), whole, buf + head, l);
+    if (tail)
+        bcache_insert(index + run - 1, 1, bounce + BLOCK_SIZE, l);
+
+    if (skip)
+        memcpy(buf, bounce + skip, head);
+    if (tail)
+        memcpy(buf + head + whole * BLOCK_SIZE, bounce + BLOCK_SIZE, tail);
+    return count;
+}
+
+/*list of the block cache the blocks of @node are kept on*/
+static int node_cache_list(const file_node_class *node) {
+    if (node->advice == FS_ADVISE_SEQUENTIAL || node->advice == FS_ADVISE_NOREUSE)
+        return BCACHE_ONCE;
+    return BCACHE_PROBATION;
+}
+
+/*number of blocks of @node as far as its chain map or extents tell, 0 if neither is loaded*/
+static size_t node_length(const file_node_class *node) {
+    if (node->chain_len >= 0)
+        return node->chain_len;
+    return node->extent ? node->extent_lblock[node->extent_count] : 0;
+}
+
+/**
+ * data block of logical block @lblock of @node, FAT_EOC past its end, and in
+ * @run the number of blocks from it through logical block @last that follow
+ * it on disk and are not cached, 0 if it is cached; extent files are mapped
+ * from their extents until their chain map is needed
+ */
+static __uint16_t node_run(file_node_class *node, size_t lblock, size_t last, size_t *run) {
+    __uint16_t index;
+
+    *run = 0;
+    if (node->chain_len < 0 && !efile_load(node)) {
+        size_t avail;
+        index = efile_map(node, lblock, &avail);
+        if (avail > last - lblock + 1)
+            avail = last - lblock + 1;
+        while (*run < avail && !bcache_cached(index + *run))
+            (*run)++;
+        return index;
+    }
+
+    index = node_block(node, lblock);
+    while (index != FAT_EOC && node->chain_len >= 0 && lblock + *run <= last &&
+           lblock + *run < (size_t) node->chain_len && node->chain[lblock + *run] == index + *run &&
+           !bcache_cached(index + *run))
+        (*run)++;
+    return index;
+}
+
+/**
+ * read logical blocks @first to @last of @node, whose chain map or extents
+ * are loaded, into the block cache on list @l, one operation per run of
+ * adjacent blocks that are not cached yet; slots are filled outside of the lock
+ */
+static void node_prefetch(file_node_class *node, size_t first, size_t last, int l) {
+    int slots[READAHEAD_MAX];
+    struct iovec iov[READAHEAD_MAX];
+    size_t length = node_length(node);
+
+    if (last >= length)
+        last = length - 1;
+
+    for (size_t lblock = first; length && lblock <= last;) {
+        size_t avail;
+        __uint16_t index = node_run(node, lblock, last, &avail);
+        size_t run = 0;
+
+        pthread_mutex_lock(&bcache->lock);
+        while (run < READAHEAD_MAX && run < avail && bcache->slot_of[index + run] == INVALID) {
+            int slot = bcache_take();
+            if (slot == INVALID)
+                break;
+            slots[run] = slot;
+            iov[run] = (struct iovec) {bcache->data + slot * BLOCK_SIZE, BLOCK_SIZE};
+            run++;
+        }
+        pthread_mutex_unlock(&bcache->lock);
+        if (!run) {
+            lblock++;
+            continue;
+        }
+
+        int failed = data_block_readv(index, iov, run);
+        pthread_mutex_lock(&bcache->lock);
+        for (size_t i = 0; i < run; i++) {
+            if (failed)
+                bcache_release(slots[i]);
+            else
+                bcache_publish(slots[i], index + i, l, true);
+        }
+        pthread_mutex_unlock(&bcache->lock);
+        if (failed)
+            return;
+        lblock += run;
+    }
+}
+
+/**
+ * after logical blocks @first to @last of @node were read, read ahead if the
+ * file is read in order: the window doubles with every read in order, and the
+ * next one is read when half of the last one is used
+ */
+static void node_readahead(file_node_class *node, size_t first, size_t last) {
+    size_t start = 0;
+    size_t count = 0;
+
+    if (!node_length(node))
+        return;
+
+    /*files marked sequential are read ahead from wherever they are read*/
+    pthread_mutex_lock(&bcache->lock);
+    bool jumped = first != node->ra_next;
+    node->ra_next = last + 1;
+    if (jumped || node->ra_end < last + 1)
+        node->ra_end = last + 1;
+    if (jumped && node->advice != FS_ADVISE_SEQUENTIAL) {
+        node->ra_window = 0;
+    } else {
+        if (node->ra_end - (last + 1) <= (size_t) node->ra_window / 2) {
+            if (node->advice == FS_ADVISE_SEQUENTIAL)
+                node->ra_window = READAHEAD_MAX;
+            else if (node->ra_window < READAHEAD_MAX)
+                node->ra_window = node->ra_window ? 2 * node->ra_window : READAHEAD_MIN;
+            start = node->ra_end;
+            count = node->ra_window;
+            node->ra_end += count;
+        }
+    }
+    pthread_mutex_unlock(&bcache->lock);
+
+    if (count && start < node_length(node))
+        node_prefetch(node, start, start + count - 1, node_cache_list(node));
+}
+
+/*read at most @count bytes at @offset of the open file @node*/
+static int file_read_at(file_node_class *node, size_t offset, void *buf, size_t count) {
+    const root_entry_class *entry = &node->entry;
+
+    if (offset >= entry->size_of_file)
+        return 0;
+    if (count > entry->size_of_file - offset)
+        count = entry->size_of_file - offset;
+
+    char *buffer_ptr = buf;
+    char *temp_data_block = buffer_get();
+    size_t real_read_size = 0;
+    size_t last = (offset + count - 1) / BLOCK_SIZE;
+    int l = node_cache_list(node);
+
+    while (real_read_size < count) {
+        size_t block_offset = (offset + real_read_size) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > count - real_read_size)
+            chunk = count - real_read_size;
+
+        /*runs of blocks adjacent on disk and not cached are read at once, partial ends included*/
+        size_t lblock = (offset + real_read_size) / BLOCK_SIZE;
+        size_t run;
+        __uint16_t real_index = node_run(node, lblock, last, &run);
+        if (real_index == FAT_EOC)
+            break;
+        if (run > 1) {
+            size_t done = data_block_read_span(real_index, run, block_offset, buffer_ptr + real_read_size,
+                                               count - real_read_size, temp_data_block, l);
+            if (!done)
+                break;
+            real_read_size += done;
+            continue;
+        }
+
+        /*whole blocks go straight into the caller's buffer*/
+        if (chunk == BLOCK_SIZE) {
+            if (data_block_fetch(real_index, buffer_ptr + real_read_size, l))
+                break;
+        } else {
+            if (data_block_fetch(real_index, temp_data_block, l))
+                break;
+            memcpy(buffer_ptr + real_read_size, temp_data_block + block_offset, chunk);
+        }
+
+        real_read_size += chunk;
+    }
+
+    buffer_put(temp_data_block);
+    if (real_read_size && node->advice != FS_ADVISE_RANDOM)
+        node_readahead(node, offset / BLOCK_SIZE, (offset + real_read_size - 1) / BLOCK_SIZE);
+    return real_read_size;
+}
+
+/**
+ * write @count whole blocks at logical block @lblock of @node, whose chain map
+ * is loaded, one operation per run of adjacent blocks; the chain is extended
+ * as needed, and the number of blocks written is returned
+ */
+static size_t file_write_blocks(file_node_class *node, size_t lblock, const char *buf, size_t count) {
+    /*in log mode, the blocks written again move to the log ahead of the new ones*/
+    for (size_t i = lblock; log_writes(&node->entry) && i < lblock + count && (int) i < node->chain_len; i++) {
+        if (log_move(node, &node->entry, i, i ? node->chain[i - 1] : FAT_EOC, node->chain[i]) < 0) {
+            count = i - lblock;
+            break;
+        }
+    }
+
+    if ((size_t) node->chain_len < lblock + count)
+        node_chain_extend(node, lblock + count - node->chain_len);
+    if (node->chain_len < 0 || (size_t) node->chain_len <= lblock)
+        return 0;
+    if (count > node->chain_len - lblock)
+        count = node->chain_len - lblock;
+
+    for (size_t i = 0; i < count;) {
+        __uint16_t first = node->chain[lblock + i];
+        size_t run = 1;
+        while (i + run < count && node->chain[lblock + i + run] == first + run)
+            run++;
+        if (data_block_write_range(first, run, buf + i * BLOCK_SIZE))
+            return i;
+        i += run;
+    }
+    return count;
+}
+
+/**
+ * write @count bytes at @offset of the open file @node, extending the chain
+ * as needed; the node's entry is updated and stored back if it changed
+ */
+static int file_write_at(file_node_class *node, size_t offset, const void *buf, size_t count) {
+    root_entry_class *entry = &node->entry;
+    root_entry_class old_entry = *entry;
+
+    /*extent files change through their chain map, their extents follow on close*/
+    if ((entry->file_flags & FS_FLAG_EXTENT) && node_chain_load(node))
+        return -1;
+
+    /*blocks shared with other files are copied before being written*/
+    if (count && node_unshare(node, (offset + count - 1) / BLOCK_SIZE))
+        return -1;
+
+    const char *buffer_ptr = buf;
+    char *temp_data_block = buffer_get();
+    size_t lblock = offset / BLOCK_SIZE;
+    __uint16_t prev_index = lblock ? node_block(node, lblock - 1) : FAT_EOC;
+    __uint16_t real_index = node_block(node, lblock);
+    size_t written = 0;
+
+    while (written < count) {
+        bool fresh = false;
+
+        /*whole blocks are written by extents, allocated together at the end*/
+        size_t whole = (offset + written) % BLOCK_SIZE ? 0 : (count - written) / BLOCK_SIZE;
+        if (whole > 1 && node->chain_len >= 0) {
+            size_t done = file_write_blocks(node, (offset + written) / BLOCK_SIZE, buffer_ptr + written, whole);
+            if (!done)
+                break;
+            written += done * BLOCK_SIZE;
+            prev_index = node->chain[(offset + written) / BLOCK_SIZE - 1];
+            real_index = fat_get(prev_index);
+            continue;
+        }
+
+        /*past the end of the chain, allocate a new block, next to the last one for extent files*/
+        if (real_index == FAT_EOC) {
+            int index = prev_index;
+            if (log_writes(entry))
+                index = log_alloc();
+            else if (!(entry->file_flags & FS_FLAG_EXTENT) || prev_index == FAT_EOC || !claim_data_block(++index))
+                index = find_empty_data_block();
+            if (index < 0)
+                break;
+            if (prev_index == FAT_EOC)
+                entry->index_first_data_block = index;
+            else
+                fat_set(prev_index, index);
+            node_chain_append(node, index);
+            real_index = index;
+            fresh = true;
+        }
+
+        size_t block_offset = (offset + written) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > count - written)
+            chunk = count - written;
+
+        const char *src = buffer_ptr + written;
+        if (chunk < BLOCK_SIZE) {
+            /*a new block has nothing worth reading back*/
+            if (fresh)
+                memset(temp_data_block, 0, BLOCK_SIZE);
+            else if (data_block_read(real_index, temp_data_block))
+                break;
+            memcpy(temp_data_block + block_offset, src, chunk);
+            src = temp_data_block;
+        }
+
+        /*in log mode, the block is written at the head of the log instead of in place*/
+        if (!fresh && log_writes(entry)) {
+            int index = log_move(node, entry, (offset + written) / BLOCK_SIZE, prev_index, real_index);
+            if (index < 0)
+                break;
+            real_index = index;
+        }
+        if (data_block_write(real_index, src))
+            break;
+
+        written += chunk;
+        prev_index = real_index;
+        real_index = fat_get(real_index);
+    }
+
+    if (offset + written > entry->size_of_file)
+        entry->size_of_file = offset + written;
+
+    buffer_put(temp_data_block);
+
+    /*size and first block may have changed*/
+    if (memcmp(&old_entry, entry, sizeof(old_entry)) && entry_store(&node->loc, entry))
+        return -1;
+    return written;
+}
+
+/**
+ * copy @count whole blocks from logical block @src_lblock of @src to logical
+ * block @dst_lblock of @dst on the disk itself, extending @dst with adjacent
+ * blocks; the blocks of @dst must not be shared
+ */
+static int file_copy_blocks(file_node_class *src, size_t src_lblock,
+                            file_node_class *dst, size_t dst_lblock, size_t count) {
+    root_entry_class old_entry = dst->entry;
+
+    if (node_chain_load(src) || node_chain_load(dst))
+        return -1;
+
+    if ((size_t) dst->chain_len < dst_lblock + count)
+        node_chain_extend(dst, dst_lblock + count - dst->chain_len);
+    if (dst->chain_len < 0 || (size_t) dst->chain_len < dst_lblock + count)
+        return -1;
+
+    /*one copy per run of blocks adjacent on both sides*/
+    for (size_t i = 0; i < count;) {
+        __uint16_t from = src->chain[src_lblock + i];
+        __uint16_t to = dst->chain[dst_lblock + i];
+        size_t run = 1;
+        while (i + run < count && src->chain[src_lblock + i + run] == from + run &&
+               dst->chain[dst_lblock + i + run] == to + run)
+            run++;
+
+        bcache_forget(to, run);
+        mount_gen++;
+        if (block_copy(super_block->data_block_index + to, super_block->data_block_index + from, run))
+            return -1;
+        if (checksum_ptr)
+            memcpy(checksum_ptr + to, checksum_ptr + from, run * sizeof(__uint32_t));
+        i += run;
+    }
+
+    if ((dst_lblock + count) * BLOCK_SIZE > dst->entry.size_of_file)
+        dst->entry.size_of_file = (dst_lblock + count) * BLOCK_SIZE;
+    if (memcmp(&old_entry, &dst->entry, sizeof(old_entry)) && entry_store(&dst->loc, &dst->entry))
+        return -1;
+    return 0;
+}
+
+/*number of blocks taken by a chunk stored with length @len*/
+static int chunk_blocks(__uint16_t len) {
+    return ((len & ~CHUNK_RAW) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*make room for @count chunks in the index cached by @node*/
+static int zfile_reserve(file_node_class *node, int count) {
+    if (node->chunk_start && count <= node->chunk_cap)
+        return 0;
+
+    int cap = node->chunk_cap ? node->chunk_cap : 16;
+    while (cap < count)
+        cap *= 2;
+
+    __uint16_t *chunk_len = realloc(node->chunk_len, cap * sizeof(__uint16_t));
+    if (!chunk_len)
+        return -1;
+    node->chunk_len = chunk_len;
+
+    __uint32_t *chunk_start = realloc(node->chunk_start, (cap + 1) * sizeof(__uint32_t));
+    if (!chunk_start)
+        return -1;
+    node->chunk_start = chunk_start;
+    node->chunk_cap = cap;
+    return 0;
+}
+
+/*load the chunk index of compressed file @node on first use*/
+static int zfile_load(file_node_class *node) {
+    if (node->chunk_buf)
+        return 0;
+
+    int count = (node->entry.size_of_file + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    __uint16_t index_block[CHUNK_PER_INDEX_BLOCK];
+
+    /*one chunk of plain data, then room for its compressed form*/
+    node->chunk_buf = malloc(2 * CHUNK_SIZE);
+    if (!node->chunk_buf || zfile_reserve(node, count) || node_chain_load(node))
+        return -1;
+
+    __uint16_t index = node->entry.index_chunk_block;
+    for (int k = 0; k < count; k++) {
+        if (k % CHUNK_PER_INDEX_BLOCK == 0) {
+            if (k)
+                index = fat_get(index);
+            if (index == FAT_EOC || data_block_read(index, index_block))
+                return -1;
+        }
+        node->chunk_len[k] = index_block[k % CHUNK_PER_INDEX_BLOCK];
+    }
+
+    node->chunk_start[0] = 0;
+    for (int k = 0; k < count; k++)
+        node->chunk_start[k + 1] = node->chunk_start[k] + chunk_blocks(node->chunk_len[k]);
+    node->chunk_count = count;
+    node->stored_size = node->entry.size_of_file;
+    return 0;
+}
+
+/**
+ * data block holding block @lblock of the second chain of @node, the chunk
+ * index or the allocation map; it is copied first if shared, and added if the
+ * chain is too short
+ */
+static int node_index_block(file_node_class *node, int lblock) {
+    __uint16_t prev = FAT_EOC;
+    __uint16_t index;
+
+    /*the second chain of a clone is shared until written*/
+    if (refcount_ptr && node->entry.index_chunk_block != FAT_EOC) {
+        int len = 0;
+        for (index = node->entry.index_chunk_block; index != FAT_EOC; index = fat_get(index))
+            len++;
+        __uint16_t *chain = malloc(len * sizeof(__uint16_t));
+        if (!chain)
+            return -1;
+        len = 0;
+        for (index = node->entry.index_chunk_block; index != FAT_EOC; index = fat_get(index))
+            chain[len++] = index;
+        int ret = chain_unshare(&node->entry.index_chunk_block, chain, len, lblock);
+        free(chain);
+        if (ret)
+            return -1;
+    }
+
+    int i = 0;
+    index = node->entry.index_chunk_block;
+    for (; i < lblock && index != FAT_EOC; i++) {
+        prev = index;
+        index = fat_get(index);
+    }
+
+    /*the chain grows up to the block wanted*/
+    for (; index == FAT_EOC; i++) {
+        int fresh = find_empty_data_block();
+        if (fresh < 0)
+            return -1;
+        if (prev == FAT_EOC)
+            node->entry.index_chunk_block = fresh;
+        else
+            fat_set(prev, fresh);
+        prev = fresh;
+        if (i == lblock)
+            index = fresh;
+    }
+    return index;
+}
+
+/*write the index block holding the length of chunk @k*/
+static int zfile_store_index(file_node_class *node, int k) {
+    __uint16_t index_block[CHUNK_PER_INDEX_BLOCK];
+    int lblock = k / CHUNK_PER_INDEX_BLOCK;
+    int index = node_index_block(node, lblock);
+
+    if (index < 0)
+        return -1;
+
+    memset(index_block, 0, sizeof(index_block));
+    int first = lblock * CHUNK_PER_INDEX_BLOCK;
+    for (int i = first; i < node->chunk_count && i < first + (int) CHUNK_PER_INDEX_BLOCK; i++)
+        index_block[i - first] = node->chunk_len[i];
+    return data_block_write(index, index_block);
+}
+
+/*compress the pending chunk of @node and store it in place of the old one*/
+static int zfile_flush(file_node_class *node) {
+    if (!node->chunk_dirty)
+        return 0;
+
+    int k = node->chunk_cached;
+    char *plain = node->chunk_buf;
+    char *packed = node->chunk_buf + CHUNK_SIZE;
+    int valid = node->entry.size_of_file - k * CHUNK_SIZE;
+    if (valid > CHUNK_SIZE)
+        valid = CHUNK_SIZE;
+
+    /*keep the chunk raw unless compression saves at least one block*/
+    int valid_blocks = (valid + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int packed_len = valid_blocks > 1 ? lz_compress(plain, valid, packed, (valid_blocks - 1) * BLOCK_SIZE) : -1;
+    __uint16_t len = packed_len > 0 ? packed_len : CHUNK_RAW | valid;
+    const char *data = packed_len > 0 ? packed : plain;
+
+    if (k == node->chunk_count) {
+        if (zfile_reserve(node, k + 1))
+            return -1;
+        node->chunk_len[k] = 0;
+        node->chunk_start[k + 1] = node->chunk_start[k];
+        node->chunk_count++;
+    }
+
+    /*resize the chunk's run of blocks in the chain, which must not be shared*/
+    int old_blocks = chunk_blocks(node->chunk_len[k]);
+    int new_blocks = chunk_blocks(len);
+    int pos = node->chunk_start[k];
+    if (pos + old_blocks > 0 && node_unshare(node, pos + old_blocks - 1))
+        return -1;
+    if (new_blocks > old_blocks) {
+        __uint16_t extra[CHUNK_BLOCKS];
+        for (int i = 0; i < new_blocks - old_blocks; i++) {
+            int index = find_empty_data_block();
+            if (index < 0) {
+                while (i--)
+                    release_block(extra[i]);
+                return -1;
+            }
+            extra[i] = index;
+        }
+        if (node_chain_splice(node, pos + old_blocks, 0, extra, new_blocks - old_blocks))
+            return -1;
+    } else if (new_blocks < old_blocks) {
+        if (node_chain_splice(node, pos + new_blocks, old_blocks - new_blocks, NULL, 0))
+            return -1;
+    }
+
+    for (int i = 0; i < new_blocks; i++) {
+        if (data_block_write(node->chain[pos + i], data + i * BLOCK_SIZE))
+            return -1;
+    }
+
+    node->chunk_len[k] = len;
+    for (int j = k + 1; j <= node->chunk_count; j++)
+        node->chunk_start[j] += new_blocks - old_blocks;
+    if (zfile_store_index(node, k))
+        return -1;
+
+    node->chunk_dirty = false;
+    node->stored_size = node->entry.size_of_file;
+    return entry_store(&node->loc, &node->entry);
+}
+
+/*bring chunk @k of @node into its chunk buffer, unless it is overwritten whole*/
+static int zfile_fetch(file_node_class *node, int k, bool whole) {
+    if (node->chunk_cached == k)
+        return 0;
+    if (zfile_flush(node))
+        return -1;
+    node->chunk_cached = INVALID;
+
+    char *plain = node->chunk_buf;
+    char *packed = node->chunk_buf + CHUNK_SIZE;
+
+    if (whole || k >= node->chunk_count) {
+        memset(plain, 0, CHUNK_SIZE);
+        node->chunk_cached = k;
+        return 0;
+    }
+
+    __uint16_t len = node->chunk_len[k];
+    int pos = node->chunk_start[k];
+    char *dst = len & CHUNK_RAW ? plain : packed;
+    for (int i = 0; i < chunk_blocks(len); i++) {
+        if (data_block_read(node->chain[pos + i], dst + i * BLOCK_SIZE))
+            return -1;
+    }
+
+    int plain_len = len & ~CHUNK_RAW;
+    if (!(len & CHUNK_RAW) && (plain_len = lz_decompress(packed, len, plain, CHUNK_SIZE)) < 0)
+        return -1;
+    memset(plain + plain_len, 0, CHUNK_SIZE - plain_len);
+
+    node->chunk_cached = k;
+    return 0;
+}
+
+/*read from a compressed file, decompressing only the chunks touched*/
+static int zfile_read_at(file_node_class *node, size_t offset, void *buf, size_t count) {
+    if (zfile_load(node) || offset >= node->entry.size_of_file)
+        return 0;
+    if (count > node->entry.size_of_file - offset)
+        count = node->entry.size_of_file - offset;
+
+    size_t done = 0;
+    while (done < count) {
+        int k = (offset + done) / CHUNK_SIZE;
+        size_t chunk_offset = (offset + done) % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - chunk_offset;
+        if (n > count - done)
+            n = count - done;
+
+        if (zfile_fetch(node, k, false))
+            break;
+        memcpy((char *) buf + done, node->chunk_buf + chunk_offset, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * write to a compressed file; data collects in the chunk buffer and is
+ * compressed when the chunk is full, another chunk is needed, or the file
+ * is closed
+ */
+static int zfile_write_at(file_node_class *node, size_t offset, const void *buf, size_t count) {
+    if (zfile_load(node))
+        return -1;
+
+    size_t done = 0;
+    while (done < count) {
+        int k = (offset + done) / CHUNK_SIZE;
+        size_t chunk_offset = (offset + done) % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - chunk_offset;
+        if (n > count - done)
+            n = count - done;
+
+        if (zfile_fetch(node, k, n == CHUNK_SIZE))
+            break;
+        memcpy(node->chunk_buf + chunk_offset, (const char *) buf + done, n);
+        node->chunk_dirty = true;
+        done += n;
+        if (offset + done > node->entry.size_of_file)
+            node->entry.size_of_file = offset + done;
+
+        if (chunk_offset + n == CHUNK_SIZE && zfile_flush(node))
+            break;
+    }
+
+    /*out of space: drop what could not be stored*/
+    if (node->chunk_dirty && done < count) {
+        node->chunk_dirty = false;
+        node->chunk_cached = INVALID;
+        node->entry.size_of_file = node->stored_size;
+        done = node->stored_size > offset ? node->stored_size - offset : 0;
+        if (done > count)
+            done = count;
+    }
+    return done;
+}
+
+static int node_read_at(file_node_class *node, size_t offset, void *buf, size_t count);
+static void sfile_unload(file_node_class *node);
+
+/*rewrite the plain or sparse file @node in compressed form*/
+static int zfile_convert(file_node_class *node) {
+    file_node_class plain;
+    char *buf = malloc(CHUNK_SIZE);
+    int ret = 0;
+
+    /*chunks are not mapped by extents*/
+    if (node->entry.file_flags & FS_FLAG_EXTENT)
+        efile_drop(node);
+    root_entry_class plain_entry = node->entry;
+
+    /*read through a private node while the shared one is rebuilt*/
+    memset(&plain, 0, sizeof(plain));
+    plain.entry = plain_entry;
+    plain.chain_len = INVALID;
+
+    node->entry.file_flags = (node->entry.file_flags | FS_FLAG_COMPRESSED) & ~FS_FLAG_SPARSE;
+    node->entry.index_first_data_block = FAT_EOC;
+    node->entry.index_chunk_block = FAT_EOC;
+    node->entry.size_of_file = 0;
+    node->chain_len = 0;
+
+    for (size_t offset = 0; buf && offset < plain_entry.size_of_file; offset += CHUNK_SIZE) {
+        int n = node_read_at(&plain, offset, buf, CHUNK_SIZE);
+        if (n <= 0 || zfile_write_at(node, offset, buf, n) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (!buf || (!ret && zfile_flush(node)))
+        ret = -1;
+
+    /*keep whichever copy is complete and free the other*/
+    if (ret) {
+        node->chunk_dirty = false;
+        free_file(&node->entry);
+        node->entry = plain_entry;
+        free(node->chunk_buf);
+        node->chunk_buf = NULL;
+        node->chunk_cached = INVALID;
+        node->chunk_count = 0;
+    } else {
+        free_file(&plain_entry);
+    }
+    node->chain_len = INVALID;
+    sfile_unload(node);
+
+    free(plain.chain);
+    sfile_unload(&plain);
+    free(buf);
+    if (entry_store(&node->loc, &node->entry))
+        return -1;
+    return ret;
+}
+
+/*make the allocation map of @node cover logical block @lblock*/
+static int sfile_reserve(file_node_class *node, size_t lblock) {
+    int words = (lblock / SPARSE_PER_MAP_BLOCK + 1) * SPARSE_WORDS_PER_MAP_BLOCK;
+
+    if (words <= node->sparse_words)
+        return 0;
+
+    __uint64_t *map = realloc(node->sparse_map, words * sizeof(__uint64_t));
+    if (!map)
+        return -1;
+    node->sparse_map = map;
+
+    __uint32_t *rank = realloc(node->sparse_rank, (words + 1) * sizeof(__uint32_t));
+    if (!rank)
+        return -1;
+    node->sparse_rank = rank;
+
+    if (!node->sparse_words)
+        rank[0] = 0;
+    memset(map + node->sparse_words, 0, (words - node->sparse_words) * sizeof(__uint64_t));
+    for (int w = node->sparse_words; w < words; w++)
+        rank[w + 1] = rank[w];
+    node->sparse_words = words;
+    return 0;
+}
+
+/*recount the blocks allocated before every word of the map from word @from*/
+static void sfile_rerank(file_node_class *node, int from) {
+    for (int w = from; w < node->sparse_words; w++)
+        node->sparse_rank[w + 1] = node->sparse_rank[w] + __builtin_popcountll(node->sparse_map[w]);
+}
+
+static bool sfile_allocated(const file_node_class *node, size_t lblock) {
+    size_t w = lblock / SPARSE_WORD_BITS;
+
+    return w < (size_t) node->sparse_words && (node->sparse_map[w] >> (lblock % SPARSE_WORD_BITS) & 1);
+}
+
+/*position in the chain of logical block @lblock, or of the first block allocated after it*/
+static __uint32_t sfile_pos(const file_node_class *node, size_t lblock) {
+    size_t w = lblock / SPARSE_WORD_BITS;
+
+    if (w >= (size_t) node->sparse_words)
+        return node->sparse_rank[node->sparse_words];
+    __uint64_t below = (1ULL << (lblock % SPARSE_WORD_BITS)) - 1;
+    return node->sparse_rank[w] + __builtin_popcountll(node->sparse_map[w] & below);
+}
+
+static void sfile_unload(file_node_class *node) {
+    free(node->sparse_map);
+    free(node->sparse_rank);
+    node->sparse_map = NULL;
+    node->sparse_rank = NULL;
+    node->sparse_words = 0;
+}
+
+/*load the allocation map of sparse file @node on first use*/
+static int sfile_load(file_node_class *node) {
+    if (node->sparse_map)
+        return 0;
+
+    size_t blocks = (node->entry.size_of_file + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (node_chain_load(node) || sfile_reserve(node, blocks ? blocks - 1 : 0)) {
+        sfile_unload(node);
+        return -1;
+    }
+
+    __uint16_t index = node->entry.index_chunk_block;
+    for (int w = 0; w < node->sparse_words && index != FAT_EOC; w += SPARSE_WORDS_PER_MAP_BLOCK) {
+        if (data_block_read(index, node->sparse_map + w)) {
+            sfile_unload(node);
+            return -1;
+        }
+        index = fat_get(index);
+    }
+    sfile_rerank(node, 0);
+
+    /*the map must account for every block of the chain*/
+    if (node->sparse_rank[node->sparse_words] != (__uint32_t) node->chain_len) {
+        fprintf(stderr, "file '%s': allocation map does not match its chain\n", node->entry.file_name);
+        sfile_unload(node);
+        return -1;
+    }
+    return 0;
+}
+
+/*write block @j of the allocation map of @node*/
+static int sfile_store_map(file_node_class *node, int j) {
+    int index = node_index_block(node, j);
+
+    if (index < 0)
+        return -1;
+    return data_block_write(index, node->sparse_map + j * SPARSE_WORDS_PER_MAP_BLOCK);
+}
+
+/**
+ * write the blocks of the allocation map of @node covering logical blocks
+ * @first to @last, and the blocks missing before them, which are all zeroes
+ */
+static int sfile_store_range(file_node_class *node, size_t first, size_t last) {
+    size_t len = 0;
+
+    for (__uint16_t index = node->entry.index_chunk_block; index != FAT_EOC; index = fat_get(index))
+        len++;
+
+    size_t j = first / SPARSE_PER_MAP_BLOCK;
+    for (j = j < len ? j : len; j <= last / SPARSE_PER_MAP_BLOCK; j++) {
+        if (sfile_store_map(node, j))
+            return -1;
+    }
+    return 0;
+}
+
+/*switch the plain file @node to the sparse layout, all its blocks allocated*/
+static int sfile_convert(file_node_class *node) {
+    if (node_chain_load(node) || sfile_reserve(node, node->chain_len ? node->chain_len - 1 : 0)) {
+        sfile_unload(node);
+        return -1;
+    }
+
+    /*holes are not mapped by extents, the file goes on as a plain one if it cannot become sparse*/
+    bool extent = node->entry.file_flags & FS_FLAG_EXTENT;
+    if (extent)
+        efile_drop(node);
+
+    for (int i = 0; i < node->chain_len; i++)
+        node->sparse_map[i / SPARSE_WORD_BITS] |= 1ULL << (i % SPARSE_WORD_BITS);
+    sfile_rerank(node, 0);
+
+    node->entry.file_flags |= FS_FLAG_SPARSE;
+    node->entry.index_chunk_block = FAT_EOC;
+    if (sfile_store_range(node, 0, node->chain_len ? node->chain_len - 1 : 0)) {
+        free_chain(node->entry.index_chunk_block);
+        node->entry.index_chunk_block = FAT_EOC;
+        node->entry.file_flags &= ~FS_FLAG_SPARSE;
+        sfile_unload(node);
+        if (extent)
+            entry_store(&node->loc, &node->entry);
+        return -1;
+    }
+    return entry_store(&node->loc, &node->entry);
+}
+
+/*read from a sparse file, holes reading as zeroes without touching the disk*/
+static int sfile_read_at(file_node_class *node, size_t offset, void *buf, size_t count) {
+    if (sfile_load(node) || offset >= node->entry.size_of_file)
+        return 0;
+    if (count > node->entry.size_of_file - offset)
+        count = node->entry.size_of_file - offset;
+
+    char *buffer_ptr = buf;
+    char *temp_data_block = NULL;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t lblock = (offset + done) / BLOCK_SIZE;
+        size_t block_offset = (offset + done) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > count - done)
+            chunk = count - done;
+
+        if (!sfile_allocated(node, lblock)) {
+            memset(buffer_ptr + done, 0, chunk);
+            done += chunk;
+            continue;
+        }
+
+        /*runs of whole blocks adjacent on disk are read at once*/
+        __uint32_t pos = sfile_pos(node, lblock);
+        __uint16_t index = node->chain[pos];
+        size_t whole = block_offset ? 0 : (count - done) / BLOCK_SIZE;
+        if (whole > 1) {
+            size_t run = 1;
+            while (run < whole && sfile_allocated(node, lblock + run) && node->chain[pos + run] == index + run)
+                run++;
+            if (data_block_read_range(index, run, buffer_ptr + done))
+                break;
+            bcache_insert(index, run, buffer_ptr + done, node_cache_list(node));
+            done += run * BLOCK_SIZE;
+            continue;
+        }
+
+        if (chunk == BLOCK_SIZE) {
+            if (data_block_fetch(index, buffer_ptr + done, node_cache_list(node)))
+                break;
+        } else {
+            if (!temp_data_block && !(temp_data_block = buffer_get()))
+                break;
+            if (data_block_fetch(index, temp_data_block, node_cache_list(node)))
+                break;
+            memcpy(buffer_ptr + done, temp_data_block + block_offset, chunk);
+        }
+        done += chunk;
+    }
+
+    buffer_put(temp_data_block);
+    return done;
+}
+
+/**
+ * give blocks to the holes of @node between logical blocks @first and @last,
+ * splicing them in the chain at their position; return the first logical
+ * block left without one, @last + 1 if none
+ */
+static size_t sfile_fill(file_node_class *node, size_t first, size_t last) {
+    size_t lblock = first;
+
+    while (lblock <= last) {
+        if (sfile_allocated(node, lblock)) {
+            lblock++;
+            continue;
+        }
+
+        size_t need = 1;
+        while (need < SPARSE_RUN && lblock + need <= last && !sfile_allocated(node, lblock + need))
+            need++;
+
+        __uint16_t run[SPARSE_RUN];
+        int got;
+        int start = find_empty_run(need, &got);
+        if (start < 0)
+            break;
+        for (int i = 0; i < got; i++)
+            run[i] = start + i;
+        if (node_chain_splice(node, sfile_pos(node, lblock), 0, run, got)) {
+            for (int i = 0; i < got; i++)
+                release_block(run[i]);
+            break;
+        }
+
+        for (int i = 0; i < got; i++, lblock++)
+            node->sparse_map[lblock / SPARSE_WORD_BITS] |= 1ULL << (lblock % SPARSE_WORD_BITS);
+        sfile_rerank(node, (lblock - got) / SPARSE_WORD_BITS);
+    }
+    return lblock;
+}
+
+/*write to a sparse file, allocating the blocks of the holes written to*/
+static int sfile_write_at(file_node_class *node, size_t offset, const void *buf, size_t count) {
+    root_entry_class old_entry = node->entry;
+
+    if (!count)
+        return 0;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (offset + count - 1) / BLOCK_SIZE;
+    if (sfile_load(node) || sfile_reserve(node, last))
+        return -1;
+
+    /*shared blocks are copied up to the last one whose link may change*/
+    __uint32_t end = sfile_pos(node, last + 1);
+    if (end && node_unshare(node, end - 1))
+        return -1;
+
+    /*the partial blocks at both ends have nothing to read back if new*/
+    bool fresh_first = !sfile_allocated(node, first);
+    bool fresh_last = !sfile_allocated(node, last);
+
+    /*out of space: write up to the first hole left*/
+    __uint32_t allocated = node->sparse_rank[node->sparse_words];
+    size_t filled = sfile_fill(node, first, last);
+    if (filled <= last)
+        count = filled * BLOCK_SIZE > offset ? filled * BLOCK_SIZE - offset : 0;
+    if (node->sparse_rank[node->sparse_words] != allocated && sfile_store_range(node, first, last))
+        return -1;
+
+    const char *buffer_ptr = buf;
+    char *temp_data_block = buffer_get();
+    size_t written = 0;
+
+    while (written < count) {
+        size_t lblock = (offset + written) / BLOCK_SIZE;
+        size_t block_offset = (offset + written) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > count - written)
+            chunk = count - written;
+
+        /*every block of the range has its place in the chain now*/
+        __uint32_t pos = sfile_pos(node, lblock);
+        __uint16_t index = node->chain[pos];
+        size_t whole = block_offset ? 0 : (count - written) / BLOCK_SIZE;
+        if (whole > 1) {
+            size_t run = 1;
+            while (run < whole && node->chain[pos + run] == index + run)
+                run++;
+            if (data_block_write_range(index, run, buffer_ptr + written))
+                break;
+            written += run * BLOCK_SIZE;
+            continue;
+        }
+
+        if (chunk == BLOCK_SIZE) {
+            if (data_block_write(index, buffer_ptr + written))
+                break;
+        } else {
+            if ((lblock == first && fresh_first) || (lblock == last && fresh_last))
+                memset(temp_data_block, 0, BLOCK_SIZE);
+            else if (data_block_read(index, temp_data_block))
+                break;
+            memcpy(temp_data_block + block_offset, buffer_ptr + written, chunk);
+            if (data_block_write(index, temp_data_block))
+                break;
+        }
+        written += chunk;
+    }
+
+    if (offset + written > node->entry.size_of_file)
+        node->entry.size_of_file = offset + written;
+
+    buffer_put(temp_data_block);
+
+    if (memcmp(&old_entry, &node->entry, sizeof(old_entry)) && entry_store(&node->loc, &node->entry))
+        return -1;
+    return written;
+}
+
+/*grow compressed file @node with zeroes up to @offset, which pack to little*/
+static int zfile_extend(file_node_class *node, size_t offset) {
+    char *zero = buffer_get();
+    int ret = 0;
+
+    if (!zero)
+        return -1;
+    memset(zero, 0, CHUNK_SIZE);
+
+    while (node->entry.size_of_file < offset) {
+        size_t size = node->entry.size_of_file;
+        size_t n = CHUNK_SIZE - size % CHUNK_SIZE;
+        if (n > offset - size)
+            n = offset - size;
+        if (zfile_write_at(node, size, zero, n) != (int) n) {
+            ret = -1;
+            break;
+        }
+    }
+
+    buffer_put(zero);
+    return ret;
+}
+
+/**
+ * describe the chain map of the extent file @node as extents, and store them
+ * in its entry, or in its extent blocks when they do not fit there; extents
+ * that did not change are left alone
+ */
+static int efile_store(file_node_class *node) {
+    root_entry_class *entry = &node->entry;
+    int count = 0;
+
+    for (int i = 0; i < node->chain_len; i++)
+        count += !i || node->chain[i] != node->chain[i - 1] + 1;
+
+    /*extent blocks are written whole, zeroes after the last extent*/
+    extent_class *extent = calloc(count + EXTENT_PER_BLOCK, sizeof(extent_class));
+    __uint32_t *lblock = malloc((count + 1) * sizeof(__uint32_t));
+    if (!extent || !lblock) {
+        free(extent);
+        free(lblock);
+        return -1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < node->chain_len; i++) {
+        if (n && node->chain[i] == extent[n - 1].start + extent[n - 1].len) {
+            extent[n - 1].len++;
+            continue;
+        }
+        lblock[n] = i;
+        extent[n++] = (extent_class) {node->chain[i], 1};
+    }
+    lblock[n] = node->chain_len;
+
+    if (node->extent && node->extent_count == n && !memcmp(node->extent, extent, n * sizeof(extent_class))) {
+        free(extent);
+        free(lblock);
+        return 0;
+    }
+
+    int ret = 0;
+    if (n <= EXTENT_INLINE) {
+        if (entry->file_flags & FS_FLAG_EXTENT_TREE)
+            free_chain(entry->index_chunk_block);
+        entry->file_flags &= ~FS_FLAG_EXTENT_TREE;
+        memcpy(entry->extent, extent, sizeof(entry->extent));
+    } else {
+        if (!(entry->file_flags & FS_FLAG_EXTENT_TREE)) {
+            memset(entry->extent, 0, sizeof(entry->extent));
+            entry->index_chunk_block = FAT_EOC;
+            entry->file_flags |= FS_FLAG_EXTENT_TREE;
+        }
+        entry->extent_count = n;
+
+        int index = INVALID;
+        for (int j = 0; !ret && j * (int) EXTENT_PER_BLOCK < n; j++) {
+            index = node_index_block(node, j);
+            ret = index < 0 || data_block_write(index, extent + j * EXTENT_PER_BLOCK);
+        }
+
+        /*blocks a shorter list no longer needs are given back*/
+        __uint16_t rest = ret ? FAT_EOC : fat_get(index);
+        if (rest != FAT_EOC) {
+            fat_set(index, FAT_EOC);
+            free_chain(rest);
+        }
+    }
+
+    efile_unload(node);
+    if (ret) {
+        free(extent);
+        free(lblock);
+        return -1;
+    }
+    node->extent = extent;
+    node->extent_lblock = lblock;
+    node->extent_count = n;
+    node->extent_stale = false;
+    return 0;
+}
+
+/**
+ * store the extents of the extent file @node if its chain changed; extents
+ * that cannot be stored are dropped, leaving a plain file
+ */
+static int efile_flush(file_node_class *node) {
+    if (!(node->entry.file_flags & FS_FLAG_EXTENT) || node->chain_len < 0)
+        return 0;
+
+    root_entry_class old_entry = node->entry;
+    int ret = 0;
+    if (efile_store(node)) {
+        efile_drop(node);
+        ret = -1;
+    }
+    if (memcmp(&old_entry, &node->entry, sizeof(old_entry)) && entry_store(&node->loc, &node->entry))
+        return -1;
+    return ret;
+}
+
+/*switch the plain file @node to the extent layout*/
+static int efile_convert(file_node_class *node) {
+    if (node_chain_load(node))
+        return -1;
+
+    node->entry.file_flags |= FS_FLAG_EXTENT;
+    memset(node->entry.extent, 0, sizeof(node->entry.extent));
+    node->extent_stale = true;
+    if (efile_flush(node) || entry_store(&node->loc, &node->entry))
+        return -1;
+    return 0;
+}
+
+/*record again the extents of the closed extent file @entry at @loc, whose chain changed*/
+static int efile_rebuild(const entry_loc_class *loc, root_entry_class *entry) {
+    file_node_class node;
+    int ret = 0;
+
+    memset(&node, 0, sizeof(node));
+    node.loc = *loc;
+    node.entry = *entry;
+    node.chain_len = INVALID;
+    node.extent_stale = true;
+    if (node_chain_load(&node)) {
+        efile_drop(&node);
+        entry_store(loc, &node.entry);
+        ret = -1;
+    } else {
+        ret = efile_flush(&node);
+    }
+
+    *entry = node.entry;
+    free(node.chain);
+    efile_unload(&node);
+    return ret;
+}
+
+/*read from @node, whatever its layout*/
+static int node_read_at(file_node_class *node, size_t offset, void *buf, size_t count) {
+    if (node->entry.file_flags & FS_FLAG_COMPRESSED)
+        return zfile_read_at(node, offset, buf, count);
+    if (node->entry.file_flags & FS_FLAG_SPARSE)
+        return sfile_read_at(node, offset, buf, count);
+    return file_read_at(node, offset, buf, count);
+}
+
+/**
+ * write to @node, whatever its layout; writing past the blocks of a plain
+ * file leaves a hole, which makes it sparse
+ */
+static int node_write_at(file_node_class *node, size_t offset, const void *buf, size_t count) {
+    size_t size = node->entry.size_of_file;
+
+    /*sizes are stored on 32 bits*/
+    if (offset + count > UINT32_MAX)
+        return -1;
+
+    if (node->entry.file_flags & FS_FLAG_COMPRESSED) {
+        if (offset > size && zfile_extend(node, offset))
+            return -1;
+        return zfile_write_at(node, offset, buf, count);
+    }
+    if (!(node->entry.file_flags & FS_FLAG_SPARSE)) {
+        if (offset / BLOCK_SIZE <= (size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            return file_write_at(node, offset, buf, count);
+        if (sfile_convert(node))
+            return -1;
+    }
+    return sfile_write_at(node, offset, buf, count);
+}
+
+/*number of buffers from @iov[@first] small enough to be gathered in one chunk*/
+static int iov_run(const struct iovec *iov, int first, int iovcnt, size_t *len) {
+    int i = first;
+
+    *len = 0;
+    while (i < iovcnt && iov[i].iov_len < BLOCK_SIZE && *len + iov[i].iov_len <= CHUNK_SIZE)
+        *len += iov[i++].iov_len;
+    return i - first;
+}
+
+/**
+ * fill the buffers of @iov from @offset of @node; runs of small buffers are
+ * served by a single read into a staging chunk
+ */
+static int node_readv_at(file_node_class *node, size_t offset, const struct iovec *iov, int iovcnt) {
+    char *stage = NULL;
+    size_t done = 0;
+
+    for (int i = 0; i < iovcnt;) {
+        size_t len;
+        int run = iov_run(iov, i, iovcnt, &len);
+
+        if (run > 1) {
+            if (!stage && !(stage = buffer_get()))
+                break;
+            size_t n = node_read_at(node, offset + done, stage, len);
+            for (size_t used = 0; used < n; i++) {
+                size_t part = iov[i].iov_len < n - used ? iov[i].iov_len : n - used;
+                memcpy(iov[i].iov_base, stage + used, part);
+                used += part;
+            }
+            done += n;
+            if (n < len)
+                break;
+            continue;
+        }
+
+        size_t n = node_read_at(node, offset + done, iov[i].iov_base, iov[i].iov_len);
+        done += n;
+        if (n < iov[i].iov_len)
+            break;
+        i++;
+    }
+
+    buffer_put(stage);
+    return done;
+}
+
+/*write the buffers of @iov at @offset of @node, gathering small ones*/
+static int node_writev_at(file_node_class *node, size_t offset, const struct iovec *iov, int iovcnt) {
+    char *stage = NULL;
+    size_t done = 0;
+    int ret = 0;
+
+    for (int i = 0; i < iovcnt;) {
+        size_t len;
+        int run = iov_run(iov, i, iovcnt, &len);
+        const void *data = iov[i].iov_base;
+
+        if (run > 1) {
+            if (!stage && !(stage = buffer_get())) {
+                ret = -1;
+                break;
+            }
+            for (size_t used = 0; run--; i++) {
+                memcpy(stage + used, iov[i].iov_base, iov[i].iov_len);
+                used += iov[i].iov_len;
+            }
+            data = stage;
+        } else {
+            len = iov[i++].iov_len;
+        }
+
+        int n = node_write_at(node, offset + done, data, len);
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        done += n;
+        if ((size_t) n < len)
+            break;
+    }
+
+    buffer_put(stage);
+    return done || !ret ? (int) done : -1;
+}
+
+/**
+ * per-block tables (checksums, reference counts) are kept in memory like the
+ * FAT and stored in hidden chains of data blocks recorded in the superblock;
+ * their blocks are read and written raw, so they carry no checksum
+ */
+static int table_block_count(int per_block) {
+    return (super_block->data_block_count + per_block - 1) / per_block;
+}
+
+/*allocate a zeroed table of @count blocks, returning its first block*/
+static void *table_alloc(int count, __uint16_t *first) {
+    __uint16_t last = FAT_EOC;
+    void *table = calloc(count, BLOCK_SIZE);
+
+    *first = FAT_EOC;
+    for (int i = 0; table && i < count; i++) {
+        int index = find_empty_data_block();
+        if (index < 0) {
+            free_chain(*first);
+            free(table);
+            return NULL;
+        }
+        if (last == FAT_EOC)
+            *first = index;
+        else
+            fat_set(last, index);
+        last = index;
+    }
+    return table;
+}
+
+/*read the @count blocks of the table chain starting at @first*/
+static void *table_load(__uint16_t first, int count) {
+    char *table = malloc(count * BLOCK_SIZE);
+
+    for (int i = 0; table && i < count; i++) {
+        if (first == FAT_EOC || block_read(super_block->data_block_index + first, table + i * BLOCK_SIZE)) {
+            free(table);
+            return NULL;
+        }
+        first = fat_get(first);
+    }
+    return table;
+}
+
+static int table_store(__uint16_t first, const void *table, int count) {
+    for (int i = 0; i < count; i++) {
+        bcache_forget(first, 1);
+        if (block_write(super_block->data_block_index + first, (const char *) table + i * BLOCK_SIZE))
+            return -1;
+        first = fat_get(first);
+    }
+    return 0;
+}
+
+/*content index used by fs_dedup, keyed by block hash and successor*/
+typedef struct {
+    __uint32_t hash;
+    __uint16_t next;
+    __uint16_t block;
+} dedup_slot_class;
+
+typedef struct {
+    dedup_slot_class *slots;
+    __uint32_t mask;
+    __uint8_t *seen;
+    char *block;
+    char *other;
+    int saved;
+} dedup_class;
+
+/*start counting references to data blocks*/
+static int refcount_enable(void) {
+    __uint16_t first;
+
+    if (refcount_ptr)
+        return 0;
+    refcount_ptr = table_alloc(table_block_count(REFCOUNT_PER_BLOCK), &first);
+    if (!refcount_ptr)
+        return -1;
+    super_block->refcount_block = first;
+    super_block->features |= FS_FEATURE_REFCOUNT;
+    return 0;
+}
+
+/*add @index, whose content is in dedup->block, to the index*/
+static void dedup_insert(dedup_class *dedup, __uint16_t index) {
+    __uint32_t hash = crc32c(0, dedup->block, BLOCK_SIZE);
+    __uint32_t i = (hash ^ fat_get(index) * 2654435761u) & dedup->mask;
+
+    while (dedup->slots[i].block)
+        i = (i + 1) & dedup->mask;
+    dedup->slots[i].hash = hash;
+    dedup->slots[i].next = fat_get(index);
+    dedup->slots[i].block = index;
+    dedup->seen[index] = 1;
+}
+
+/**
+ * find a block holding the content of dedup->block and followed by @next;
+ * blocks whose count is saturated cannot be shared any further
+ */
+static __uint16_t dedup_find(dedup_class *dedup, __uint16_t next) {
+    __uint32_t hash = crc32c(0, dedup->block, BLOCK_SIZE);
+    __uint32_t i = (hash ^ next * 2654435761u) & dedup->mask;
+
+    for (; dedup->slots[i].block; i = (i + 1) & dedup->mask) {
+        dedup_slot_class *slot = &dedup->slots[i];
+        if (slot->hash != hash || slot->next != next || refcount_ptr[slot->block] == UINT16_MAX)
+            continue;
+        if (!data_block_read_range(slot->block, 1, dedup->other) && !memcmp(dedup->block, dedup->other, BLOCK_SIZE))
+            return slot->block;
+    }
+    return FAT_EOC;
+}
+
+/**
+ * share the blocks of @entry with identical ones already indexed
+ * FAT chains can only share their tails, so the chain is walked backwards
+ * and a block is merged only when its successor was merged as well
+ */
+static int dedup_file(dedup_class *dedup, root_entry_class *entry) {
+    int len = 0;
+    int cap = 16;
+    __uint16_t *chain = malloc(cap * sizeof(__uint16_t));
+
+    for (__uint16_t index = entry->index_first_data_block; chain && index != FAT_EOC; index = fat_get(index)) {
+        if (len == cap) {
+            __uint16_t *grown = realloc(chain, cap * 2 * sizeof(__uint16_t));
+            if (!grown)
+                break;
+            chain = grown;
+            cap *= 2;
+        }
+        chain[len++] = index;
+    }
+    if (!chain || (len && fat_get(chain[len - 1]) != FAT_EOC)) {
+        free(chain);
+        return -1;
+    }
+
+    /*the tail from the first shared block on is already canonical*/
+    int first = 0;
+    while (first < len && !refcount_ptr[chain[first]])
+        first++;
+    for (int i = first; i < len; i++) {
+        if (dedup->seen[chain[i]])
+            continue;
+        if (data_block_read_range(chain[i], 1, dedup->block)) {
+            free(chain);
+            return -1;
+        }
+        dedup_insert(dedup, chain[i]);
+    }
+
+    __uint16_t canon = first < len ? chain[first] : FAT_EOC;
+    for (int i = first - 1; i >= 0; i--) {
+        __uint16_t index = chain[i];
+
+        fat_set(index, canon);
+        /*on failure the chain is still whole from its old first block*/
+        if (data_block_read_range(index, 1, dedup->block)) {
+            free(chain);
+            return -1;
+        }
+
+        __uint16_t match = dedup_find(dedup, canon);
+        if (match == FAT_EOC) {
+            dedup_insert(dedup, index);
+            canon = index;
+            continue;
+        }
+
+        /*drop the copy and the link it held on its successor*/
+        refcount_ptr[match]++;
+        free_chain(index);
+        dedup->saved++;
+        canon = match;
+    }
+
+    entry->index_first_data_block = canon;
+    free(chain);
+    return 0;
+}
+
+/*deduplicate a closed, uncompressed file, or the files below a directory*/
+static int dedup_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    dedup_class *dedup = arg;
+
+    if (entry->file_type == FS_TYPE_DIR) {
+        dir_handle_class sub;
+        dir_handle_set(&sub, loc, entry);
+        return dir_walk(&sub, dedup_visit, dedup);
+    }
+    if ((entry->file_flags & FS_FLAG_COMPRESSED) || node_find(loc))
+        return 0;
+
+    root_entry_class old_entry = *entry;
+    int saved = dedup->saved;
+    if (dedup_file(dedup, entry))
+        return -1;
+    /*extent files record their new chain*/
+    if (dedup->saved != saved && (entry->file_flags & FS_FLAG_EXTENT) && efile_rebuild(loc, entry))
+        return -1;
+    if (memcmp(&old_entry, entry, sizeof(old_entry)) && entry_store(loc, entry))
+        return -1;
+    return 0;
+}
+
+/*fail on the first file open below a directory*/
+static int tree_busy_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    if (entry->file_type == FS_TYPE_DIR) {
+        dir_handle_class sub;
+        dir_handle_set(&sub, loc, entry);
+        return dir_walk(&sub, tree_busy_visit, arg);
+    }
+    return node_find(loc) ? -1 : 0;
+}
+
+/*drop the blocks of a file, or of a directory and everything below it*/
+static int tree_free_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    if (entry->file_type == FS_TYPE_DIR) {
+        dir_handle_class sub;
+        dir_handle_set(&sub, loc, entry);
+        dir_walk(&sub, tree_free_visit, arg);
+        free_chain(entry->index_first_data_block);
+        return 0;
+    }
+    free_file(entry);
+    return 0;
+}
+
+/**
+ * copy an entry into the snapshot directory @arg: files share their chains,
+ * directories are copied since their blocks change in place
+ */
+static int snapshot_copy_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    dir_handle_class *dst = arg;
+    root_entry_class copy = *entry;
+    entry_loc_class copy_loc;
+
+    if (entry->file_type == FS_TYPE_DIR) {
+        dir_handle_class src;
+        dir_handle_class sub;
+        dir_handle_set(&src, loc, entry);
+        if (dir_make(dst, (char *) entry->file_name, FS_FLAG_READONLY, &sub))
+            return -1;
+        return dir_walk(&src, snapshot_copy_visit, &sub);
+    }
+
+    copy.file_flags |= FS_FLAG_READONLY;
+    if (entry_share(entry))
+        return -1;
+    if (dir_insert(dst, &copy, &copy_loc)) {
+        free_file(&copy);
+        return -1;
+    }
+    return 0;
+}
+
+/*remove snapshot @name, whose files must all be closed*/
+static int snapshot_remove(dir_handle_class *snapshots, const char *name) {
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    if (dir_lookup(snapshots, name, &loc, &entry) || tree_busy_visit(&loc, &entry, NULL))
+        return -1;
+    tree_free_visit(&loc, &entry, NULL);
+    return dir_remove(&loc);
+}
+
+/*double the descriptor table and thread the new slots on the free list*/
+static int open_table_grow(void) {
+    int capacity = open_table->capacity ? open_table->capacity * 2 : FS_OPEN_MAX_COUNT;
+    open_file_class *files = realloc(open_table->open_files, capacity * sizeof(open_file_class));
+
+    if (!files)
+        return -1;
+
+    for (int i = capacity - 1; i >= open_table->capacity; --i) {
+        files[i].node = NULL;
+        files[i].offset = -1;
+        files[i].next_free = open_table->free_head;
+        open_table->free_head = i;
+    }
+    open_table->open_files = files;
+    open_table->capacity = capacity;
+    return 0;
+}
+
+/*release everything a mount holds, whether it completed or not*/
+static void mount_release(void) {
+    if (bcache)
+        pthread_mutex_destroy(&bcache->lock);
+    free(checksum_ptr);
+    free(refcount_ptr);
+    free(log_state.stuck);
+    memset(&log_state, 0, sizeof(log_state));
+    if (open_table) {
+        free(open_table->open_files);
+        free(open_table->buckets);
+    }
+    arena_destroy();
+    checksum_ptr = NULL;
+    refcount_ptr = NULL;
+    open_table = NULL;
+    super_block = NULL;
+    FAT_ptr = NULL;
+    root_block = NULL;
+    free_tree = NULL;
+    buffer_pool = NULL;
+    bcache = NULL;
+}
+
+static int mount_fail(void) {
+    mount_release();
+    block_disk_close();
+    return -1;
+}
+
+/*write the FAT blocks changed since they were read, the root, the tables and the superblock*/
+static int mount_sync(void) {
+    /*the open segment of the log goes with them*/
+    int ret = log_seal();
+
+    /*the FAT, root and superblock are adjacent: hold them back to write them at once*/
+    int plugged = block_plug() == 0;
+
+    for (int i = 0; i < super_block->FAT_block_count; ++i) {
+        if ((FAT_state[i] & FAT_BLOCK_DIRTY) && !(FAT_state[i] & FAT_BLOCK_BAD) &&
+            block_write(1+i,(char*)FAT_ptr+i*BLOCK_SIZE))
+            ret = -1;
+    }
+    if (block_write(super_block->root_block_index,root_block))
+        ret = -1;
+
+    if (refcount_ptr && table_store(super_block->refcount_block, refcount_ptr, table_block_count(REFCOUNT_PER_BLOCK)))
+        ret = -1;
+
+    /*metadata checksums live in the superblock*/
+    if (checksum_ptr) {
+        if (table_store(super_block->checksum_block, checksum_ptr, table_block_count(CHECKSUM_PER_BLOCK)))
+            ret = -1;
+        for (int i = 0; i < super_block->FAT_block_count; ++i) {
+            if ((FAT_state[i] & FAT_BLOCK_LOADED) && !(FAT_state[i] & FAT_BLOCK_BAD))
+                super_block->FAT_checksum[i] = crc32c(0, (char*)FAT_ptr + i*BLOCK_SIZE, BLOCK_SIZE);
+        }
+        super_block->root_checksum = crc32c(0, root_block, BLOCK_SIZE);
+    }
+
+    /*volumes that rewrite their superblock also keep the free counts there*/
+    if (super_block->features) {
+        FAT_unused_block();
+        memcpy(super_block->FAT_free, FAT_free_count, sizeof(FAT_free_count));
+        super_block->features |= FS_FEATURE_FREE_SUMMARY;
+        if (block_write(0, super_block))
+            ret = -1;
+    }
+
+    if (plugged && block_unplug())
+        ret = -1;
+
+    /*FAT blocks on disk are current until they change again*/
+    for (int i = 0; !ret && i < super_block->FAT_block_count; ++i)
+        FAT_state[i] &= ~FAT_BLOCK_DIRTY;
+    return ret;
+}
+
+/**
+ * write back what @only, or every open file when NULL, still holds in memory,
+ * and the metadata if the volume changed since the last time, then make it
+ * durable; runs with mount_lock and io_lock held
+ */
+static int mount_flush(file_node_class *only) {
+    int plugged = block_plug() == 0;
+    int ret = only ? node_flush(only) : 0;
+
+    for (int i = 0; !only && i < open_table->bucket_count; i++) {
+        for (file_node_class *node = open_table->buckets[i]; node; node = node->next) {
+            if (node_flush(node))
+                ret = -1;
+        }
+    }
+
+    __uint64_t gen = mount_gen;
+    bool changed = gen != mount_synced_gen;
+    if (changed && mount_sync())
+        ret = -1;
+    if (plugged && block_unplug())
+        ret = -1;
+
+    /*blocks written through since the last time are made durable as well*/
+    if (!ret && changed) {
+        ret = block_disk_sync();
+        if (!ret)
+            mount_synced_gen = gen;
+    }
+    return ret;
+}
+
+static int flusher_pass(void) {
+    return mount_flush(NULL);
+}
+
+/*writes back what changed, until fs_flush_interval() or fs_umount() stops it*/
+static worker_class flusher = {
+    .name = "flusher",
+    .pass = flusher_pass,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+int fs_mount(const char *diskname) {
+    super_block_class sb;
+
+    /* open the file */
+    if (block_disk_open(diskname))
+        return -1;
+
+
+    /*read super block*/
+    if (block_read(0, &sb) == -1 || memcmp((char *) sb.signature, "ECS150FS", 8) ||
+        sb.block_count != block_disk_count() || (sb.features & ~FS_FEATURE_ALL) ||
+        sb.FAT_block_count < 1 || sb.FAT_block_count > FAT_MAX_BLOCKS) {
+        block_disk_close();
+        return -1;
+    }
+    bool checked = sb.features & FS_FEATURE_CHECKSUM;
+
+    /*everything of a fixed size comes from the arena*/
+    size_t leaves = free_tree_leaves(sb.data_block_count);
+    size_t size = arena_size(sizeof(super_block_class)) + arena_size(BLOCK_SIZE * sb.FAT_block_count) +
+                  arena_size(sizeof(root_dir_class)) + arena_size(sizeof(free_tree_class)) +
+                  3 * arena_size(2 * leaves * sizeof(__uint32_t)) + arena_size(sizeof(user_define_open_file_table)) +
+                  arena_size(sizeof(buffer_pool_class)) + arena_size(BUFFER_POOL_COUNT * CHUNK_SIZE) +
+                  arena_size(sizeof(bcache_class)) + arena_size(BCACHE_BLOCKS * BLOCK_SIZE) +
+                  arena_size(sb.data_block_count * sizeof(__int16_t));
+    if (arena_init(size))
+        return mount_fail();
+    super_block = arena_alloc(sizeof(super_block_class));
+    *super_block = sb;
+
+    /*FAT blocks are read when first used*/
+    FAT_ptr = arena_alloc(BLOCK_SIZE * super_block->FAT_block_count);
+    memset(FAT_state, 0, sizeof(FAT_state));
+    mount_gen = 0;
+    mount_synced_gen = 0;
+    FAT_summary_valid = super_block->features & FS_FEATURE_FREE_SUMMARY;
+    if (FAT_summary_valid)
+        memcpy(FAT_free_count, super_block->FAT_free, sizeof(FAT_free_count));
+
+    /*index the free blocks*/
+    if (free_tree_build())
+        return mount_fail();
+
+    buffer_pool = arena_alloc(sizeof(buffer_pool_class));
+    buffer_pool->buffers = arena_alloc(BUFFER_POOL_COUNT * CHUNK_SIZE);
+    atomic_init(&buffer_pool->free_mask, (1u << BUFFER_POOL_COUNT) - 1);
+
+    /*file data read again is served from memory*/
+    if (bcache_init())
+        return mount_fail();
+
+    /*read root directory*/
+    root_block = arena_alloc(sizeof(root_dir_class));
+    if (block_read(super_block->root_block_index, root_block) == -1)
+        return mount_fail();
+    if (checked && super_block->root_checksum != crc32c(0, root_block, BLOCK_SIZE)) {
+        fprintf(stderr, "root directory: checksum mismatch\n");
+        return mount_fail();
+    }
+
+    /*read the per-block tables*/
+    if (checked && !(checksum_ptr = table_load(super_block->checksum_block, table_block_count(CHECKSUM_PER_BLOCK))))
+        return mount_fail();
+    if ((super_block->features & FS_FEATURE_REFCOUNT) &&
+        !(refcount_ptr = table_load(super_block->refcount_block, table_block_count(REFCOUNT_PER_BLOCK))))
+        return mount_fail();
+
+    //initialize open file table
+    open_table = arena_alloc(sizeof(user_define_open_file_table));
+    open_table->count = 0;
+    open_table->capacity = 0;
+    open_table->free_head = INVALID;
+    open_table->bucket_count = FS_OPEN_MAX_COUNT;
+    open_table->buckets = calloc(open_table->bucket_count, sizeof(file_node_class *));
+    if (!open_table->buckets || open_table_grow())
+        return mount_fail();
+
+    return 0;
+}
+
+int fs_umount(void) {
+    mount_lock_take();
+    io_lock_take(false);
+    bool busy = super_block == NULL || open_table->count > 0;
+    io_lock_drop();
+    mount_lock_drop();
+    if (busy)
+        return -1;
+
+    /*a pass takes the locks, so the workers stop before they are held*/
+    worker_stop(&flusher);
+    worker_stop(&cleaner);
+
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = mount_sync();
+
+    mount_release();
+
+    /*close the disk*/
+    if (block_disk_close() == -1)
+        ret = -1;
+    io_lock_drop();
+    mount_lock_drop();
+
+    return ret;
+}
+
+static int info_print(void) {
+    if (super_block == NULL) {
+        return -1;
+    }
+
+    printf("FS Info:\n");
+
+    int total_block = 1 + super_block->FAT_block_count + 1 + super_block->data_block_count;
+    printf("total_blk_count=%d\n", total_block);
+
+    printf("fat_blk_count=%d\n", super_block->FAT_block_count);
+
+    printf("rdir_blk=%d\n", super_block->root_block_index);
+
+    printf("data_blk=%d\n", super_block->data_block_index);
+
+    printf("data_blk_count=%d\n", super_block->data_block_count);
+
+    printf("fat_free_ratio=%d/%d\n", FAT_unused_block(), super_block->data_block_count);
+
+    printf("rdir_free_ratio=%d/%d\n", rdir_unused_block(), FS_FILE_MAX_COUNT);
+
+    return 0;
+}
+
+int fs_info(void) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = info_print();
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+/**
+ * resolve the parent directory of @path like resolve_parent(), reusing
+ * @parent as is when @prev, the path resolved last, names the same directory
+ */
+static int resolve_parent_again(const char *path, const char *prev, dir_handle_class *parent, char *leaf) {
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    size_t dir_len = slash ? (size_t) (slash - path + 1) : 0;
+    const char *name = path ? path + dir_len : NULL;
+
+    if (prev && path && *name && strlen(name) < FS_FILENAME_LEN && !strncmp(path, prev, dir_len) &&
+        prev[dir_len] && !strchr(prev + dir_len, '/')) {
+        strcpy(leaf, name);
+        return 0;
+    }
+    return resolve_parent(path, parent, leaf);
+}
+
+static int file_create(dir_handle_class *parent, const char *leaf) {
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    if (!dir_writable(parent, leaf))
+        return -1;
+
+    /*if the file have already existed*/
+    if (!dir_lookup(parent, leaf, &loc, &entry))
+        return -1;
+
+    memset(&entry, 0, sizeof(entry));
+    strcpy((char *) entry.file_name, leaf);
+    entry.size_of_file = 0;
+    entry.index_first_data_block = FAT_EOC;
+    entry.file_type = FS_TYPE_FILE;
+
+    /*fails if the root directory already contains 128 files*/
+    return dir_insert(parent, &entry, &loc);
+}
+
+int fs_create(const char *filename) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = resolve_parent(filename, &parent, leaf) ? -1 : file_create(&parent, leaf);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static int file_delete(dir_handle_class *parent, const char *leaf) {
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    if (parent->readonly)
+        return -1;
+
+    /*check if the file exist in the directory*/
+    if (dir_lookup(parent, leaf, &loc, &entry) || entry.file_type != FS_TYPE_FILE)
+        return -1;
+
+    /*check if open*/
+    if (is_open(&loc))
+        return -1;
+
+    free_file(&entry);
+    return dir_remove(&loc);
+}
+
+int fs_delete(const char *filename) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = resolve_parent(filename, &parent, leaf) ? -1 : file_delete(&parent, leaf);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+/**
+ * apply @op to every path of @paths: consecutive paths in the same directory
+ * share one resolution of it, and its blocks are written back once
+ */
+static int batch_apply(const char **paths, int count, int (*op)(dir_handle_class *, const char *)) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+    const char *prev = NULL;
+    int done = 0;
+
+    if (super_block == NULL || (count && !paths) || count < 0)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (resolve_parent_again(paths[i], prev, &parent, leaf)) {
+            prev = NULL;
+            continue;
+        }
+        prev = paths[i];
+        if (dir_batch_begin(parent.dir, parent.block_count)) {
+            prev = NULL;
+            continue;
+        }
+        if (!op(&parent, leaf))
+            done++;
+    }
+    if (dir_batch_end())
+        return -1;
+    return done;
+}
+
+int fs_create_many(const char **filenames, int count) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = batch_apply(filenames, count, file_create);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+int fs_delete_many(const char **filenames, int count) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = batch_apply(filenames, count, file_delete);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+int fs_mkdir(const char *dirname) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = resolve_parent(dirname, &parent, leaf) || !dir_writable(&parent, leaf) ? -1 :
+              dir_make(&parent, leaf, 0, NULL);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static int dir_delete(const char *dirname) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+    entry_loc_class loc;
+    root_entry_class entry;
+    dir_header_class header[DIR_ENTRY_PER_BLOCK];
+
+    if (resolve_parent(dirname, &parent, leaf) || parent.readonly)
+        return -1;
+    if (dir_lookup(&parent, leaf, &loc, &entry) || entry.file_type != FS_TYPE_DIR)
+        return -1;
+
+    /*only empty directories can go*/
+    if (data_block_read(entry.index_first_data_block, header) || header[0].entry_count)
+        return -1;
+
+    free_chain(entry.index_first_data_block);
+    return dir_remove(&loc);
+}
+
+int fs_rmdir(const char *dirname) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = dir_delete(dirname);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static void print_entry(const root_entry_class *entry) {
+    printf(entry->file_type == FS_TYPE_DIR ? "dir: " : "file: ");
+    printf("%s, ", entry->file_name);
+    printf("size: ");
+    printf("%d, ", entry->size_of_file);
+    printf("data_blk: ");
+    printf("%d \n", entry->index_first_data_block);
+}
+
+static int root_list(void) {
+    if (super_block == NULL) {
+        return -1;
+    }
+
+    printf("FS Ls:\n");
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (strcmp((char *) root_block->dic[i].file_name, "")) {
+            print_entry(&root_block->dic[i]);
+        }
+    }
+
+    return 0;
+}
+
+int fs_ls(void) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = root_list();
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static int dir_list(const char *dirname) {
+    dir_handle_class handle;
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+
+    if (super_block == NULL || resolve_dir(dirname, &handle))
+        return -1;
+
+    if (handle.dir == DIR_ROOT)
+        return root_list();
+
+    /*stream the table one block at a time*/
+    printf("FS Ls:\n");
+    __uint16_t index = handle.dir;
+    for (__uint32_t i = 0; i < handle.block_count && index != FAT_EOC; i++) {
+        if (data_block_read(index, block))
+            return -1;
+        for (__uint32_t j = i ? 0 : 1; j < DIR_ENTRY_PER_BLOCK; j++) {
+            if (!entry_is_free(&block[j]))
+                print_entry(&block[j]);
+        }
+        index = fat_get(index);
+    }
+
+    return 0;
+}
+
+int fs_lsdir(const char *dirname) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = dir_list(dirname);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+typedef struct readdir_class {
+    int (*visit)(const char *, int, int, void *);
+    void *arg;
+} readdir_class;
+
+static int readdir_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    readdir_class *readdir = arg;
+    (void) loc;
+    return readdir->visit((char *) entry->file_name, entry->size_of_file, entry->file_type == FS_TYPE_DIR,
+                          readdir->arg);
+}
+
+int fs_readdir(const char *dirname, int (*visit)(const char *name, int size, int is_dir, void *arg), void *arg) {
+    dir_handle_class handle;
+    readdir_class readdir = { visit, arg };
+
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = super_block == NULL || visit == NULL || resolve_dir(dirname, &handle) ? -1 :
+              dir_walk(&handle, readdir_visit, &readdir);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static int file_open(const char *filename) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+    entry_loc_class loc;
+    root_entry_class entry;
+
+    /*if the file is invalid*/
+    if (resolve_parent(filename, &parent, leaf))
+        return -1;
+
+    /*if the file in the directory*/
+    if (dir_lookup(&parent, leaf, &loc, &entry) || entry.file_type != FS_TYPE_FILE)
+        return -1;
+
+    /*grow the table when every descriptor is taken*/
+    if (open_table->free_head == INVALID && open_table_grow())
+        return -1;
+
+    file_node_class *node = node_get(&loc, &entry);
+    if (!node)
+        return -1;
+
+    /*put the file into the open_files_array*/
+    int file_dis = open_table->free_head;
+    open_file_class *file = &open_table->open_files[file_dis];
+    open_table->free_head = file->next_free;
+    file->node = node;
+    file->offset = 0;
+    open_table->count++;
+
+    return file_dis;
+}
+
+int fs_open(const char *filename) {
+    mount_lock_take();
+    io_lock_take(false);
+    int fd = file_open(filename);
+    io_lock_drop();
+    mount_lock_drop();
+    return fd;
+}
+
+int fs_close(int fd) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+
+    //if a file is never be opened it should not be closed
+    if (!file) {
+        io_lock_drop();
+        return -1;
+    }
+
+    int ret = node_put(file->node);
+    file->node = NULL;
+    file->offset = -1;
+    file->next_free = open_table->free_head;
+    open_table->free_head = fd;
+    open_table->count --;
+
+    io_lock_drop();
+    return ret;
+
+}
+
+int fs_stat(int fd) {
+    io_lock_take(true);
+    open_file_class *file = get_open_file(fd);
+    int size = file ? (int) file->node->entry.size_of_file : -1;
+    io_lock_drop();
+
+    return size;
+}
+
+int fs_lseek(int fd, size_t offset) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = 0;
+
+    //fd is invalid, or offset is too big for a descriptor
+    if (!file || offset > INT32_MAX)
+        ret = -1;
+    else
+        file->offset = offset;
+
+    io_lock_drop();
+    return ret;
+}
+
+int fs_seek(int fd, size_t offset, int whence) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = -1;
+
+    if (file && (whence == FS_SEEK_DATA || whence == FS_SEEK_HOLE) && offset < file->node->entry.size_of_file) {
+        file_node_class *node = file->node;
+        size_t size = node->entry.size_of_file;
+        bool data = whence == FS_SEEK_DATA;
+
+        /*only sparse files have holes before their end*/
+        if (!(node->entry.file_flags & FS_FLAG_SPARSE)) {
+            ret = data ? offset : size;
+        } else if (!sfile_load(node)) {
+            size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            size_t lblock = offset / BLOCK_SIZE;
+            while (lblock < blocks && sfile_allocated(node, lblock) != data)
+                lblock++;
+            if (lblock == blocks)
+                ret = data ? -1 : (int) size;
+            else if (lblock == offset / BLOCK_SIZE)
+                ret = offset;
+            else
+                ret = lblock * BLOCK_SIZE < size ? lblock * BLOCK_SIZE : size;
+        }
+    }
+    if (ret >= 0)
+        file->offset = ret;
+
+    io_lock_drop();
+    return ret;
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = -1;
+
+    if (file && advice >= FS_ADVISE_NORMAL && advice <= FS_ADVISE_NOREUSE) {
+        file_node_class *node = file->node;
+        size_t size = node->entry.size_of_file;
+        ret = 0;
+
+        if (advice != FS_ADVISE_WILLNEED && advice != FS_ADVISE_DONTNEED) {
+            node->advice = advice;
+            node->ra_window = 0;
+        } else if (offset < size && !(node->entry.file_flags & FS_FLAG_INDEXED) && !node_chain_load(node)) {
+            /*indexed files keep their blocks in their own order, and are left alone*/
+            size_t first = offset / BLOCK_SIZE;
+            size_t last = (len && len < size - offset ? offset + len - 1 : size - 1) / BLOCK_SIZE;
+
+            /*prefetching takes half of the block cache at most*/
+            if (advice == FS_ADVISE_WILLNEED) {
+                if (last - first >= BCACHE_BLOCKS / 2)
+                    last = first + BCACHE_BLOCKS / 2 - 1;
+                node_prefetch(node, first, last, node_cache_list(node));
+            } else {
+                for (size_t lblock = first; lblock <= last; lblock++)
+                    bcache_forget(node->chain[lblock], 1);
+                node->ra_end = node->ra_next;
+            }
+        }
+    }
+
+    io_lock_drop();
+    return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int written = 0;
+
+    /*check if the fd is valid, files of snapshots are read-only*/
+    if (!file || (file->node->entry.file_flags & FS_FLAG_READONLY))
+        written = -1;
+    else if (count)
+        written = node_write_at(file->node, file->offset, buf, count);
+    if (written > 0)
+        file->offset += written;
+
+    io_lock_drop();
+    return written;
+}
+
+
+int fs_read(int fd, void *buf, size_t count) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int real_read_size = -1;
+
+    if (file) {
+        real_read_size = node_read_at(file->node, file->offset, buf, count);
+        file->offset += real_read_size;
+    }
+
+    io_lock_drop();
+    return real_read_size;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset) {
+    io_lock_take(true);
+    open_file_class *file = get_open_file(fd);
+
+    if (!file) {
+        io_lock_drop();
+        return -1;
+    }
+
+    /*reading a plain or sparse file through its loaded maps changes nothing*/
+    file_node_class *node = file->node;
+    if (!(node->entry.file_flags & FS_FLAG_COMPRESSED) && node->chain_len >= 0 &&
+        (!(node->entry.file_flags & FS_FLAG_SPARSE) || node->sparse_map)) {
+        int ret = node_read_at(node, offset, buf, count);
+        io_lock_drop();
+        return ret;
+    }
+    io_lock_drop();
+
+    /*otherwise caches are filled, and that takes the lock alone*/
+    io_lock_take(false);
+    file = get_open_file(fd);
+    int ret = file ? node_read_at(file->node, offset, buf, count) : -1;
+    io_lock_drop();
+    return ret;
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int written = 0;
+
+    if (!file || (file->node->entry.file_flags & FS_FLAG_READONLY))
+        written = -1;
+    else if (count)
+        written = node_write_at(file->node, offset, buf, count);
+
+    io_lock_drop();
+    return written;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = -1;
+
+    if (file && iov && iovcnt >= 0) {
+        ret = node_readv_at(file->node, file->offset, iov, iovcnt);
+        file->offset += ret;
     }
-    return -1;
+
+    io_lock_drop();
+    return ret;
 }
 
-/*free fat block when delete a file*/
-void free_fat_block(int index) {
+int fs_writev(int fd, const struct iovec *iov, int iovcnt) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = -1;
 
-    int index_first_fat_block = root_block->dic[index].index_first_data_block;
+    if (file && iov && iovcnt >= 0 && !(file->node->entry.file_flags & FS_FLAG_READONLY))
+        ret = node_writev_at(file->node, file->offset, iov, iovcnt);
+    if (ret > 0)
+        file->offset += ret;
 
-    while (FAT_ptr[index_first_fat_block] != FAT_EOC) {
-        int temp = FAT_ptr[index_first_fat_block];
-        FAT_ptr[index_first_fat_block] = 0;
-        index_first_fat_block = temp;
-    }
-    FAT_ptr[index_first_fat_block] = 0;
+    io_lock_drop();
+    return ret;
 }
 
-int fs_mount(const char *diskname) {
-     
-    /* open the file */
-    if (block_disk_open(diskname))
-        return -1;
+int fs_compress(int fd) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = 0;
 
+    if (!file || (file->node->entry.file_flags & FS_FLAG_READONLY))
+        ret = -1;
+    else if (!(file->node->entry.file_flags & FS_FLAG_COMPRESSED))
+        ret = zfile_convert(file->node);
 
-    /*read super block*/
-    
-    super_block = malloc(sizeof(struct super_block_class));
-    if (block_read(0, super_block) == -1)
-        return -1;
-    if (memcmp((char *) super_block->signature, "ECS150FS",8) || super_block->block_count != block_disk_count()) {
-        free(super_block);
-        return -1;
-    }
+    io_lock_drop();
+    return ret;
+}
 
-    /*read FAT*/
-    FAT_ptr = malloc(BLOCK_SIZE * super_block->FAT_block_count);
-    
-    for (int i = 0; i < super_block->FAT_block_count; ++i) {
-        if(block_read(i+1, (char*)FAT_ptr + i*BLOCK_SIZE) == -1){
-            return -1;
-        }
-    }
-     
-    /*read root directory*/
-    root_block = malloc(sizeof(struct root_dir_class));
-    if (block_read(super_block->root_block_index, root_block) == -1)
-        return -1;
+int fs_extent(int fd) {
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = 0;
 
-    //initialize open file table
-    open_table = malloc(sizeof(user_define_open_file_table));
-    open_table->count = 0;
-    for (int i = 0; i < 30; ++i) {
-        open_table->open_files[i].offset = -1;
-        open_table->open_files[i].root_entry_index = INVALID_INDEX;
-    }
-     
-    return 0;
+    if (!file || (file->node->entry.file_flags & (FS_FLAG_READONLY | FS_FLAG_INDEXED)))
+        ret = -1;
+    else if (!(file->node->entry.file_flags & FS_FLAG_EXTENT))
+        ret = efile_convert(file->node);
+
+    io_lock_drop();
+    return ret;
 }
 
-int fs_umount(void) {
+int fs_fsync(int fd) {
+    mount_lock_take();
+    io_lock_take(false);
+    open_file_class *file = get_open_file(fd);
+    int ret = file ? mount_flush(file->node) : -1;
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
 
-    if (super_block == NULL){
+int fs_flush_interval(unsigned int interval) {
+    if (super_block == NULL)
         return -1;
-    }
 
-    if(open_table->count > 0){
-        return -1;
-    }
-    
-    for (int i = 0; i < super_block->FAT_block_count; ++i) {
-        block_write(1+i,(char*)FAT_ptr+i*BLOCK_SIZE);
+    worker_stop(&flusher);
+    return interval ? worker_start(&flusher, interval) : 0;
+}
+
+typedef struct log_clean_class {
+    /*blocks of the segment being emptied*/
+    int first;
+    int end;
+    char *block;
+} log_clean_class;
+
+/*move the blocks a file has in the segment being emptied to the log*/
+static int log_clean_visit(const entry_loc_class *loc, root_entry_class *entry, void *arg) {
+    log_clean_class *clean = arg;
+
+    if (entry->file_type == FS_TYPE_DIR) {
+        dir_handle_class sub;
+        dir_handle_set(&sub, loc, entry);
+        return dir_walk(&sub, log_clean_visit, clean);
     }
-    block_write(super_block->root_block_index,root_block);
+    if (entry->file_flags & LOG_IN_PLACE)
+        return 0;
 
-    free(super_block);
-    free(FAT_ptr);
-    free(root_block);
+    /*open files are moved through their node, which holds their latest entry*/
+    file_node_class *node = node_find(loc);
+    if (node)
+        entry = &node->entry;
 
-    /*close the disk*/
-    if (block_disk_close() == -1)
+    __uint16_t head = entry->index_first_data_block;
+    __uint16_t prev = FAT_EOC;
+    size_t lblock = 0;
+    for (__uint16_t index = head; index != FAT_EOC; prev = index, index = fat_get(index), lblock++) {
+        /*the rest of the chain is shared with other files*/
+        if (refcount_ptr && refcount_ptr[index])
+            break;
+        if (index < clean->first || index >= clean->end || data_block_read(index, clean->block))
+            continue;
+
+        int moved = log_move(node, entry, lblock, prev, index);
+        if (moved < 0)
+            return -1;
+        /*the block stays out of the log until the segment is empty*/
+        free_tree_set(index, false);
+        index = moved;
+        if (data_block_write(index, clean->block))
+            return -1;
+    }
+
+    if (entry->index_first_data_block != head && entry_store(loc, entry))
         return -1;
-    
     return 0;
 }
 
-int fs_info(void) {
-    if (super_block == NULL) {
-        return -1;
+/**
+ * take back sparse segments until LOG_CLEAN_RESERVE of them are free, moving
+ * the blocks of files they hold to the log; the segments no file block can be
+ * moved from are left alone until their use changes
+ */
+static int log_clean(void) {
+    __uint32_t segment = log_state.segment;
+    int count = super_block->data_block_count;
+    log_clean_class clean;
+    int ret = 0;
+
+    for (int b = 0; b < super_block->FAT_block_count; b++) {
+        if (!(FAT_state[b] & FAT_BLOCK_LOADED))
+            fat_fault(b);
     }
+    clean.block = buffer_get();
 
-    printf("FS Info:\n");
+    /*a pass empties at most as many segments as the volume holds*/
+    for (int round = 0; segment && round * segment < (__uint32_t) count; round++) {
+        int free_count = 0;
+        int victim = -1;
+        __uint32_t victim_live = 0;
 
-    int total_block = 1 + super_block->FAT_block_count + 1 + super_block->data_block_count;
-    printf("total_blk_count=%d\n", total_block);
+        for (int first = 0; first < count; first += segment) {
+            int end = first + (int) segment < count ? first + (int) segment : count;
+            __uint32_t live = 0;
+            for (int i = first; i < end; i++)
+                live += !i || FAT_ptr[i] != 0;
 
-    printf("fat_blk_count=%d\n", super_block->FAT_block_count);
+            if (!live)
+                free_count++;
+            else if (live * 100 <= (__uint32_t) (end - first) * LOG_CLEAN_LIVE && log_state.stuck[first / segment] != live &&
+                     (log_state.head + (int) log_state.left <= first || log_state.head >= end) &&
+                     (victim < 0 || live < victim_live)) {
+                victim = first;
+                victim_live = live;
+            }
+        }
+        if (free_count >= LOG_CLEAN_RESERVE || victim < 0)
+            break;
 
-    printf("rdir_blk=%d\n", super_block->root_block_index);
+        /*keep the log out of the segment while it is emptied*/
+        clean.first = victim;
+        clean.end = victim + (int) segment < count ? victim + (int) segment : count;
+        for (int i = clean.first; i < clean.end; i++) {
+            if (i && FAT_ptr[i] == 0)
+                free_tree_set(i, false);
+        }
+        dir_handle_class root;
+        dir_handle_root(&root);
+        ret = dir_walk(&root, log_clean_visit, &clean);
+        free_tree_fill(clean.first, clean.end - clean.first);
+        if (ret)
+            break;
 
-    printf("data_blk=%d\n", super_block->data_block_index);
+        __uint32_t live = 0;
+        for (int i = clean.first; i < clean.end; i++)
+            live += !i || FAT_ptr[i] != 0;
+        log_state.stuck[victim / segment] = live;
+    }
 
-    printf("data_blk_count=%d\n", super_block->data_block_count);
+    buffer_put(clean.block);
+    return ret;
+}
 
-    printf("fat_free_ratio=%d/%d\n", FAT_unused_block(), super_block->data_block_count);
+int fs_log(unsigned int segment_blocks) {
+    if (super_block == NULL || segment_blocks > LOG_SEGMENT_MAX ||
+        segment_blocks > (unsigned int) super_block->data_block_count)
+        return -1;
 
-    printf("rdir_free_ratio=%d/%d\n", rdir_unused_block(), FS_FILE_MAX_COUNT);
+    worker_stop(&cleaner);
+    mount_lock_take();
+    io_lock_take(false);
 
-    return 0;
+    int ret = log_seal();
+    free(log_state.stuck);
+    memset(&log_state, 0, sizeof(log_state));
+    if (segment_blocks) {
+        int segments = (super_block->data_block_count + segment_blocks - 1) / segment_blocks;
+        log_state.stuck = calloc(segments, sizeof(__uint16_t));
+        if (!log_state.stuck || worker_start(&cleaner, LOG_CLEAN_INTERVAL))
+            ret = -1;
+        else
+            log_state.segment = segment_blocks;
+    }
+
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
 }
 
-int fs_create(const char *filename) {
-    if (!strcmp(filename, "")) {
+static int checksum_enable(void) {
+    if (super_block == NULL)
         return -1;
-    }
+    if (checksum_ptr)
+        return 0;
 
-    if (strlen(filename) > FS_FILENAME_LEN) {
+    /*the checksum chain comes out of the data blocks*/
+    __uint16_t first;
+    __uint32_t *checksums = table_alloc(table_block_count(CHECKSUM_PER_BLOCK), &first);
+    char *block = malloc(BLOCK_SIZE);
+    if (!checksums || !block) {
+        if (checksums)
+            free_chain(first);
+        free(checksums);
+        free(block);
         return -1;
     }
-   
-    /*if the file have already existed*/
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (!strcmp((char *) root_block->dic[i].file_name, filename)) {
+
+    /*checksum every block in use, except those of the chain itself*/
+    for (int i = 1; i < super_block->data_block_count; i++) {
+        if (fat_get(i) == 0)
+            continue;
+        if (data_block_read_range(i, 1, block)) {
+            free(checksums);
+            free(block);
+            free_chain(first);
             return -1;
         }
+        checksums[i] = crc32c(0, block, BLOCK_SIZE);
     }
-    
-    /*if the directory contains more than 128 files*/
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++){
-        if (!strcmp(root_block->dic[i].file_name, "")){
-            break;
-        } else if (i == 127)
-            return -1;
-    }
+    for (__uint16_t index = first; index != FAT_EOC; index = fat_get(index))
+        checksums[index] = 0;
+    free(block);
 
-    /*find the first empty entry */
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (!strcmp(root_block->dic[i].file_name, "")) {
-            strcpy((char *) root_block->dic[i].file_name, filename);
-            root_block->dic[i].size_of_file = 0;
-            root_block->dic[i].index_first_data_block = FAT_EOC;
-            return 0;
-        }
-        
-    }
+    checksum_ptr = checksums;
+    super_block->checksum_block = first;
+    super_block->features |= FS_FEATURE_CHECKSUM;
+    return 0;
+}
 
-    return -1;
+int fs_checksum(void) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = checksum_enable();
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
 }
 
-int fs_delete(const char *filename) {
+int fs_scrub(int rate) {
+    mount_lock_take();
+    char *block = super_block && checksum_ptr ? malloc(BLOCK_SIZE) : NULL;
+    struct timespec start;
+    int bad = 0;
+    int done = 0;
 
-    if (filename == NULL) {
+    if (!block) {
+        mount_lock_drop();
         return -1;
     }
 
-    /*check if open*/
-    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-        if (!strcmp(root_block->dic[open_table->open_files[i].root_entry_index].file_name,filename)){
-            return -1;
-        }
+    /*the whole FAT is read first, so checking a block only reads shared state*/
+    io_lock_take(false);
+    for (int b = 0; b < super_block->FAT_block_count; b++) {
+        if (!(FAT_state[b] & FAT_BLOCK_LOADED))
+            fat_fault(b);
     }
+    io_lock_drop();
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    /*check if the file exist in the directory*/
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (!strcmp((char *) root_block->dic[i].file_name, filename)) {
-            strcpy(root_block->dic[i].file_name, "");
-            root_block->dic[i].size_of_file = 0;
-
-            free_fat_block(i);
-
-            root_block->dic[i].index_first_data_block = FAT_EOC;
-            break;
+    /*every block of every chain, in disk order, from the disk itself*/
+    for (int i = 1; i < super_block->data_block_count; i++) {
+        /*writers must not move the block or its checksum while it is checked*/
+        io_lock_take(true);
+        bool used = fat_get(i) != 0 && checksum_ptr[i] != 0;
+        if (used && data_block_read_range(i, 1, block))
+            bad++;
+        io_lock_drop();
+        if (!used)
+            continue;
 
+        /*after @rate blocks, wait for the rest of the second*/
+        if (rate > 0 && ++done % rate == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec;
+            if (elapsed < 1000000000L) {
+                /*others, the flusher among them, get the volume meanwhile*/
+                struct timespec pause = { 0, 1000000000L - elapsed };
+                mount_lock_drop();
+                nanosleep(&pause, NULL);
+                mount_lock_take();
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
         }
-
-        if (i == 127)
-            return -1;
     }
-    return 0;
+
+    free(block);
+    mount_lock_drop();
+    return bad;
 }
 
-int fs_ls(void) {
-    if (super_block == NULL) {
+static int dedup_run(void) {
+    dir_handle_class root;
+    dir_handle_class snapshots;
+    dedup_class dedup;
+    __uint32_t size = 1;
+
+    if (super_block == NULL || refcount_enable())
         return -1;
-    }
 
-    printf("FS Ls:\n");
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp((char *) root_block->dic[i].file_name, "")) {
-            printf("file: ");
-            printf("%s, ", root_block->dic[i].file_name);
-            printf("size: ");
-            printf("%d, ", root_block->dic[i].size_of_file);
-            printf("data_blk: ");
-            printf("%d \n", root_block->dic[i].index_first_data_block);
-        }
-    }
+    /*keep the index at most half full*/
+    while (size < (__uint32_t) super_block->data_block_count * 2)
+        size *= 2;
+    memset(&dedup, 0, sizeof(dedup));
+    dedup.slots = calloc(size, sizeof(dedup_slot_class));
+    dedup.mask = size - 1;
+    dedup.seen = calloc(super_block->data_block_count, 1);
+    dedup.block = malloc(BLOCK_SIZE);
+    dedup.other = malloc(BLOCK_SIZE);
 
-    return 0;
+    /*snapshot files are indexed too, so live files can merge with them*/
+    dir_handle_root(&root);
+    int ret = -1;
+    if (dedup.slots && dedup.seen && dedup.block && dedup.other && !dir_walk(&root, dedup_visit, &dedup) &&
+        (snapshot_dir_handle(&snapshots, false) || !dir_walk(&snapshots, dedup_visit, &dedup)))
+        ret = dedup.saved;
+
+    free(dedup.slots);
+    free(dedup.seen);
+    free(dedup.block);
+    free(dedup.other);
+    return ret;
 }
 
-int fs_open(const char *filename) {
-    
-    /*if the file is invalid*/
-    if (!filename)
+int fs_dedup(void) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = dedup_run();
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
+
+static int file_clone(const char *src, const char *dst) {
+    dir_handle_class parent;
+    char leaf[FS_FILENAME_LEN];
+    entry_loc_class loc;
+    root_entry_class entry;
+    root_entry_class copy;
+
+    if (super_block == NULL || resolve_parent(src, &parent, leaf))
         return -1;
-   
-    /*if the file in the directory*/
-    int index_in_root = 0;
-    for (; index_in_root < FS_FILE_MAX_COUNT; index_in_root++) {
-        if (!strcmp((char *) root_block->dic[index_in_root].file_name, filename))
-            break;
-        if (index_in_root == 127)
+    if (dir_lookup(&parent, leaf, &loc, &entry) || entry.file_type != FS_TYPE_FILE)
+        return -1;
+
+    /*an open file may have a chunk or extents waiting to be written back*/
+    file_node_class *node = node_find(&loc);
+    if (node) {
+        if (zfile_flush(node) || efile_flush(node))
             return -1;
+        entry = node->entry;
     }
-    
-    //to add length check later.
 
-    /*if the open files excess the max*/
-    if (open_table->count >= FS_OPEN_MAX_COUNT)
+    if (resolve_parent(dst, &parent, leaf) || !dir_writable(&parent, leaf))
+        return -1;
+    if (!dir_lookup(&parent, leaf, &loc, &copy))
+        return -1;
+    if (refcount_enable() || entry_share(&entry))
+        return -1;
+
+    copy = entry;
+    memset(copy.file_name, 0, FS_FILENAME_LEN);
+    strcpy((char *) copy.file_name, leaf);
+    copy.file_flags &= ~FS_FLAG_READONLY;
+    if (dir_insert(&parent, &copy, &loc)) {
+        free_file(&copy);
         return -1;
+    }
+    return 0;
+}
 
+int fs_clone(const char *src, const char *dst) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = file_clone(src, dst);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
 
-   
-    /*put the file into the open_files_array*/
+static int snapshot_take(const char *name) {
+    dir_handle_class root;
+    dir_handle_class snapshots;
+    dir_handle_class snapshot;
 
-    int file_dis = -1;
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-        if (open_table->open_files[i].root_entry_index == INVALID_INDEX) {
-            open_table->open_files[i].offset = 0;
-            open_table->open_files[i].root_entry_index = index_in_root;
-            open_table->count++;
-            file_dis = i;
-            break;
+    if (super_block == NULL || !name || !*name || strlen(name) >= FS_FILENAME_LEN - 1)
+        return -1;
+    if (refcount_enable())
+        return -1;
+
+    /*pending chunks of open compressed files and extents of open files go to disk first*/
+    for (int i = 0; i < open_table->bucket_count; i++) {
+        for (file_node_class *node = open_table->buckets[i]; node; node = node->next) {
+            if (zfile_flush(node) || efile_flush(node))
+                return -1;
         }
     }
-    return file_dis;
-}
 
-int fs_close(int fd) {
-    if (fd > FS_OPEN_MAX_COUNT || fd < 0) {
+    if (snapshot_dir_handle(&snapshots, true) || dir_make(&snapshots, name, FS_FLAG_READONLY, &snapshot))
         return -1;
-    }
 
-    //if a file is never be opened it should not be closed
-    if (open_table->open_files[fd].offset == -1) {
-        // not initialized
+    dir_handle_root(&root);
+    if (dir_walk(&root, snapshot_copy_visit, &snapshot)) {
+        snapshot_remove(&snapshots, name);
         return -1;
     }
+    return 0;
+}
 
-    open_table->open_files[fd].offset = -1;
-    open_table->open_files[fd].root_entry_index = INVALID_INDEX;
-    open_table->count --;
+int fs_snapshot(const char *name) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = snapshot_take(name);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
+}
 
-    return 0;
+int fs_snapshot_delete(const char *name) {
+    dir_handle_class snapshots;
 
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = super_block == NULL || !name || snapshot_dir_handle(&snapshots, false) ? -1 :
+              snapshot_remove(&snapshots, name);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
 }
 
-int fs_stat(int fd) {
-    if (fd > FS_OPEN_MAX_COUNT || fd < 0) {
-        return -1;
-    }
+static int copy_range(int src_fd, int dst_fd, size_t offset, size_t count) {
+    open_file_class *src = get_open_file(src_fd);
+    open_file_class *dst = get_open_file(dst_fd);
 
-    int root_entry_index = open_table->open_files[fd].root_entry_index;
-   
-    if (root_entry_index < 0 || root_entry_index > FS_FILE_MAX_COUNT)
+    if (!src || !dst || (dst->node->entry.file_flags & FS_FLAG_READONLY))
         return -1;
 
-    if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+    size_t size = src->node->entry.size_of_file;
+    if (offset >= size)
+        return 0;
+    if (count > size - offset)
+        count = size - offset;
+
+    /*ranges of the same file must not overlap*/
+    size_t dst_offset = dst->offset;
+    if (src->node == dst->node && offset < dst_offset + count && dst_offset < offset + count)
         return -1;
 
-    int size = root_block->dic[root_entry_index].size_of_file;
+    /*blocks are copied on disk between files whose chains follow their offsets*/
+    bool src_mapped = src->node->entry.file_flags & FS_FLAG_INDEXED;
+    bool dst_mapped = dst->node->entry.file_flags & FS_FLAG_INDEXED;
+    bool aligned = !src_mapped && !dst_mapped && offset % BLOCK_SIZE == dst_offset % BLOCK_SIZE;
+    char *buf = NULL;
+    size_t copied = 0;
 
-    return size;
-}
+    while (copied < count) {
+        size_t from = offset + copied;
+        size_t to = dst_offset + copied;
 
-int fs_lseek(int fd, size_t offset) {
-    //fd is invalid
-    if (fd > FS_OPEN_MAX_COUNT || fd < 0) {
-        return -1;
-    }
+        /*whole blocks go from disk to disk*/
+        if (aligned && from % BLOCK_SIZE == 0 && count - copied >= BLOCK_SIZE) {
+            size_t blocks = (count - copied) / BLOCK_SIZE;
+            if (node_unshare(dst->node, (to + blocks * BLOCK_SIZE - 1) / BLOCK_SIZE) ||
+                file_copy_blocks(src->node, from / BLOCK_SIZE, dst->node, to / BLOCK_SIZE, blocks))
+                break;
+            copied += blocks * BLOCK_SIZE;
+            continue;
+        }
 
-    //not initialized
-    if (open_table->open_files[fd].offset == -1) {
-        return -1;
-    }
+        /*partial blocks and compressed files go through one chunk buffer*/
+        size_t chunk = aligned ? BLOCK_SIZE - from % BLOCK_SIZE : CHUNK_SIZE;
+        if (chunk > count - copied)
+            chunk = count - copied;
+        if (!buf && !(buf = buffer_get()))
+            break;
 
-    // offset is too big
-    if (offset > root_block->dic[open_table->open_files[fd].root_entry_index].size_of_file) {
-        //too big
-        return -1;
+        int n = node_read_at(src->node, from, buf, chunk);
+        if (n <= 0)
+            break;
+        int written = node_write_at(dst->node, to, buf, n);
+        if (written > 0)
+            copied += written;
+        if (written != n)
+            break;
     }
 
-    open_table->open_files[fd].offset = offset;
+    buffer_put(buf);
+    dst->offset += copied;
+    return copied;
+}
 
-    return 0;
+int fs_copy_range(int src_fd, int dst_fd, size_t offset, size_t count) {
+    io_lock_take(false);
+    int ret = copy_range(src_fd, dst_fd, offset, count);
+    io_lock_drop();
+    return ret;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-    /*the entry index of fd in root directory*/
-    int root_entry_index = open_table->open_files[fd].root_entry_index;
+/**
+ * fs_check walks every chain reachable from the superblock and the directory
+ * tree; chains of files are walked by several threads at once, which claim
+ * the blocks they go through in a shared ownership map
+ */
+#define CHECK_BROKEN 0x01
+#define CHECK_CYCLE 0x02
+#define CHECK_CROSS 0x04
+#define CHECK_LENGTH 0x08
 
-    /*check if the root entry index is valid*/
-    if (root_entry_index == INVALID_INDEX)
-        return -1;
+/*chains whose length is not derived from a size*/
+#define CHECK_ANY_LENGTH UINT32_MAX
 
-    /*check if the fd is valid*/
-    if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
-        return -1;
+#define CHECK_MAX_THREADS 16
 
-    if (!count){
-        return 0;
-    }
+typedef enum check_kind {
+    CHECK_FILE,
+    CHECK_INDEX,
+    CHECK_DIR,
+    CHECK_TABLE,
+} check_kind;
+
+typedef struct check_chain_class {
+    entry_loc_class loc;
+    char name[FS_FILENAME_LEN];
+    check_kind kind;
+    bool walked;
+    __uint16_t head;
+    __uint32_t expected;
+    __uint32_t length;
+    __uint8_t problems;
+} check_chain_class;
 
-    int num_block;                                  //the block we need to create to write
-    int spanning_data_block;                        //the num of block before the offset
-    __uint16_t temp_index;                          //the last index of the block we write
-    int start_block_offset;                         //the offset at that block
-    char *temp_data_block = malloc(BLOCK_SIZE);     //the bounce to store the data we read
+typedef struct check_class {
+    check_chain_class *chains;
+    int count;
+    int cap;
+    /*1 + the first chain to go through every block, 0 for none*/
+    _Atomic __uint32_t *owner;
+    /*number of chains going through every block*/
+    _Atomic __uint32_t *claims;
+    _Atomic int next;
+    bool repair;
+    int problems;
+} check_class;
 
-    spanning_data_block = open_table->open_files[fd].offset / BLOCK_SIZE;
-    start_block_offset = open_table->open_files[fd].offset % BLOCK_SIZE;
+static int check_add(check_class *check, const entry_loc_class *loc, const char *name, check_kind kind,
+                     __uint16_t head, __uint32_t expected) {
+    if (check->count == check->cap) {
+        int cap = check->cap ? check->cap * 2 : 64;
+        check_chain_class *chains = realloc(check->chains, cap * sizeof(check_chain_class));
+        if (!chains)
+            return -1;
+        check->chains = chains;
+        check->cap = cap;
+    }
 
-    int index_first_fat_block;
-    int index_writing_block;
+    check_chain_class *chain = &check->chains[check->count];
+    memset(chain, 0, sizeof(*chain));
+    chain->loc = *loc;
+    strncpy(chain->name, name, FS_FILENAME_LEN - 1);
+    chain->kind = kind;
+    chain->head = head;
+    chain->expected = expected;
+    return check->count++;
+}
 
-    /*check if the file is empty*/
-    if (root_block->dic[root_entry_index].index_first_data_block != FAT_EOC){
-        /*if it is not empty, get its first data block*/
-        index_first_fat_block = root_block->dic[root_entry_index].index_first_data_block;
-        index_writing_block = index_first_fat_block;
+/*walk chain @id, claiming its blocks; safe to run on several chains at once*/
+static void check_walk(check_class *check, int id) {
+    check_chain_class *chain = &check->chains[id];
+    __uint32_t limit = super_block->data_block_count;
 
-        /*go through to the the data block we start writing*/
-        for (int i = 0; i < spanning_data_block; ++i) {
-            index_writing_block = FAT_ptr[index_writing_block];
+    for (__uint16_t index = chain->head; index != FAT_EOC; index = FAT_ptr[index]) {
+        if (index == 0 || index >= limit) {
+            chain->problems |= CHECK_BROKEN;
+            break;
+        }
+        /*a chain longer than the volume loops through another chain*/
+        if (chain->length == limit) {
+            chain->problems |= CHECK_CYCLE;
+            break;
         }
 
-    }else{
-        /*if it is empty, find a avaliable data block for it*/
-        index_first_fat_block = find_empty_data_block();
+        __uint32_t owner = 0;
+        if (!atomic_compare_exchange_strong(&check->owner[index], &owner, id + 1)) {
+            if (owner == (__uint32_t) id + 1) {
+                chain->problems |= CHECK_CYCLE;
+                break;
+            }
+            /*with reference counts, files share their tails*/
+            if (!refcount_ptr || chain->kind == CHECK_DIR || chain->kind == CHECK_TABLE)
+                chain->problems |= CHECK_CROSS;
+        }
+        atomic_fetch_add(&check->claims[index], 1);
+        chain->length++;
+    }
+    if (chain->expected != CHECK_ANY_LENGTH && chain->length != chain->expected && !(chain->problems & CHECK_CYCLE))
+        chain->problems |= CHECK_LENGTH;
+    chain->walked = true;
+}
 
-        /*set the first data block index*/
-        root_block->dic[root_entry_index].index_first_data_block = index_first_fat_block;
+static void *check_worker(void *arg) {
+    check_class *check = arg;
 
-        /*the writing block is just this first index*/
-        index_writing_block = index_first_fat_block;
-        printf("DATA BLOCK INDEX: %d\n", index_writing_block);
+    for (int id; (id = atomic_fetch_add(&check->next, 1)) < check->count;) {
+        if (!check->chains[id].walked)
+            check_walk(check, id);
     }
+    return NULL;
+}
 
-    /*the size exceeds our data block */
-    int new_block_size = count + open_table->open_files[fd].offset - root_block->dic[root_entry_index].size_of_file;
+static int check_dir(check_class *check, int id, __uint32_t block_count);
 
-    /**
-     *small operation
-     *write the first block
-     */
-    if (count < BLOCK_SIZE - start_block_offset){
-        block_read(super_block->data_block_index + index_writing_block, temp_data_block);
-        memcpy(temp_data_block + start_block_offset, buf, count);
-        block_write(super_block->data_block_index + index_writing_block, temp_data_block);
-        //root_block->dic[root_entry_index].size_of_file += count;
-        open_table->open_files[fd].offset += count;
-        if (open_table->open_files[fd].offset >  root_block->dic[root_entry_index].size_of_file){
-            root_block->dic[root_entry_index].size_of_file = open_table->open_files[fd].offset;
-        }
-        return count;
+static int check_entry(check_class *check, const entry_loc_class *loc, const root_entry_class *entry) {
+    const char *name = (const char *) entry->file_name;
+
+    if (entry->file_type == FS_TYPE_DIR) {
+        int id = check_add(check, loc, name, CHECK_DIR, entry->index_first_data_block,
+                           entry->size_of_file / BLOCK_SIZE);
+        return id < 0 ? -1 : check_dir(check, id, entry->size_of_file / BLOCK_SIZE);
     }
 
-    if (count == BLOCK_SIZE - start_block_offset){
+    /*compressed and sparse files only get their chains checked, their length follows their index*/
+    bool indexed = entry->file_flags & FS_FLAG_INDEXED;
+    __uint32_t expected = indexed ? CHECK_ANY_LENGTH : (entry->size_of_file + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (check_add(check, loc, name, CHECK_FILE, entry->index_first_data_block, expected) < 0)
+        return -1;
+    if ((entry->file_flags & FS_FLAG_SECOND_CHAIN) &&
+        check_add(check, loc, name, CHECK_INDEX, entry->index_chunk_block, CHECK_ANY_LENGTH) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * walk the chain of directory @id right away, then list its entries if the
+ * chain can be trusted; a directory reached twice is a cross-link, which also
+ * stops loops in the tree
+ */
+static int check_dir(check_class *check, int id, __uint32_t block_count) {
+    root_entry_class block[DIR_ENTRY_PER_BLOCK];
+
+    check_walk(check, id);
+    if (check->chains[id].problems || !block_count)
         return 0;
+
+    __uint16_t dir = check->chains[id].head;
+    __uint16_t index = dir;
+    __uint32_t entries = 0;
+    __uint32_t tombs = 0;
+    for (__uint32_t i = 0; i < block_count; i++) {
+        if (data_block_read(index, block))
+            return -1;
+        for (__uint32_t j = i ? 0 : 1; j < DIR_ENTRY_PER_BLOCK; j++) {
+            if (entry_is_free(&block[j])) {
+                tombs += block[j].file_type == FS_TYPE_DELETED;
+                continue;
+            }
+            entry_loc_class loc = { dir, i * DIR_ENTRY_PER_BLOCK + j };
+            entries++;
+            if (check_entry(check, &loc, &block[j]))
+                return -1;
+        }
+        index = FAT_ptr[index];
+    }
+
+    /*the header's counts drive the growth of the table*/
+    dir_header_class header[DIR_ENTRY_PER_BLOCK];
+    if (data_block_read(dir, header))
+        return -1;
+    if (header[0].entry_count != entries || header[0].tomb_count != tombs || header[0].block_count != block_count) {
+        printf("directory '%s': header counts %u entries, %u deleted, %u blocks instead of %u, %u, %u\n",
+               check->chains[id].name, header[0].entry_count, header[0].tomb_count, header[0].block_count,
+               entries, tombs, block_count);
+        check->problems++;
+        if (check->repair) {
+            header[0].entry_count = entries;
+            header[0].tomb_count = tombs;
+            header[0].block_count = block_count;
+            if (data_block_write(dir, header))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*list every chain of the volume, walking the directories on the way*/
+static int check_gather(check_class *check) {
+    entry_loc_class hidden = { DIR_ROOT, INVALID_INDEX };
+
+    if (checksum_ptr && check_add(check, &hidden, "checksum", CHECK_TABLE, super_block->checksum_block,
+                                  table_block_count(CHECKSUM_PER_BLOCK)) < 0)
+        return -1;
+    if (refcount_ptr && check_add(check, &hidden, "refcount", CHECK_TABLE, super_block->refcount_block,
+                                  table_block_count(REFCOUNT_PER_BLOCK)) < 0)
+        return -1;
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        entry_loc_class loc = { DIR_ROOT, i };
+        if (!entry_is_free(&root_block->dic[i]) && check_entry(check, &loc, &root_block->dic[i]))
+            return -1;
+    }
+
+    if (super_block->snapshot_dir) {
+        dir_header_class header[DIR_ENTRY_PER_BLOCK];
+        if (super_block->snapshot_dir >= super_block->data_block_count ||
+            data_block_read(super_block->snapshot_dir, header))
+            return -1;
+        int id = check_add(check, &hidden, "@", CHECK_DIR, super_block->snapshot_dir, header[0].block_count);
+        if (id < 0 || check_dir(check, id, header[0].block_count))
+            return -1;
     }
+    return 0;
+}
 
-    /**
-     * large operation
-     * if the the exceed size are positive, create more blocks
-     */
-    
-    if (new_block_size > 0) {
-        temp_index = index_writing_block;
+static void check_report(const check_chain_class *chain) {
+    static const char *kinds[] = { "file", "index of", "directory", "table" };
 
-        /*get the block we need to create*/
+    printf("%s '%s':", kinds[chain->kind], chain->name);
+    if (chain->problems & CHECK_BROKEN)
+        printf(" broken link");
+    if (chain->problems & CHECK_CYCLE)
+        printf(" cycle");
+    if (chain->problems & CHECK_CROSS)
+        printf(" cross-linked");
+    if (chain->problems & CHECK_LENGTH)
+        printf(" %u blocks instead of %u", chain->length, chain->expected);
+    printf("\n");
+}
 
-        num_block = new_block_size / BLOCK_SIZE;
+/**
+ * count in @links the references to every block, from entries and from the
+ * blocks in use; a block's reference count holds its references beyond the
+ * first, shared tails only being counted at the block where they join
+ */
+static void check_links(const check_class *check, const _Atomic __uint32_t *claims, __uint32_t *links) {
+    __uint32_t limit = super_block->data_block_count;
 
+    memset(links, 0, limit * sizeof(__uint32_t));
+    for (int id = 0; id < check->count; id++) {
+        __uint16_t head = check->chains[id].head;
+        if (head != 0 && head < limit)
+            links[head]++;
+    }
+    for (__uint32_t i = 1; i < limit; i++) {
+        __uint16_t next = FAT_ptr[i];
+        if (claims[i] && next != 0 && next < limit)
+            links[next]++;
+    }
+}
 
-       
-        /*go to the EOC*/
-        while (FAT_ptr[temp_index] != FAT_EOC) {
-            temp_index = FAT_ptr[temp_index];
-        }
-       
-        int count_empty_block = 0;
-        /*allocate more block at the end*/
-        for (;  count_empty_block < num_block; count_empty_block++) {
-            FAT_ptr[temp_index] = find_empty_data_block();
-            temp_index = FAT_ptr[temp_index];
+/*mark in @needed the blocks whose next link some chain relies on*/
+static void check_needed(const check_class *check, __uint32_t *stamp, bool *needed) {
+    __uint32_t limit = super_block->data_block_count;
 
-            if (temp_index == FAT_EOC){
+    for (int id = 0; id < check->count; id++) {
+        const check_chain_class *chain = &check->chains[id];
+        bool sized = (chain->kind == CHECK_FILE || chain->kind == CHECK_INDEX) && chain->expected != CHECK_ANY_LENGTH;
+        __uint32_t length = 0;
+
+        for (__uint16_t index = chain->head; index != FAT_EOC; index = FAT_ptr[index]) {
+            if (index == 0 || index >= limit || stamp[index] == (__uint32_t) id + 1)
                 break;
-            }
+            stamp[index] = id + 1;
+            if (!sized || ++length < chain->expected)
+                needed[index] = true;
         }
-        
-        /**
-         * write the beginning block
-         */
-      
-        block_read(super_block->data_block_index + index_writing_block, temp_data_block);
-        memcpy(temp_data_block + start_block_offset, buf, BLOCK_SIZE - start_block_offset);
-
-        open_table->open_files[fd].offset += BLOCK_SIZE - start_block_offset;
-
-        block_write(super_block->data_block_index + index_writing_block, temp_data_block);
-        count -= (BLOCK_SIZE - start_block_offset);
-        if(count_empty_block-- == 0){
-            if (open_table->open_files[fd].offset >  root_block->dic[root_entry_index].size_of_file){
-                    root_block->dic[root_entry_index].size_of_file = open_table->open_files[fd].offset;
-                }
-            return BLOCK_SIZE - start_block_offset;
-        }
-
-        index_writing_block = FAT_ptr[index_writing_block];
-
-        /*write to the rest whole block*/
-        int count_index = 1;
-        while (count > BLOCK_SIZE) {
-            block_read(super_block->data_block_index + index_writing_block, temp_data_block);
-            memcpy(temp_data_block, buf + (BLOCK_SIZE - start_block_offset) + BLOCK_SIZE * (count_index - 1),
-                   BLOCK_SIZE);
-
-            open_table->open_files[fd].offset += BLOCK_SIZE;
-            block_write(super_block->data_block_index + index_writing_block, temp_data_block);
-            count -= BLOCK_SIZE;
-            count_index++;
-            if(count_empty_block-- == 0){
-                if (open_table->open_files[fd].offset >  root_block->dic[root_entry_index].size_of_file){
-                    root_block->dic[root_entry_index].size_of_file = open_table->open_files[fd].offset;
-                }
-                return BLOCK_SIZE - start_block_offset + BLOCK_SIZE * (count_index - 1);
+    }
+    memset(stamp, 0, limit * sizeof(__uint32_t));
+}
+
+/**
+ * cut the chains of files found broken, looping, cross-linked or longer than
+ * their size, in order so the outcome does not depend on the threads; the
+ * blocks kept are claimed again in @claims. Directories and tables are only
+ * reported, since their size is part of their layout
+ */
+static int check_repair(check_class *check, _Atomic __uint32_t *claims) {
+    __uint32_t *stamp = calloc(super_block->data_block_count, sizeof(__uint32_t));
+    bool *needed = calloc(super_block->data_block_count, sizeof(bool));
+    int ret = 0;
+
+    if (!stamp || !needed) {
+        free(stamp);
+        free(needed);
+        return -1;
+    }
+    check_needed(check, stamp, needed);
+
+    for (int id = 0; id < check->count && !ret; id++) {
+        check_chain_class *chain = &check->chains[id];
+        bool fixable = chain->kind == CHECK_FILE || chain->kind == CHECK_INDEX;
+        __uint16_t prev = FAT_EOC;
+        __uint32_t kept = 0;
+        bool cut = false;
+
+        for (__uint16_t index = chain->head; index != FAT_EOC; index = FAT_ptr[index]) {
+            bool invalid = index == 0 || index >= super_block->data_block_count || stamp[index] == (__uint32_t) id + 1;
+            bool crossed = claims[index] && !refcount_ptr;
+            /*a shared tail is only cut where none of its owners goes on*/
+            bool trim = kept == chain->expected && !(prev != FAT_EOC && needed[prev]);
+
+            if (invalid || (fixable && (crossed || trim))) {
+                cut = fixable;
+                break;
             }
-            index_writing_block = FAT_ptr[index_writing_block];
+            stamp[index] = id + 1;
+            claims[index]++;
+            prev = index;
+            kept++;
         }
-	
 
-        /*write the last block*/
-        block_read(super_block->data_block_index + index_writing_block, temp_data_block);
-        memcpy(temp_data_block, buf + (BLOCK_SIZE - start_block_offset) + BLOCK_SIZE * (count_index - 1), count);
-         open_table->open_files[fd].offset += count;
-        block_write(super_block->data_block_index + index_writing_block, temp_data_block);
-        
-        /*change the size in root directory*/
-        //root_block->dic[root_entry_index].size_of_file += new_block_size;
-         if (open_table->open_files[fd].offset >  root_block->dic[root_entry_index].size_of_file){
-             root_block->dic[root_entry_index].size_of_file = open_table->open_files[fd].offset;
+        /*a chain ending early is kept, the size of its file is clamped to it*/
+        bool short_chain = chain->kind == CHECK_FILE && chain->expected != CHECK_ANY_LENGTH && kept < chain->expected;
+        if (!cut && !short_chain)
+            continue;
+
+        root_entry_class entry;
+        if (entry_load(&chain->loc, &entry)) {
+            ret = -1;
+            break;
         }
-        return new_block_size;
-    }    
-}
+        if (cut) {
+            if (prev != FAT_EOC)
+                fat_set(prev, FAT_EOC);
+            else if (chain->kind == CHECK_FILE)
+                entry.index_first_data_block = FAT_EOC;
+            else
+                entry.index_chunk_block = FAT_EOC;
+        }
+        if (chain->kind == CHECK_FILE && !(entry.file_flags & FS_FLAG_INDEXED) &&
+            entry.size_of_file > kept * BLOCK_SIZE)
+            entry.size_of_file = kept * BLOCK_SIZE;
+        ret = entry_store(&chain->loc, &entry);
+    }
 
+    free(stamp);
+    free(needed);
+    return ret;
+}
 
-int fs_read(int fd, void *buf, size_t count) {
-    int root_entry_index = open_table->open_files[fd].root_entry_index;
+static int check_run(int repair, int threads) {
+    _Atomic __uint32_t *claims = NULL;
+    __uint32_t *links = NULL;
+    check_class check;
+    int ret = -1;
 
-    if (root_entry_index == INVALID_INDEX)
+    if (super_block == NULL || open_table->count > 0)
         return -1;
 
-    if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
-        return -1;
+    /*the superblock must describe the layout fs_make writes*/
+    int fat_blocks = (super_block->data_block_count * sizeof(__uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (super_block->FAT_block_count != fat_blocks || super_block->root_block_index != 1 + fat_blocks ||
+        super_block->data_block_index != 2 + fat_blocks ||
+        super_block->block_count != 2 + fat_blocks + super_block->data_block_count) {
+        printf("superblock: inconsistent layout\n");
+        return 1;
+    }
+
+    /*the walkers read the FAT directly, which must be whole to be trusted*/
+    int bad = 0;
+    for (int b = 0; b < super_block->FAT_block_count; b++) {
+        fat_get(b * FAT_PER_BLOCK);
+        if (FAT_state[b] & FAT_BLOCK_BAD) {
+            printf("FAT block %d: unreadable\n", b);
+            bad++;
+        }
+    }
+    if (bad)
+        return bad;
 
-    
+    memset(&check, 0, sizeof(check));
+    check.repair = repair;
+    check.owner = calloc(super_block->data_block_count, sizeof(*check.owner));
+    check.claims = calloc(super_block->data_block_count, sizeof(*check.claims));
+    if (!check.owner || !check.claims || check_gather(&check))
+        goto out;
 
-    __int8_t *buffer_ptr = buf;
-    void *temp_data_block = malloc(BLOCK_SIZE);
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > CHECK_MAX_THREADS)
+        threads = CHECK_MAX_THREADS;
+    if (threads > check.count)
+        threads = check.count;
 
-    int start_block_index = -1;
-    int start_block_offset = -1;
-    int end_block_index = -1;
-    int end_block_offset = -1;
-    int real_read_size = 0;
+    pthread_t workers[CHECK_MAX_THREADS];
+    int started = 0;
+    atomic_init(&check.next, 0);
+    while (started < threads - 1 && !pthread_create(&workers[started], NULL, check_worker, &check))
+        started++;
+    check_worker(&check);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
 
-    // get the file entry
+    bool chain_problems = false;
+    bool complete = true;
+    for (int id = 0; id < check.count; id++) {
+        if (check.chains[id].problems) {
+            check_report(&check.chains[id]);
+            check.problems++;
+            chain_problems = true;
+            if (check.chains[id].kind == CHECK_DIR || check.chains[id].kind == CHECK_TABLE)
+                complete = false;
+        }
+    }
 
-    // get virtual index
-    start_block_index = open_table->open_files[fd].offset / BLOCK_SIZE;
-    start_block_offset = open_table->open_files[fd].offset % BLOCK_SIZE;
-    end_block_index = (open_table->open_files[fd].offset + count) / BLOCK_SIZE;
-    end_block_offset = (open_table->open_files[fd].offset + count) % BLOCK_SIZE;
+    links = malloc(super_block->data_block_count * sizeof(__uint32_t));
+    if (!links)
+        goto out;
+    check_links(&check, check.claims, links);
 
-    //read the first data block
-    __uint16_t real_index = root_block->dic[open_table->open_files[fd].root_entry_index].index_first_data_block;
-    // add later
-    for(int i = 0; i < start_block_index ; ++i){
-        real_index  = FAT_ptr[real_index];
+    int leaked = 0;
+    int miscounted = 0;
+    for (int i = 1; i < super_block->data_block_count; i++) {
+        leaked += FAT_ptr[i] != 0 && !check.claims[i];
+        if (refcount_ptr && check.claims[i] && refcount_ptr[i] != links[i] - 1)
+            miscounted++;
     }
+    if (leaked)
+        printf("%d blocks in use by no file\n", leaked);
+    if (miscounted)
+        printf("%d blocks with a wrong reference count\n", miscounted);
+    check.problems += leaked + miscounted;
 
-    block_read(super_block->data_block_index + real_index, temp_data_block);
+    if (repair && (chain_problems || leaked || miscounted)) {
+        claims = calloc(super_block->data_block_count, sizeof(*claims));
+        if (!claims || check_repair(&check, claims))
+            goto out;
 
-    /*read one block and we done*/
-    if (start_block_index == end_block_index) {
-        memcpy(buf, temp_data_block + start_block_offset, count);
-        real_read_size += count;
-        open_table->open_files[fd].offset += count;
-    } else {
-        // read the first block
-        memcpy(buffer_ptr, (char*)temp_data_block + start_block_offset, BLOCK_SIZE - start_block_offset);
-        real_read_size += BLOCK_SIZE - start_block_offset ;
-        open_table->open_files[fd].offset += BLOCK_SIZE - start_block_offset;
-        //update buffer_ptr
-        buffer_ptr = buffer_ptr + (BLOCK_SIZE - start_block_offset);
-        for (int i = start_block_index + 1; i < end_block_index; ++i) {
-            // get next data block
-            real_index = FAT_ptr[real_index];
-            if(real_index == FAT_EOC){
-                return real_read_size;
+        /*blocks below a damaged directory were not reached, so they stay*/
+        if (complete) {
+            check_links(&check, claims, links);
+            for (int i = 1; i < super_block->data_block_count; i++) {
+                if (FAT_ptr[i] != 0 && !claims[i])
+                    release_block(i);
+                if (refcount_ptr)
+                    refcount_ptr[i] = claims[i] ? links[i] - 1 : 0;
             }
-            block_read(super_block->data_block_index + real_index, temp_data_block);
-            memcpy(buffer_ptr, temp_data_block, BLOCK_SIZE);
-            open_table->open_files[fd].offset += BLOCK_SIZE;
-            real_read_size +=  BLOCK_SIZE;
-            // update ptr
-            buffer_ptr = buffer_ptr + BLOCK_SIZE;
+            mount_gen++;
+        } else {
+            printf("damaged directories: unreferenced blocks and reference counts left as they are\n");
         }
-        // read the tail data
-        
-        real_index = FAT_ptr[real_index];
-        if(real_index == FAT_EOC){
-            return real_read_size;
-        }
-        block_read(super_block->data_block_index + real_index, temp_data_block);
-        memcpy(buffer_ptr, temp_data_block, end_block_offset);
-        real_read_size +=  end_block_offset;
-        open_table->open_files[fd].offset += end_block_offset;
     }
+    ret = check.problems;
 
-    
-
-    free(temp_data_block);
+out:
+    free(links);
+    free(claims);
+    free(check.chains);
+    free(check.owner);
+    free(check.claims);
+    return ret;
+}
 
-    return real_read_size;
+int fs_check(int repair, int threads) {
+    mount_lock_take();
+    io_lock_take(false);
+    int ret = check_run(repair, threads);
+    io_lock_drop();
+    mount_lock_drop();
+    return ret;
 }
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,16 +10,30 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Initial size of the open file table, which grows on demand */
 #define FS_OPEN_MAX_COUNT 32
 
+/** What fs_seek() looks for */
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+/** How a file is going to be read, for fs_advise() */
+#define FS_ADVISE_NORMAL 0
+#define FS_ADVISE_SEQUENTIAL 1
+#define FS_ADVISE_RANDOM 2
+#define FS_ADVISE_WILLNEED 3
+#define FS_ADVISE_DONTNEED 4
+#define FS_ADVISE_NOREUSE 5
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). Only the superblock and the
+ * root directory are read at mount time; FAT blocks are read the first time
+ * they are needed, and only the modified ones are written back by fs_umount().
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
@@ -36,6 +51,58 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_fsync - Make a file durable
+ * @fd: File descriptor
+ *
+ * Write back what the file referenced by file descriptor @fd still holds in
+ * memory, such as a pending compressed chunk or changed extents, along with
+ * the metadata of the volume that changed since it was last written back: the
+ * modified FAT blocks, the root directory, the per-block tables and the
+ * superblock. The disk is then asked to make every block written so far
+ * durable, so that the file survives a crash without unmounting. Nothing is
+ * written when the volume did not change since the last write-back.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if writing back or flushing the disk fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_flush_interval - Write back changes in the background
+ * @interval: Milliseconds between two write-backs, 0 to stop
+ *
+ * Start a flusher thread that, every @interval milliseconds, does for every
+ * open file and the volume what fs_fsync() does for one file, if anything
+ * changed meanwhile. Changes are then lost by a crash only when they are less
+ * than @interval old. Each write-back holds calls on the directory tree and on
+ * file descriptors off, and writes the metadata in disk order. A flusher
+ * already running is stopped first, and fs_umount() stops it as well.
+ *
+ * Return: -1 if no file system is currently mounted or if the thread cannot
+ * be started. 0 otherwise.
+ */
+int fs_flush_interval(unsigned int interval);
+
+/**
+ * fs_log - Write files in log-structured mode
+ * @segment_blocks: Blocks per segment of the log, at most 1024, 0 to stop
+ *
+ * Until the volume is unmounted or fs_log() is called with 0, blocks of files
+ * written again are not overwritten in place but appended to a log, along
+ * with new blocks: a segment of @segment_blocks free blocks filled in order
+ * and written in a few large requests once full, or by fs_fsync(), the
+ * flusher or fs_umount(). Random overwrites then cost about what sequential
+ * writes do. The FAT records where every block moved, so the volume stays
+ * readable by any implementation. A cleaner thread keeps free segments
+ * available by moving what is left in sparsely used ones. Compressed, sparse
+ * and extent files are still written in place.
+ *
+ * Return: -1 if no file system is currently mounted, if @segment_blocks is
+ * too large or if the cleaner cannot be started. 0 otherwise.
+ */
+int fs_log(unsigned int segment_blocks);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,33 +112,109 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_check - Check the consistency of the file system
+ * @repair: Whether to fix the problems found
+ * @threads: Number of threads walking the chains of files, 0 for one per CPU
+ *
+ * Validate the superblock, then walk every chain of blocks reachable from the
+ * root directory, the subdirectories, the snapshots and the block tables. Each
+ * block records the first chain going through it, which tells a chain looping
+ * on itself from two chains sharing a block. Blocks allocated in the FAT but
+ * reached by no chain are leaked, and shared blocks must match the reference
+ * counts of the volume. Problems are printed as they are found.
+ *
+ * With @repair, files are cut before their first bad block and their size
+ * clamped to what is left, directory headers are recounted, leaked blocks are
+ * freed and reference counts rebuilt. No file may be open.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if a file is open, or
+ * on an I/O error. Otherwise, return the number of problems found.
+ */
+int fs_check(int repair, int threads);
+
 /**
  * fs_create - Create a new file
- * @filename: File name
+ * @filename: File path
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file at path @filename of the mounted file system.
+ * Components of @filename are separated by '/', every component but the last
+ * must name an existing directory, and no component can exceed
+ * %FS_FILENAME_LEN characters (including the NULL character). A path with a
+ * single component names a file in the root directory.
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if a component of @filename is too long, or if the root directory already
+ * contains %FS_FILE_MAX_COUNT files. 0 otherwise.
  */
 int fs_create(const char *filename);
 
 /**
  * fs_delete - Delete a file
- * @filename: File name
+ * @filename: File path
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file at path @filename from the mounted file system. Directories
+ * are removed with fs_rmdir().
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
  * delete, or if file @filename is currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_create_many - Create several files
+ * @filenames: Array of file paths
+ * @count: Number of paths in @filenames
+ *
+ * Create every file of @filenames like fs_create() would, in order. Runs of
+ * paths located in the same directory resolve that directory once, and the
+ * directory blocks they modify are written once at the end of the run, so
+ * sorting @filenames by directory makes large batches cheaper.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @count is negative.
+ * Otherwise, return the number of files actually created.
+ */
+int fs_create_many(const char **filenames, int count);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Array of file paths
+ * @count: Number of paths in @filenames
+ *
+ * Delete every file of @filenames like fs_delete() would, batching the
+ * directory updates like fs_create_many().
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @count is negative.
+ * Otherwise, return the number of files actually deleted.
+ */
+int fs_delete_many(const char **filenames, int count);
+
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory path
+ *
+ * Create a new and empty directory at path @dirname, following the same path
+ * rules as fs_create(). Subdirectories are not limited to %FS_FILE_MAX_COUNT
+ * entries: their entries live in hashed directory blocks that grow on demand,
+ * so looking a name up costs about one block read whatever their size.
+ *
+ * Return: -1 if @dirname is invalid, if an entry named @dirname already exists,
+ * if its parent directory is full, or if there is no space left on disk. 0
+ * otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @dirname: Directory path
+ *
+ * Delete the empty directory at path @dirname.
+ *
+ * Return: -1 if @dirname is invalid, if there is no directory named @dirname,
+ * or if the directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
 /**
  * fs_ls - List files on file system
  *
@@ -81,21 +224,49 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files in a directory
+ * @dirname: Directory path
+ *
+ * List information about the files located in directory @dirname, an empty
+ * path or "/" being the root directory. Directory blocks are read and printed
+ * one at a time, so listing a large directory does not load it in memory.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @dirname is not a
+ * directory. 0 otherwise.
+ */
+int fs_lsdir(const char *dirname);
+
+/**
+ * fs_readdir - Iterate over the files in a directory
+ * @dirname: Directory path
+ * @visit: Function called on every entry of the directory
+ * @arg: Argument passed to @visit
+ *
+ * Call @visit with the name, the size and the type (1 for a directory, 0 for a
+ * file) of every entry located in directory @dirname, in no particular order.
+ * @visit may read the file system but must not modify it, and stops the
+ * iteration by returning a non-zero value.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @dirname is not a
+ * directory, or if @visit stopped the iteration. 0 otherwise.
+ */
+int fs_readdir(const char *dirname, int (*visit)(const char *name, int size, int is_dir, void *arg), void *arg);
+
 /**
  * fs_open - Open a file
- * @filename: File name
+ * @filename: File path
  *
- * Open file named @filename for reading and writing, and return the
+ * Open file at path @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors, which share the file's cached state. The number of files open
+ * simultaneously is only limited by memory.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the open file table cannot grow. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -106,7 +277,8 @@ int fs_open(const char *filename);
  * Close file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if pending compressed data could not be written back (see
+ * fs_compress()). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -130,12 +302,59 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may lie past the end of the file: reading there returns nothing, and
+ * writing there leaves a hole between the end of the file and @offset. Holes
+ * covering whole blocks take no space on disk and read as zeroes.
+ *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset does not fit in an int. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_seek - Find data or a hole in a file
+ * @fd: File descriptor
+ * @offset: File offset to search from
+ * @whence: %FS_SEEK_DATA or %FS_SEEK_HOLE
+ *
+ * Find the first offset at or after @offset that holds data, or that lies in a
+ * hole, and set the file offset to it, like lseek() does with SEEK_DATA and
+ * SEEK_HOLE. Holes are tracked by blocks, and the end of the file counts as a
+ * hole, so a file without holes has data up to its size and a hole there.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @whence is invalid, if
+ * @offset is not before the end of the file, or if there is no data after
+ * @offset when looking for data. Otherwise return the offset found.
+ */
+int fs_seek(int fd, size_t offset, int whence);
+
+/**
+ * fs_advise - Tell how a file is going to be read
+ * @fd: File descriptor
+ * @offset: Start of the range the hint is about
+ * @len: Length of the range, 0 meaning up to the end of the file
+ * @advice: One of the %FS_ADVISE_* hints
+ *
+ * Recently read data blocks are kept in memory, and blocks read more than once
+ * are protected from reads that go through many blocks once. A file read in
+ * order is also read ahead, in windows that grow with every read in order.
+ * Hints refine this for the file, and last until it is closed by every
+ * descriptor:
+ *
+ * %FS_ADVISE_NORMAL restores the default behavior. %FS_ADVISE_SEQUENTIAL reads
+ * ahead as much as possible, and %FS_ADVISE_RANDOM never does. Blocks of
+ * files marked %FS_ADVISE_SEQUENTIAL or %FS_ADVISE_NOREUSE are read once: they
+ * only recycle a few slots of their own, and never push hot blocks out.
+ *
+ * %FS_ADVISE_WILLNEED reads the range into memory now, up to half of what is
+ * kept, and %FS_ADVISE_DONTNEED drops it; these two apply to the range and not
+ * to the file, and have no effect on compressed or sparse files.
+ *
+ * Return: -1 if file descriptor @fd is invalid or if @advice is not a hint. 0
+ * otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int advice);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -151,6 +370,8 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * If the file offset lies past the end of the file, the gap becomes a hole that
+ * reads as zeroes.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -177,4 +398,220 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file to read from
+ *
+ * Like fs_read(), but read at @offset and leave the file's offset untouched.
+ * Every call but fs_mount() and fs_umount() may be made from several threads
+ * at once: positional reads of an uncompressed file run in parallel once a
+ * first read has mapped its blocks, and other calls are serialized.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes to be written
+ * @offset: Offset in the file to write at
+ *
+ * Like fs_write(), but write at @offset and leave the file's offset untouched.
+ * Writing beyond the end of the file leaves a hole, as with fs_lseek().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the file is read-only, or if the file would grow past 4GiB.
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read from the file's offset into the buffers of @iov one after the other,
+ * as a single fs_read() of their total length would, and advance the offset
+ * accordingly. Runs of buffers smaller than a block are filled from a single
+ * read of the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid or if @iov is invalid.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_writev - Write several buffers to a file
+ * @fd: File descriptor
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the buffers of @iov at the file's offset one after the other, as a
+ * single fs_write() of their concatenation would, and advance the offset
+ * accordingly. Runs of buffers smaller than a block are gathered and written
+ * at once, so that small records do not each cost a block update.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if the file is read-only, or
+ * if @iov is invalid. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_copy_range - Copy data between files
+ * @src_fd: File descriptor of the file to copy from
+ * @dst_fd: File descriptor of the file to copy to
+ * @offset: Offset of the data to copy in the file of @src_fd
+ * @count: Number of bytes to copy
+ *
+ * Copy @count bytes found at @offset in the file of @src_fd to the file of
+ * @dst_fd, at its current offset, without going through a buffer of the
+ * caller. The offset of @dst_fd is advanced by the number of bytes copied,
+ * while the offset of @src_fd is left untouched. When both files are
+ * uncompressed and @offset lies at the same position within a block as the
+ * offset of @dst_fd, whole blocks are copied on the disk itself and the
+ * blocks added to the destination file are allocated next to each other.
+ * Fewer than @count bytes are copied if the end of the source file is
+ * reached or if the disk runs out of space.
+ *
+ * Return: -1 if a file descriptor is invalid, if the destination file is
+ * read-only, or if both descriptors refer to the same file and the two ranges
+ * overlap. Otherwise, return the number of bytes actually copied.
+ */
+int fs_copy_range(int src_fd, int dst_fd, size_t offset, size_t count);
+
+/**
+ * fs_compress - Compress a file
+ * @fd: File descriptor
+ *
+ * Switch the file referenced by file descriptor @fd to compressed storage,
+ * rewriting its current content. A compressed file is cut in chunks of 16KiB
+ * that are compressed independently, and an index of their stored lengths
+ * lets fs_read() decompress only the chunks it touches. Writes gather in the
+ * chunk being written, which is compressed once it is full, when another
+ * chunk is accessed, or when the file is closed. Compression cannot be turned
+ * off once enabled.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there is not enough space on disk to hold both copies of the
+ * file while it is rewritten. 0 otherwise.
+ */
+int fs_compress(int fd);
+
+/**
+ * fs_extent - Map a file by extents
+ * @fd: File descriptor
+ *
+ * Switch the file referenced by file descriptor @fd to the extent layout: its
+ * data blocks are also described as runs of adjacent blocks, kept in the
+ * file's entry when there are at most two and else in extent blocks, so that
+ * fs_read() maps offsets by binary search over the runs and reads each one in
+ * a single operation, without walking the FAT. Blocks added to the file are
+ * taken next to its last one where possible. The FAT chain is kept up to date
+ * as well, so the file stays readable by implementations that do not know
+ * extents; its extents are written back when it is closed. Writing past the
+ * end of the file or compressing it drops the extents.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the file is compressed, sparse or read-only, or if there is not
+ * enough space on disk for its extent blocks. 0 otherwise.
+ */
+int fs_extent(int fd);
+
+/**
+ * fs_checksum - Enable block checksums
+ *
+ * Turn on checksums for the mounted file system. A CRC32C of every data block
+ * is kept in a checksum area allocated from the data blocks, updated on every
+ * block write and verified on every block read, so that corrupted blocks make
+ * fs_read() fail instead of returning garbage. The FAT and root directory are
+ * checked at mount time against checksums kept in the superblock. Checksums
+ * stay enabled across mounts.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is not
+ * enough space on disk for the checksum area. 0 otherwise.
+ */
+int fs_checksum(void);
+
+/**
+ * fs_scrub - Verify every allocated block
+ * @rate: Maximum number of blocks checked per second, or 0 for no limit
+ *
+ * Read every allocated data block of the mounted file system in disk order and
+ * check it against its checksum, reporting mismatches on stderr. Limiting
+ * @rate keeps a scrub from competing with regular I/O.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if checksums are not
+ * enabled (see fs_checksum()). Otherwise, return the number of corrupted
+ * blocks.
+ */
+int fs_scrub(int rate);
+
+/**
+ * fs_dedup - Share identical data blocks between files
+ *
+ * Index the data blocks of every closed, uncompressed file by content and
+ * merge blocks holding identical data, keeping a reference count for every
+ * shared block. Since a block has a single successor in the FAT, two blocks
+ * are merged only when the rest of their chains is shared as well: identical
+ * files, or files ending with identical blocks, end up sharing those blocks.
+ * Writing to a shared block gives the file its own copy first, so that the
+ * other files keep their content.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is not
+ * enough space on disk for the reference counts. Otherwise, return the number
+ * of data blocks freed.
+ */
+int fs_dedup(void);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Path of the file to clone
+ * @dst: Path of the new file
+ *
+ * Create file @dst with the content of file @src without copying any data:
+ * both files share their data blocks until one of them is written, at which
+ * point the blocks being modified are copied. @src may be open, and may be a
+ * file of a snapshot, which restores it.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @src is not an
+ * existing file, if @dst is invalid, already exists or lies in a snapshot, or
+ * if the directory of @dst is full. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot - Take a read-only snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Record the current content of every file and directory under snapshot
+ * @name. Files of the snapshot share their data blocks with the live files,
+ * which copy blocks only when they are written afterwards, so taking a
+ * snapshot costs a copy of the directories only. The snapshot is reached
+ * through paths starting with "@name/", and "@" lists every snapshot; it
+ * cannot be modified, only deleted with fs_snapshot_delete().
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @name is empty,
+ * longer than %FS_FILENAME_LEN - 2 characters or already taken, or if there is
+ * not enough space on disk. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete snapshot @name, freeing the blocks no other file shares.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no snapshot
+ * @name, or if one of its files is currently open. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
 #endif /* _FS_H */
@@ -0,0 +1,250 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsd.h"
+
+/*spins before yielding, and yields before sleeping*/
+#define FSD_SPIN_COUNT 1024
+#define FSD_YIELD_COUNT 64
+#define FSD_SLEEP_NS 50000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define fsd_cpu_relax() __builtin_ia32_pause()
+#else
+#define fsd_cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+struct fsd_client_class {
+    fsd_shared_class *shared;
+    fsd_slot_class *slot;
+};
+
+/*wait for the next completion, giving up if the daemon goes away*/
+static int fsd_wait(fsd_client_class *client) {
+    fsd_ring_index_class *cq_index = &client->slot->cq_index;
+    struct timespec nap = {0, FSD_SLEEP_NS};
+    int pos;
+
+    for (int round = 0; (pos = fsd_ring_peek(cq_index)) < 0; round++) {
+        if (!atomic_load_explicit(&client->shared->running, memory_order_acquire))
+            return -1;
+        if (round < FSD_SPIN_COUNT)
+            fsd_cpu_relax();
+        else if (round < FSD_SPIN_COUNT + FSD_YIELD_COUNT)
+            sched_yield();
+        else
+            nanosleep(&nap, NULL);
+    }
+    return pos;
+}
+
+/*queue one request; its data buffer is the one matching its ring position*/
+static int fsd_submit(fsd_client_class *client, __uint32_t op, int fd, __uint64_t offset, __uint64_t count) {
+    fsd_slot_class *slot = client->slot;
+    __uint32_t tail = atomic_load_explicit(&slot->sq_index.tail, memory_order_relaxed);
+    fsd_request_class *request = &slot->sq[tail % FSD_RING_SIZE];
+
+    request->op = op;
+    request->buf = tail % FSD_RING_SIZE;
+    request->fd = fd;
+    request->offset = offset;
+    request->count = count;
+    fsd_ring_push(&slot->sq_index);
+    return request->buf;
+}
+
+/*run a single request whose data buffer was filled by the caller*/
+static int fsd_call(fsd_client_class *client, __uint32_t op, int fd, __uint64_t count) {
+    int pos, result;
+
+    fsd_submit(client, op, fd, 0, count);
+    pos = fsd_wait(client);
+    if (pos < 0)
+        return -1;
+    result = client->slot->cq[pos].result;
+    fsd_ring_pop(&client->slot->cq_index);
+    return result;
+}
+
+static int fsd_call_path(fsd_client_class *client, __uint32_t op, const char *path) {
+    __uint32_t tail;
+    size_t len;
+
+    if (client == NULL || path == NULL)
+        return -1;
+    len = strlen(path) + 1;
+    if (len > FSD_BUF_SIZE)
+        return -1;
+    tail = atomic_load_explicit(&client->slot->sq_index.tail, memory_order_relaxed);
+    memcpy(client->slot->buf[tail % FSD_RING_SIZE], path, len);
+    return fsd_call(client, op, -1, len);
+}
+
+fsd_client_class *fsd_attach(const char *name) {
+    fsd_client_class *client;
+    fsd_shared_class *shared;
+    struct stat st;
+    int shm_fd;
+
+    shm_fd = shm_open(name, O_RDWR, 0);
+    if (shm_fd < 0)
+        return NULL;
+    if (fstat(shm_fd, &st) < 0 || (size_t) st.st_size < sizeof(fsd_shared_class)) {
+        close(shm_fd);
+        return NULL;
+    }
+    shared = mmap(NULL, sizeof(fsd_shared_class), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shared == MAP_FAILED)
+        return NULL;
+    if (shared->magic != FSD_MAGIC || shared->version != FSD_VERSION ||
+        !atomic_load_explicit(&shared->running, memory_order_acquire)) {
+        munmap(shared, sizeof(fsd_shared_class));
+        return NULL;
+    }
+
+    client = malloc(sizeof(fsd_client_class));
+    if (client == NULL) {
+        munmap(shared, sizeof(fsd_shared_class));
+        return NULL;
+    }
+    client->shared = shared;
+    client->slot = NULL;
+    for (int i = 0; i < FSD_SLOT_COUNT; i++) {
+        __uint32_t expected = FSD_SLOT_FREE;
+        if (atomic_compare_exchange_strong(&shared->slots[i].state, &expected, FSD_SLOT_ATTACHED)) {
+            client->slot = &shared->slots[i];
+            break;
+        }
+    }
+    if (client->slot == NULL) {
+        munmap(shared, sizeof(fsd_shared_class));
+        free(client);
+        return NULL;
+    }
+    atomic_store_explicit(&client->slot->pid, getpid(), memory_order_release);
+    return client;
+}
+
+int fsd_detach(fsd_client_class *client) {
+    if (client == NULL)
+        return -1;
+    atomic_store_explicit(&client->slot->state, FSD_SLOT_DETACHING, memory_order_release);
+    munmap(client->shared, sizeof(fsd_shared_class));
+    free(client);
+    return 0;
+}
+
+int fsd_create(fsd_client_class *client, const char *filename) {
+    return fsd_call_path(client, FSD_OP_CREATE, filename);
+}
+
+int fsd_delete(fsd_client_class *client, const char *filename) {
+    return fsd_call_path(client, FSD_OP_DELETE, filename);
+}
+
+int fsd_mkdir(fsd_client_class *client, const char *dirname) {
+    return fsd_call_path(client, FSD_OP_MKDIR, dirname);
+}
+
+int fsd_open(fsd_client_class *client, const char *filename) {
+    return fsd_call_path(client, FSD_OP_OPEN, filename);
+}
+
+int fsd_close(fsd_client_class *client, int fd) {
+    if (client == NULL)
+        return -1;
+    return fsd_call(client, FSD_OP_CLOSE, fd, 0);
+}
+
+int fsd_stat(fsd_client_class *client, int fd) {
+    if (client == NULL)
+        return -1;
+    return fsd_call(client, FSD_OP_STAT, fd, 0);
+}
+
+int fsd_fsync(fsd_client_class *client, int fd) {
+    if (client == NULL)
+        return -1;
+    return fsd_call(client, FSD_OP_FSYNC, fd, 0);
+}
+
+/*
+ * Split a transfer into buffer-sized requests and keep the submission ring
+ * full. The daemon completes a slot's requests in order, so the buffer of the
+ * oldest request in flight is the first one to come back. Once a request fails
+ * or comes back short, nothing more is submitted and the requests still in
+ * flight are drained without being counted: the result covers only the bytes
+ * transferred in one piece from @offset.
+ */
+static int fsd_transfer(fsd_client_class *client, __uint32_t op, int fd, char *buf, size_t count, size_t offset) {
+    fsd_slot_class *slot;
+    size_t done = 0, submitted = 0;
+    size_t length[FSD_RING_SIZE];
+    char *dest[FSD_RING_SIZE];
+    int in_flight = 0, failed = 0, short_io = 0;
+
+    if (client == NULL || buf == NULL)
+        return -1;
+    slot = client->slot;
+
+    /*the byte count is returned as an int*/
+    if (count > INT_MAX)
+        count = INT_MAX;
+
+    while (submitted < count || in_flight) {
+        while (submitted < count && in_flight < FSD_RING_SIZE && !failed && !short_io) {
+            __uint32_t tail = atomic_load_explicit(&slot->sq_index.tail, memory_order_relaxed);
+            int pos = tail % FSD_RING_SIZE;
+            size_t chunk = count - submitted < FSD_BUF_SIZE ? count - submitted : FSD_BUF_SIZE;
+
+            if (op == FSD_OP_PWRITE)
+                memcpy(slot->buf[pos], buf + submitted, chunk);
+            dest[pos] = buf + submitted;
+            length[pos] = chunk;
+            fsd_submit(client, op, fd, offset + submitted, chunk);
+            submitted += chunk;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        int pos = fsd_wait(client);
+        if (pos < 0)
+            return -1;
+        fsd_completion_class *completion = &slot->cq[pos];
+        int result = completion->result;
+        __uint32_t index = completion->buf;
+        if (result < 0) {
+            failed = 1;
+        } else if (!failed && !short_io) {
+            if (op == FSD_OP_PREAD)
+                memcpy(dest[index], slot->buf[index], result);
+            done += result;
+            /*later requests start past the end of what was transferred*/
+            if ((size_t) result < length[index])
+                short_io = 1;
+        }
+        fsd_ring_pop(&slot->cq_index);
+        in_flight--;
+    }
+
+    if (failed && !done)
+        return -1;
+    return done;
+}
+
+int fsd_pread(fsd_client_class *client, int fd, void *buf, size_t count, size_t offset) {
+    return fsd_transfer(client, FSD_OP_PREAD, fd, buf, count, offset);
+}
+
+int fsd_pwrite(fsd_client_class *client, int fd, const void *buf, size_t count, size_t offset) {
+    return fsd_transfer(client, FSD_OP_PWRITE, fd, (char *) buf, count, offset);
+}
@@ -0,0 +1,197 @@
+#ifndef _FSD_H
+#define _FSD_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * A file system daemon (progs/fs_daemon.c) mounts a volume and serves the
+ * processes attached to it through a POSIX shared memory object. Every client
+ * owns a slot holding a submission ring, a completion ring and one data buffer
+ * per ring entry. Each ring has a single producer and a single consumer, so it
+ * only needs a head and a tail index published with release/acquire ordering;
+ * the data of reads and writes is copied once, between the caller's buffer
+ * and the slot's shared buffer.
+ */
+
+/** Layout version, bumped whenever the shared structures change */
+#define FSD_VERSION 1
+#define FSD_MAGIC 0x46534431
+
+/** Number of clients attached at once */
+#define FSD_SLOT_COUNT 16
+
+/** Number of entries of every ring, and of data buffers of every slot */
+#define FSD_RING_SIZE 16
+
+/** Size of a data buffer, the largest read or write of a single request */
+#define FSD_BUF_SIZE (64 * 1024)
+
+enum fsd_op {
+    FSD_OP_CREATE,
+    FSD_OP_DELETE,
+    FSD_OP_MKDIR,
+    FSD_OP_OPEN,
+    FSD_OP_CLOSE,
+    FSD_OP_STAT,
+    FSD_OP_PREAD,
+    FSD_OP_PWRITE,
+    FSD_OP_FSYNC,
+};
+
+enum fsd_slot_state {
+    FSD_SLOT_FREE,
+    FSD_SLOT_ATTACHED,
+    FSD_SLOT_DETACHING,
+};
+
+/*paths travel in the request's data buffer*/
+typedef struct fsd_request_class {
+    __uint32_t op;
+    __uint32_t buf;
+    __int32_t fd;
+    __uint32_t unused;
+    __uint64_t offset;
+    __uint64_t count;
+} fsd_request_class;
+
+typedef struct fsd_completion_class {
+    __uint32_t buf;
+    __int32_t result;
+} fsd_completion_class;
+
+/*the two indexes sit on their own cache lines, one per side*/
+typedef struct fsd_ring_index_class {
+    _Atomic __uint32_t head;
+    __uint8_t pad_head[60];
+    _Atomic __uint32_t tail;
+    __uint8_t pad_tail[60];
+} fsd_ring_index_class;
+
+typedef struct fsd_slot_class {
+    _Atomic __uint32_t state;
+    _Atomic __int32_t pid;
+    fsd_ring_index_class sq_index;
+    fsd_request_class sq[FSD_RING_SIZE];
+    fsd_ring_index_class cq_index;
+    fsd_completion_class cq[FSD_RING_SIZE];
+    char buf[FSD_RING_SIZE][FSD_BUF_SIZE];
+} fsd_slot_class;
+
+typedef struct fsd_shared_class {
+    __uint32_t magic;
+    __uint32_t version;
+    _Atomic __uint32_t running;
+    fsd_slot_class slots[FSD_SLOT_COUNT];
+} fsd_shared_class;
+
+/*whether the ring behind @index can take one more entry*/
+static inline int fsd_ring_full(fsd_ring_index_class *index) {
+    return atomic_load_explicit(&index->tail, memory_order_relaxed) -
+           atomic_load_explicit(&index->head, memory_order_acquire) == FSD_RING_SIZE;
+}
+
+/*publish the entry written at the tail of the ring*/
+static inline void fsd_ring_push(fsd_ring_index_class *index) {
+    __uint32_t tail = atomic_load_explicit(&index->tail, memory_order_relaxed);
+    atomic_store_explicit(&index->tail, tail + 1, memory_order_release);
+}
+
+/*position of the oldest entry of the ring, or -1 if it is empty*/
+static inline int fsd_ring_peek(fsd_ring_index_class *index) {
+    __uint32_t head = atomic_load_explicit(&index->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&index->tail, memory_order_acquire))
+        return -1;
+    return head % FSD_RING_SIZE;
+}
+
+/*give the oldest entry of the ring back to the producer*/
+static inline void fsd_ring_pop(fsd_ring_index_class *index) {
+    __uint32_t head = atomic_load_explicit(&index->head, memory_order_relaxed);
+    atomic_store_explicit(&index->head, head + 1, memory_order_release);
+}
+
+/** A process attached to a daemon */
+typedef struct fsd_client_class fsd_client_class;
+
+/**
+ * fsd_attach - Attach to a file system daemon
+ * @name: Name of the daemon's shared memory object, as given to the daemon
+ *
+ * Map the shared memory object of the daemon serving @name and take one of its
+ * client slots. Every call below goes through that slot; a process may attach
+ * several times to get several independent slots, for instance one per thread.
+ *
+ * Return: NULL if no daemon serves @name or if all its slots are taken.
+ * Otherwise, return a handle for the calls below.
+ */
+fsd_client_class *fsd_attach(const char *name);
+
+/**
+ * fsd_detach - Detach from a file system daemon
+ * @client: Handle returned by fsd_attach()
+ *
+ * Give the slot of @client back to the daemon, which closes the files it left
+ * open. A slot whose process exits without detaching is reclaimed the same way.
+ *
+ * Return: -1 if @client is NULL. 0 otherwise.
+ */
+int fsd_detach(fsd_client_class *client);
+
+/**
+ * fsd_create - Create a file through a daemon
+ * @client: Handle returned by fsd_attach()
+ * @filename: Path of the file, as taken by fs_create()
+ *
+ * The following calls behave like their fs_*() counterparts on the daemon's
+ * volume, file descriptors being private to the slot that opened them.
+ *
+ * Return: -1 if the daemon went away, or on the failure of fs_create().
+ * 0 otherwise.
+ */
+int fsd_create(fsd_client_class *client, const char *filename);
+int fsd_delete(fsd_client_class *client, const char *filename);
+int fsd_mkdir(fsd_client_class *client, const char *dirname);
+int fsd_open(fsd_client_class *client, const char *filename);
+int fsd_close(fsd_client_class *client, int fd);
+int fsd_stat(fsd_client_class *client, int fd);
+int fsd_fsync(fsd_client_class *client, int fd);
+
+/**
+ * fsd_pread - Read from a file through a daemon
+ * @client: Handle returned by fsd_attach()
+ * @fd: File descriptor returned by fsd_open()
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file to read from
+ *
+ * Like fs_pread(). Reads larger than %FSD_BUF_SIZE are split into requests
+ * that are all submitted before the first completion is awaited; none is
+ * submitted after one fails or reads short. At most %INT_MAX bytes are read.
+ *
+ * Return: -1 if the daemon went away or if @fd is invalid. Otherwise return
+ * the number of bytes actually read.
+ */
+int fsd_pread(fsd_client_class *client, int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fsd_pwrite - Write to a file through a daemon
+ * @client: Handle returned by fsd_attach()
+ * @fd: File descriptor returned by fsd_open()
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes to be written
+ * @offset: Offset in the file to write at
+ *
+ * Like fs_pwrite(), with large writes split and submitted at once, and at most
+ * %INT_MAX bytes written. No request is submitted after one fails or writes
+ * short, but the requests already submitted still run: the content of the file
+ * past the bytes reported written is then undefined.
+ *
+ * Return: -1 if the daemon went away, or on the failure of fs_pwrite().
+ * Otherwise return the number of bytes actually written.
+ */
+int fsd_pwrite(fsd_client_class *client, int fd, const void *buf, size_t count, size_t offset);
+
+#endif /* _FSD_H */
@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+
+static __uint32_t read32(const __uint8_t *p) {
+    __uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static __uint32_t hash32(__uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*write the extra bytes of a length that did not fit in its nibble*/
+static __uint8_t *put_length(__uint8_t *op, __uint8_t *end, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= end)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+/*emit one sequence: literals, then a match unless @match_len is 0*/
+static __uint8_t *put_sequence(__uint8_t *op, __uint8_t *end, const __uint8_t *literals,
+                               int literal_len, int offset, int match_len) {
+    int match_code = match_len ? match_len - MIN_MATCH : 0;
+    __uint8_t *token = op++;
+
+    if (op > end)
+        return NULL;
+
+    *token = (literal_len < 15 ? literal_len : 15) << 4;
+    if (literal_len >= 15 && !(op = put_length(op, end, literal_len - 15)))
+        return NULL;
+
+    if (op + literal_len > end)
+        return NULL;
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (!match_len)
+        return op;
+
+    if (op + 2 > end)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    *token |= match_code < 15 ? match_code : 15;
+    if (match_code >= 15 && !(op = put_length(op, end, match_code - 15)))
+        return NULL;
+    return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap) {
+    const __uint8_t *in = src;
+    __uint8_t *op = dst;
+    __uint8_t *end = op + cap;
+    int table[1 << HASH_BITS];
+    int ip = 0;
+    int anchor = 0;
+
+    /*positions are stored off by one so that 0 means empty*/
+    memset(table, 0, sizeof(table));
+
+    while (ip + MIN_MATCH + LAST_LITERALS <= len) {
+        __uint32_t seq = read32(in + ip);
+        __uint32_t h = hash32(seq);
+        int ref = table[h] - 1;
+
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > MAX_OFFSET || read32(in + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        int match_len = MIN_MATCH;
+        while (ip + match_len < len - LAST_LITERALS && in[ref + match_len] == in[ip + match_len])
+            match_len++;
+
+        op = put_sequence(op, end, in + anchor, ip - anchor, ip - ref, match_len);
+        if (!op)
+            return -1;
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+    if (!op)
+        return -1;
+    return op - (__uint8_t *) dst;
+}
+
+/*read the extra bytes of a length whose nibble was 15*/
+static int get_length(const __uint8_t **ip, const __uint8_t *end, int len) {
+    __uint8_t byte;
+
+    do {
+        if (*ip >= end)
+            return -1;
+        byte = *(*ip)++;
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap) {
+    const __uint8_t *ip = src;
+    const __uint8_t *end = ip + len;
+    __uint8_t *op = dst;
+    __uint8_t *out_end = op + cap;
+
+    while (ip < end) {
+        __uint8_t token = *ip++;
+        int literal_len = token >> 4;
+
+        if (literal_len == 15 && (literal_len = get_length(&ip, end, literal_len)) < 0)
+            return -1;
+        if (literal_len > end - ip || literal_len > out_end - op)
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        /*the last sequence carries literals only*/
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > op - (__uint8_t *) dst)
+            return -1;
+
+        int match_len = token & 0x0F;
+        if (match_len == 15 && (match_len = get_length(&ip, end, match_len)) < 0)
+            return -1;
+        match_len += MIN_MATCH;
+        if (match_len > out_end - op)
+            return -1;
+
+        /*matches may overlap their own output*/
+        const __uint8_t *ref = op - offset;
+        while (match_len--)
+            *op++ = *ref++;
+    }
+
+    return op - (__uint8_t *) dst;
+}
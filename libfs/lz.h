@@ -0,0 +1,42 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+/**
+ * lz_bound - Worst-case compressed size
+ * @len: Number of input bytes
+ *
+ * Return: the size of a buffer large enough to hold the compressed form of
+ * any @len bytes.
+ */
+#define lz_bound(len) ((len) + (len) / 255 + 16)
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Number of bytes in @src
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst
+ *
+ * Compress @len bytes of @src into @dst with a byte-oriented LZ77 coding: each
+ * sequence is a token holding literal and match lengths, the literals, and a
+ * 16-bit back reference. Matches are found through a small hash table of
+ * 4-byte prefixes, which favours speed over ratio.
+ *
+ * Return: -1 if the compressed data does not fit in @cap bytes. Otherwise,
+ * return the number of bytes written to @dst.
+ */
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Number of bytes in @src
+ * @dst: Buffer receiving the original data
+ * @cap: Size of @dst
+ *
+ * Return: -1 if @src is corrupted or does not decompress into @cap bytes.
+ * Otherwise, return the number of bytes written to @dst.
+ */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif /* _LZ_H */
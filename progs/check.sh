@@ -0,0 +1,298 @@
+#!/bin/sh
+#
+# Round-trip checks: write files through libfs with test_fs.x, read them back
+# with its cat command and compare what comes out with the host files they
+# were written from.
+#
+# Usage: ./check.sh [check...]
+#
+# Every check runs on a freshly formatted image, and all of them run when none
+# is named. A check stops at its first failure, and the script exits with 1 if
+# any check failed.
+
+dir=$(cd "$(dirname "$0")" && pwd)
+ours=$dir/test_fs.x
+make=$dir/fs_make.x
+fsck=$dir/fsck.x
+bench=$dir/fs_bench.x
+
+checks="dirs compress dedup clone fsck sparse extent log"
+
+for prog in "$ours" "$make" "$fsck" "$bench"; do
+	if [ ! -x "$prog" ]; then
+		echo "$0: missing $prog" >&2
+		exit 2
+	fi
+done
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+# Deterministic file contents, so that every run writes the same bytes
+gen() {
+	awk -v n="$2" -v seed="$3" 'BEGIN {
+		srand(seed)
+		for (i = 0; i < n; i++)
+			printf "%c", 32 + int(rand() * 95)
+	}' > "$1"
+}
+
+fail() {
+	echo "$check: $*" >&2
+	exit 1
+}
+
+# Run one file system command, which must succeed
+fs() {
+	$ours "$@" > out 2>&1 || fail "'$*' failed: $(tail -n 1 out)"
+}
+
+# Run one file system command, which must fail
+fs_fails() {
+	if $ours "$@" > out 2>&1; then
+		fail "'$*' should have failed"
+	fi
+}
+
+# Check that file $2 of the image reads back as host file $1
+same() {
+	fs cat disk.fs "$2"
+	tail -n +3 out | cmp -s - "$1" || fail "'$2' differs from '$1'"
+}
+
+# Check that the image is consistent
+clean() {
+	$fsck disk.fs > out 2>&1 || fail "fsck: $(tail -n 1 out)"
+}
+
+# Blocks of the image still free
+free_blocks() {
+	fs info disk.fs
+	sed -n 's/^fat_free_ratio=\([0-9]*\)\/.*/\1/p' out
+}
+
+# Subdirectories: a directory grown past one block, then emptied and removed
+check_dirs() {
+	mkdir -p tree/sub
+	i=0
+	while [ $i -lt 300 ]; do
+		gen tree/sub/f$i $((i * 13 + 1)) $i
+		i=$((i + 1))
+	done
+	gen tree/sub/big 70000 300
+	before=$(free_blocks)
+	fs mkdir disk.fs d
+	fs import-dir disk.fs tree d
+	for f in f0 f127 f128 f299 big; do
+		same tree/sub/$f d/sub/$f
+	done
+	fs lsdir disk.fs d/sub
+	[ "$(grep -c '^file: ' out)" -eq 301 ] || fail "d/sub lists $(grep -c '^file: ' out) files, not 301"
+
+	fs_fails rmdir disk.fs d/sub
+	i=0
+	while [ $i -lt 300 ]; do
+		fs rm disk.fs d/sub/f$i
+		i=$((i + 1))
+	done
+	same tree/sub/big d/sub/big
+	fs rm disk.fs d/sub/big
+	fs rmdir disk.fs d/sub
+	fs rmdir disk.fs d
+	fs ls disk.fs
+	grep -q '^dir: d,' out && fail "'d' still listed after rmdir"
+	[ "$(free_blocks)" -eq "$before" ] || fail "$((before - $(free_blocks))) blocks leaked"
+}
+
+# Compressed files, one of them hardly compressible
+check_compress() {
+	awk 'BEGIN { for (i = 0; i < 20000; i++) printf "line %d of a file that compresses\n", i % 1000 }' > text
+	gen noise 100000 1
+	fs add disk.fs text
+	fs add disk.fs noise
+	before=$(free_blocks)
+	fs compress disk.fs text
+	fs compress disk.fs noise
+	[ "$(free_blocks)" -gt "$before" ] || fail "compressing saved no block"
+	same text text
+	same noise noise
+}
+
+# Two identical files and one ending like them share their blocks once deduplicated
+check_dedup() {
+	gen a 200000 1
+	cp a b
+	{ gen head 8192 2; cat head a; } > c
+	fs add disk.fs a
+	fs add disk.fs b
+	fs add disk.fs c
+	fs dedup disk.fs
+	saved=$(sed -n 's/.*: \([0-9]*\) blocks freed$/\1/p' out)
+	[ "${saved:-0}" -eq 98 ] || fail "dedup freed ${saved:-no} blocks"
+	same a a
+	same b b
+	same c c
+	clean
+	fs rm disk.fs a
+	fs rm disk.fs c
+	same b b
+	clean
+}
+
+# Overwrite host file $1 with host file $2 at block $3
+patch() {
+	dd if="$2" of="$1" bs=4096 seek="$3" conv=notrunc 2> /dev/null
+}
+
+# Clones and snapshots share blocks until one side is written
+check_clone() {
+	gen f 100000 1
+	gen p 6000 2
+	fs add disk.fs f
+	fs clone disk.fs f g
+	cp f g
+	patch g p 3
+	fs write disk.fs g p 12288
+	same f f
+	same g g
+
+	fs snapshot disk.fs s1
+	cp g g1
+	patch g p 20
+	fs write disk.fs g p 81920
+	fs rm disk.fs f
+	same f @s1/f
+	same g1 @s1/g
+	same g g
+	fs_fails write disk.fs @s1/g p 0
+	fs clone disk.fs @s1/f f
+	same f f
+	clean
+	fs snapdel disk.fs s1
+	same f f
+	same g g
+	clean
+}
+
+# Set FAT entry $1 of the image to $2, written as octal bytes
+fat_set() {
+	printf "$2" | dd of=disk.fs bs=1 seek=$((4096 + 2 * $1)) conv=notrunc 2> /dev/null
+}
+
+# fsck finds and repairs a chain cut short and a leaked block
+check_fsck() {
+	gen f 100000 1
+	before=$(free_blocks)
+	fs add disk.fs f
+	fs ls disk.fs
+	first=$(sed -n 's/^file: f, .*data_blk: \([0-9]*\).*/\1/p' out)
+	[ -n "$first" ] || fail "no first block for 'f'"
+	fat_set $((first + 10)) '\377\377'
+	fat_set 3000 '\377\377'
+
+	$fsck disk.fs > out 2>&1
+	[ $? -eq 1 ] || fail "fsck did not find the problems: $(tail -n 1 out)"
+	$fsck -r disk.fs > out 2>&1
+	[ $? -eq 1 ] || fail "fsck -r did not find the problems: $(tail -n 1 out)"
+	clean
+	head -c $((11 * 4096)) f > cut
+	same cut f
+	[ "$(free_blocks)" -eq $((before - 11)) ] || fail "$((before - 11 - $(free_blocks))) blocks still leaked"
+}
+
+# Writes past the end of a file leave holes that read as zeroes and take no space
+check_sparse() {
+	gen p 10000 1
+	: > s
+	fs add disk.fs s
+	before=$(free_blocks)
+	fs write disk.fs s p 1048676
+	head -c 1048676 /dev/zero > s
+	cat p >> s
+	same s s
+	used=$((before - $(free_blocks)))
+	[ $used -le 4 ] || fail "3 blocks of data, their index and a hole took $used blocks"
+
+	patch s p 100
+	fs write disk.fs s p 409600
+	fs write disk.fs s p 4000000
+	head -c $((4000000 - 1058676)) /dev/zero >> s
+	cat p >> s
+	same s s
+	clean
+}
+
+# Files mapped by extents, over free space cut in pieces, overwritten and appended to
+check_extent() {
+	i=0
+	while [ $i -lt 8 ]; do
+		gen g$i 40000 $i
+		fs add disk.fs g$i
+		i=$((i + 1))
+	done
+	for i in 1 3 5 7; do
+		fs rm disk.fs g$i
+	done
+	gen e 300000 10
+	gen p 9000 11
+	fs add disk.fs e
+	fs extent disk.fs e
+	same e e
+
+	patch e p 20
+	fs write disk.fs e p 81920
+	fs write disk.fs e p 300000
+	cat p >> e
+	same e e
+	for i in 0 2 4 6; do
+		same g$i g$i
+	done
+	clean
+}
+
+# First block of file $1 of the image
+first_block() {
+	fs ls disk.fs
+	sed -n "s/^file: $1, .*data_blk: \([0-9]*\).*/\1/p" out
+}
+
+# Log-structured writes, then a cleaner that moves what is left live of half
+# emptied segments while fs_bench.x fills the rest of the disk
+check_log() {
+	gen h 400000 1
+	gen p 4096 2
+	# 'h' starts on a segment boundary, and every other block of it is rewritten
+	head -c $((15 * 4096)) /dev/zero > pad
+	fs add disk.fs pad
+	fs -l 16 add disk.fs h
+	i=1
+	while [ $i -lt 97 ]; do
+		fs -l 16 write disk.fs h p $((i * 4096))
+		patch h p $i
+		i=$((i + 2))
+	done
+	fs rm disk.fs pad
+	same h h
+	first=$(first_block h)
+
+	fill=$((($(free_blocks) - 40) / 2 * 4096))
+	$bench -t 1 -S 1 -f $fill -s 4096 -m write=1 -d 1000 -L 16 disk.fs > out 2>&1 ||
+		fail "fs_bench.x failed: $(tail -n 1 out)"
+	[ "$(first_block h)" != "$first" ] || fail "the cleaner did not move 'h'"
+	same h h
+	clean
+}
+
+[ $# -gt 0 ] && checks="$*"
+status=0
+for check in $checks; do
+	$make disk.fs 4096 > /dev/null
+	if (check_$check); then
+		echo "$check: ok"
+	else
+		status=1
+	fi
+	rm -rf disk.fs out ./*
+done
+exit $status
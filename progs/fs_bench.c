@@ -0,0 +1,565 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define USAGE "Usage: %s [-t threads] [-d ms] [-m mix] [-s iosize] " \
+	"[-f filesize] [-S shared] [-x percent] [-F interval] [-L segment] " \
+	"[-o csv] <diskname>"
+
+/* Everything the benchmark creates lives in this directory */
+#define BENCH_DIR "bench"
+
+/* Files a thread keeps created before the oldest one has to go */
+#define LIVE_MAX 32
+
+/*
+ * Latencies are counted in a histogram of HIST_SUB buckets per power of two,
+ * which keeps every percentile within 1/HIST_SUB of the true value
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum bench_op {
+	OP_READ,
+	OP_WRITE,
+	OP_OPEN,
+	OP_CREATE,
+	OP_DELETE,
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+	"read", "write", "open", "create", "delete",
+};
+
+/* State of a worker, on cache lines of its own */
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	int private_fd;
+	uint64_t seed;
+	/* Names of the files created and not deleted yet, oldest first */
+	unsigned int live[LIVE_MAX];
+	int live_head;
+	int live_count;
+	unsigned int next_name;
+	uint64_t ops[OP_COUNT];
+	uint64_t errors;
+	uint64_t hist[OP_COUNT][HIST_SIZE];
+} __attribute__((aligned(64)));
+
+/* What one thread count achieved */
+struct bench_result {
+	int threads;
+	double ops_per_sec;
+	uint64_t ops[OP_COUNT];
+	uint64_t errors;
+	uint64_t hist[OP_COUNT + 1][HIST_SIZE];
+};
+
+static struct {
+	int max_threads;
+	long duration_ms;
+	unsigned int weights[OP_COUNT];
+	unsigned int weight_total;
+	size_t io_size;
+	size_t file_size;
+	int shared_count;
+	unsigned int shared_percent;
+	unsigned int flush_interval;
+	unsigned int log_segment;
+	const char *csv;
+} conf = {
+	.duration_ms = 1000,
+	.weights = { 60, 20, 10, 5, 5 },
+	.io_size = 4096,
+	.file_size = 1 << 20,
+	.shared_count = 1,
+	.shared_percent = 50,
+};
+
+static int *shared_fds;
+static pthread_barrier_t start_barrier;
+static atomic_int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+	/* xorshift64* */
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+static int hist_index(uint64_t ns)
+{
+	int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		(int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest latency counted in bucket @index */
+static uint64_t hist_value(int index)
+{
+	int msb = index / HIST_SUB - 1 + HIST_SUB_BITS;
+
+	if (index < HIST_SUB)
+		return index;
+	return (uint64_t)(HIST_SUB + index % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+/* Latency under which @percent of the counts of @hist fall */
+static uint64_t hist_percentile(const uint64_t *hist, double percent)
+{
+	uint64_t total = 0, seen = 0, rank;
+	int last = 0;
+
+	for (int i = 0; i < HIST_SIZE; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+
+	rank = (uint64_t)(total * percent / 100);
+	if (rank >= total)
+		rank = total - 1;
+	for (int i = 0; i < HIST_SIZE; i++) {
+		if (!hist[i])
+			continue;
+		last = i;
+		seen += hist[i];
+		if (seen > rank)
+			break;
+	}
+	return hist_value(last);
+}
+
+/* Parse "read=60,write=20,..." into the weights of the operations */
+static void parse_mix(char *mix)
+{
+	memset(conf.weights, 0, sizeof(conf.weights));
+	for (char *item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+		char *eq = strchr(item, '=');
+		size_t op;
+
+		if (!eq)
+			die("Bad mix item '%s', expected <op>=<weight>", item);
+		*eq = '\0';
+		for (op = 0; op < OP_COUNT; op++)
+			if (!strcmp(item, op_names[op]))
+				break;
+		if (op == OP_COUNT)
+			die("Unknown operation '%s'", item);
+		conf.weights[op] = atoi(eq + 1);
+	}
+}
+
+static void private_name(char *name, int id)
+{
+	snprintf(name, FS_FILENAME_LEN + sizeof(BENCH_DIR), BENCH_DIR "/p%d", id);
+}
+
+static void shared_name(char *name, int id)
+{
+	snprintf(name, FS_FILENAME_LEN + sizeof(BENCH_DIR), BENCH_DIR "/s%d", id);
+}
+
+static void created_name(char *name, int thread, unsigned int n)
+{
+	snprintf(name, FS_FILENAME_LEN + sizeof(BENCH_DIR), BENCH_DIR "/c%d.%u",
+		 thread, n % 100000);
+}
+
+/* Create @name and fill it with @conf.file_size bytes */
+static void file_fill(const char *name)
+{
+	char buf[4096];
+	size_t done = 0;
+	int fd;
+
+	memset(buf, 'b', sizeof(buf));
+	if (fs_create(name) || (fd = fs_open(name)) < 0)
+		die("Cannot create %s", name);
+	while (done < conf.file_size) {
+		size_t n = conf.file_size - done < sizeof(buf) ?
+			conf.file_size - done : sizeof(buf);
+		if (fs_write(fd, buf, n) != (int)n)
+			die("Cannot fill %s, is the disk large enough?", name);
+		done += n;
+	}
+	fs_close(fd);
+}
+
+/* Pick an operation according to the weights of the mix */
+static int pick_op(struct bench_thread *t)
+{
+	unsigned int r = next_random(&t->seed) % conf.weight_total;
+	int op;
+
+	for (op = 0; op < OP_COUNT - 1; op++) {
+		if (r < conf.weights[op])
+			break;
+		r -= conf.weights[op];
+	}
+	return op;
+}
+
+/* Run operation @op, possibly turned into another one; return what ran */
+static int run_op(struct bench_thread *t, int op, char *buf, int *failed)
+{
+	char name[FS_FILENAME_LEN + sizeof(BENCH_DIR)];
+	bool shared = next_random(&t->seed) % 100 < conf.shared_percent;
+	int file = next_random(&t->seed) % conf.shared_count;
+	int fd = shared ? shared_fds[file] : t->private_fd;
+	size_t blocks = (conf.file_size - conf.io_size) / conf.io_size + 1;
+	size_t offset = next_random(&t->seed) % blocks * conf.io_size;
+
+	/* Creates go until LIVE_MAX files are around, deletes while there are some */
+	if (op == OP_CREATE && t->live_count == LIVE_MAX)
+		op = OP_DELETE;
+	else if (op == OP_DELETE && !t->live_count)
+		op = OP_CREATE;
+
+	switch (op) {
+	case OP_READ:
+		*failed = fs_pread(fd, buf, conf.io_size, offset) !=
+			(int)conf.io_size;
+		break;
+	case OP_WRITE:
+		*failed = fs_pwrite(fd, buf, conf.io_size, offset) !=
+			(int)conf.io_size;
+		break;
+	case OP_OPEN:
+		if (shared)
+			shared_name(name, file);
+		else
+			private_name(name, t->id);
+		fd = fs_open(name);
+		*failed = fd < 0 || fs_close(fd);
+		break;
+	case OP_CREATE:
+		created_name(name, t->id, t->next_name);
+		*failed = fs_create(name);
+		if (!*failed) {
+			t->live[(t->live_head + t->live_count) % LIVE_MAX] =
+				t->next_name;
+			t->live_count++;
+		}
+		t->next_name++;
+		break;
+	case OP_DELETE:
+		created_name(name, t->id, t->live[t->live_head]);
+		*failed = fs_delete(name);
+		t->live_head = (t->live_head + 1) % LIVE_MAX;
+		t->live_count--;
+		break;
+	}
+	return op;
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	char *buf = malloc(conf.io_size);
+
+	if (!buf)
+		die("Cannot allocate I/O buffer");
+	memset(buf, 'w', conf.io_size);
+
+	pthread_barrier_wait(&start_barrier);
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		int failed = 0;
+		uint64_t start = now_ns();
+		int op = run_op(t, pick_op(t), buf, &failed);
+
+		t->hist[op][hist_index(now_ns() - start)]++;
+		t->ops[op]++;
+		t->errors += failed;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Delete what the threads left created */
+static void cleanup_live(struct bench_thread *t)
+{
+	char name[FS_FILENAME_LEN + sizeof(BENCH_DIR)];
+
+	while (t->live_count) {
+		created_name(name, t->id, t->live[t->live_head]);
+		fs_delete(name);
+		t->live_head = (t->live_head + 1) % LIVE_MAX;
+		t->live_count--;
+	}
+}
+
+/* Run the mix with @n threads for the configured duration */
+static void bench_run(int n, struct bench_thread *threads,
+		      struct bench_result *res)
+{
+	struct timespec pause = {
+		conf.duration_ms / 1000, conf.duration_ms % 1000 * 1000000
+	};
+	char name[FS_FILENAME_LEN + sizeof(BENCH_DIR)];
+	uint64_t start, elapsed, total = 0;
+
+	memset(res, 0, sizeof(*res));
+	res->threads = n;
+
+	for (int i = 0; i < n; i++) {
+		struct bench_thread *t = &threads[i];
+
+		memset(t, 0, sizeof(*t));
+		t->id = i;
+		t->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+		private_name(name, i);
+		if ((t->private_fd = fs_open(name)) < 0)
+			die("Cannot open %s", name);
+	}
+
+	if (pthread_barrier_init(&start_barrier, NULL, n + 1))
+		die("Cannot create barrier");
+	atomic_store(&running, 1);
+	for (int i = 0; i < n; i++)
+		if (pthread_create(&threads[i].thread, NULL, bench_worker,
+				   &threads[i]))
+			die("Cannot create thread %d", i);
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	nanosleep(&pause, NULL);
+	atomic_store(&running, 0);
+	for (int i = 0; i < n; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (int i = 0; i < n; i++) {
+		struct bench_thread *t = &threads[i];
+
+		for (int op = 0; op < OP_COUNT; op++) {
+			res->ops[op] += t->ops[op];
+			total += t->ops[op];
+			for (int b = 0; b < HIST_SIZE; b++) {
+				res->hist[op][b] += t->hist[op][b];
+				res->hist[OP_COUNT][b] += t->hist[op][b];
+			}
+		}
+		res->errors += t->errors;
+		fs_close(t->private_fd);
+		cleanup_live(t);
+	}
+	res->ops_per_sec = total * 1e9 / elapsed;
+}
+
+static void print_result(const struct bench_result *res, double base)
+{
+	const uint64_t *all = res->hist[OP_COUNT];
+
+	printf("%7d %12.0f %7.2f %6.2f %9.1f %9.1f %9.1f %9.1f %7llu\n",
+	       res->threads, res->ops_per_sec, res->ops_per_sec / base,
+	       res->ops_per_sec / base / res->threads,
+	       hist_percentile(all, 50) / 1e3, hist_percentile(all, 90) / 1e3,
+	       hist_percentile(all, 99) / 1e3,
+	       hist_percentile(all, 99.9) / 1e3,
+	       (unsigned long long)res->errors);
+	for (int op = 0; op < OP_COUNT; op++) {
+		if (!res->ops[op])
+			continue;
+		printf("        %-7s %10llu ops  p50 %9.1f  p99 %9.1f us\n",
+		       op_names[op], (unsigned long long)res->ops[op],
+		       hist_percentile(res->hist[op], 50) / 1e3,
+		       hist_percentile(res->hist[op], 99) / 1e3);
+	}
+}
+
+/*
+ * Measure how the throughput of libfs scales with threads. Every thread runs
+ * a weighted mix of operations for -d milliseconds:
+ *	read, write:	fs_pread()/fs_pwrite() of -s bytes at an aligned offset
+ *	open:		fs_open() and fs_close() by path
+ *	create, delete:	fs_create()/fs_delete() of files of its own
+ * Reads, writes and opens go to one of -S files shared by all threads with
+ * probability -x percent, else to a file private to the thread; all files
+ * are -f bytes long. The mix is run with 1, 2, 4... threads up to -t (default
+ * one per CPU), and every thread count gets a line with the aggregate ops/s,
+ * the speedup over one thread, the efficiency (speedup per thread), latency
+ * percentiles over all operations in microseconds, and failed operations,
+ * followed by the count and latencies of every operation. -o writes the
+ * scaling curve as CSV, -F runs the flusher every interval milliseconds, -L
+ * writes in log-structured mode with segments of that many blocks.
+ *
+ * The disk must be formatted by fs_make.x with room for -S + -t files of -f
+ * bytes; what the benchmark creates is deleted before it unmounts.
+ */
+int main(int argc, char **argv)
+{
+	char name[FS_FILENAME_LEN + sizeof(BENCH_DIR)];
+	struct bench_thread *threads;
+	struct bench_result *results;
+	int counts[32], count_n = 0;
+	FILE *csv = NULL;
+	int opt;
+
+	conf.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:d:m:s:f:S:x:F:L:o:")) != -1) {
+		switch (opt) {
+		case 't':
+			conf.max_threads = atoi(optarg);
+			break;
+		case 'd':
+			conf.duration_ms = atol(optarg);
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 's':
+			conf.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			conf.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			conf.shared_count = atoi(optarg);
+			break;
+		case 'x':
+			conf.shared_percent = atoi(optarg);
+			break;
+		case 'F':
+			conf.flush_interval = atoi(optarg);
+			break;
+		case 'L':
+			conf.log_segment = atoi(optarg);
+			break;
+		case 'o':
+			conf.csv = optarg;
+			break;
+		default:
+			die(USAGE, argv[0]);
+		}
+	}
+	if (optind >= argc)
+		die(USAGE, argv[0]);
+
+	for (int op = 0; op < OP_COUNT; op++)
+		conf.weight_total += conf.weights[op];
+	if (conf.max_threads < 1 || conf.duration_ms < 1 || !conf.weight_total ||
+	    !conf.io_size || conf.io_size > INT_MAX ||
+	    conf.file_size < conf.io_size || conf.shared_count < 1 ||
+	    conf.shared_percent > 100)
+		die("Invalid parameters");
+
+	/* Thread counts double up to the maximum, which is always run */
+	for (int n = 1; n < conf.max_threads && count_n < 31; n *= 2)
+		counts[count_n++] = n;
+	counts[count_n++] = conf.max_threads;
+
+	if (conf.csv && !(csv = fopen(conf.csv, "w")))
+		die("Cannot open %s", conf.csv);
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+	if (fs_mkdir(BENCH_DIR))
+		die("Cannot create directory " BENCH_DIR ", is it left over?");
+	if (conf.flush_interval && fs_flush_interval(conf.flush_interval))
+		die("Cannot start the flusher");
+	if (conf.log_segment && fs_log(conf.log_segment))
+		die("Cannot write in log-structured mode");
+
+	/* Files are written once up front, so that reads find blocks */
+	shared_fds = calloc(conf.shared_count, sizeof(int));
+	threads = aligned_alloc(64, conf.max_threads * sizeof(*threads));
+	results = calloc(count_n, sizeof(*results));
+	if (!shared_fds || !threads || !results)
+		die("Cannot allocate thread state");
+	for (int i = 0; i < conf.shared_count; i++) {
+		shared_name(name, i);
+		file_fill(name);
+		if ((shared_fds[i] = fs_open(name)) < 0)
+			die("Cannot open %s", name);
+	}
+	for (int i = 0; i < conf.max_threads; i++) {
+		private_name(name, i);
+		file_fill(name);
+	}
+
+	printf("%7s %12s %7s %6s %9s %9s %9s %9s %7s\n", "threads", "ops/s",
+	       "speedup", "effic", "p50 us", "p90 us", "p99 us", "p99.9 us",
+	       "errors");
+	if (csv)
+		fprintf(csv, "threads,ops_per_sec,speedup,efficiency,"
+			"p50_ns,p90_ns,p99_ns,p999_ns,errors\n");
+	for (int i = 0; i < count_n; i++) {
+		struct bench_result *res = &results[i];
+		const uint64_t *all = res->hist[OP_COUNT];
+		double base;
+
+		bench_run(counts[i], threads, res);
+		base = results[0].ops_per_sec ? results[0].ops_per_sec : 1;
+		print_result(res, base);
+		if (csv)
+			fprintf(csv, "%d,%.0f,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu\n",
+				res->threads, res->ops_per_sec,
+				res->ops_per_sec / base,
+				res->ops_per_sec / base / res->threads,
+				(unsigned long long)hist_percentile(all, 50),
+				(unsigned long long)hist_percentile(all, 90),
+				(unsigned long long)hist_percentile(all, 99),
+				(unsigned long long)hist_percentile(all, 99.9),
+				(unsigned long long)res->errors);
+	}
+
+	/* Leave the volume as it was found */
+	for (int i = 0; i < conf.shared_count; i++) {
+		fs_close(shared_fds[i]);
+		shared_name(name, i);
+		fs_delete(name);
+	}
+	for (int i = 0; i < conf.max_threads; i++) {
+		private_name(name, i);
+		fs_delete(name);
+	}
+	fs_rmdir(BENCH_DIR);
+
+	free(shared_fds);
+	free(threads);
+	free(results);
+	if (csv)
+		fclose(csv);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
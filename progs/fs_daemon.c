@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fsd.h>
+
+#define fs_daemon_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_daemon_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Idle rounds before the daemon naps, and how long it naps */
+#define IDLE_SPIN	4096
+#define IDLE_NAP_NS	100000
+
+/* Requests served from one slot before moving on to the next one */
+#define SLOT_BATCH	FSD_RING_SIZE
+
+/* Idle rounds between two checks that attached clients are still alive */
+#define REAP_INTERVAL	1024
+
+/* Daemon-private state of a slot: the file descriptors it opened */
+struct slot_files {
+	int *fds;
+	int count;
+	int capacity;
+};
+
+static volatile sig_atomic_t stop;
+static struct slot_files files[FSD_SLOT_COUNT];
+
+static void on_signal(int signo)
+{
+	(void)signo;
+	stop = 1;
+}
+
+static int slot_owns(struct slot_files *sf, int fd)
+{
+	for (int i = 0; i < sf->count; i++)
+		if (sf->fds[i] == fd)
+			return i;
+	return -1;
+}
+
+static int slot_add(struct slot_files *sf, int fd)
+{
+	if (sf->count == sf->capacity) {
+		int capacity = sf->capacity ? sf->capacity * 2 : 8;
+		int *fds = realloc(sf->fds, capacity * sizeof(int));
+		if (!fds)
+			return -1;
+		sf->fds = fds;
+		sf->capacity = capacity;
+	}
+	sf->fds[sf->count++] = fd;
+	return 0;
+}
+
+/* Path arguments must be terminated within the request's buffer */
+static const char *request_path(fsd_slot_class *slot, fsd_request_class *req)
+{
+	char *path = slot->buf[req->buf];
+
+	if (!req->count || req->count > FSD_BUF_SIZE || path[req->count - 1])
+		return NULL;
+	return path;
+}
+
+static int serve(fsd_slot_class *slot, struct slot_files *sf,
+		 fsd_request_class *req)
+{
+	const char *path = NULL;
+	int fd, idx;
+
+	if (req->buf >= FSD_RING_SIZE)
+		return -1;
+
+	switch (req->op) {
+	case FSD_OP_CREATE:
+	case FSD_OP_DELETE:
+	case FSD_OP_MKDIR:
+	case FSD_OP_OPEN:
+		path = request_path(slot, req);
+		if (!path)
+			return -1;
+		break;
+	case FSD_OP_CLOSE:
+	case FSD_OP_STAT:
+	case FSD_OP_PREAD:
+	case FSD_OP_PWRITE:
+	case FSD_OP_FSYNC:
+		/* A slot only reaches the files it opened itself */
+		if (slot_owns(sf, req->fd) < 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	switch (req->op) {
+	case FSD_OP_CREATE:
+		return fs_create(path);
+	case FSD_OP_DELETE:
+		return fs_delete(path);
+	case FSD_OP_MKDIR:
+		return fs_mkdir(path);
+	case FSD_OP_OPEN:
+		fd = fs_open(path);
+		if (fd >= 0 && slot_add(sf, fd)) {
+			fs_close(fd);
+			return -1;
+		}
+		return fd;
+	case FSD_OP_CLOSE:
+		idx = slot_owns(sf, req->fd);
+		sf->fds[idx] = sf->fds[--sf->count];
+		return fs_close(req->fd);
+	case FSD_OP_STAT:
+		return fs_stat(req->fd);
+	case FSD_OP_PREAD:
+		if (req->count > FSD_BUF_SIZE)
+			return -1;
+		return fs_pread(req->fd, slot->buf[req->buf], req->count,
+				req->offset);
+	case FSD_OP_PWRITE:
+		if (req->count > FSD_BUF_SIZE)
+			return -1;
+		return fs_pwrite(req->fd, slot->buf[req->buf], req->count,
+				 req->offset);
+	case FSD_OP_FSYNC:
+		return fs_fsync(req->fd);
+	}
+	return -1;
+}
+
+/* Serve up to SLOT_BATCH requests of a slot, return how many were served */
+static int serve_slot(fsd_slot_class *slot, struct slot_files *sf)
+{
+	int served = 0;
+
+	while (served < SLOT_BATCH && !fsd_ring_full(&slot->cq_index)) {
+		int pos = fsd_ring_peek(&slot->sq_index);
+		if (pos < 0)
+			break;
+
+		fsd_request_class req = slot->sq[pos];
+		__uint32_t tail = atomic_load_explicit(&slot->cq_index.tail,
+						       memory_order_relaxed);
+		fsd_completion_class *cpl = &slot->cq[tail % FSD_RING_SIZE];
+
+		cpl->buf = req.buf;
+		cpl->result = serve(slot, sf, &req);
+		fsd_ring_pop(&slot->sq_index);
+		fsd_ring_push(&slot->cq_index);
+		served++;
+	}
+	return served;
+}
+
+/* Close what a departed client left open and hand its slot out again */
+static void reclaim_slot(fsd_slot_class *slot, struct slot_files *sf)
+{
+	for (int i = 0; i < sf->count; i++)
+		fs_close(sf->fds[i]);
+	sf->count = 0;
+
+	atomic_store(&slot->sq_index.head, 0);
+	atomic_store(&slot->sq_index.tail, 0);
+	atomic_store(&slot->cq_index.head, 0);
+	atomic_store(&slot->cq_index.tail, 0);
+	atomic_store(&slot->pid, 0);
+	atomic_store_explicit(&slot->state, FSD_SLOT_FREE,
+			      memory_order_release);
+}
+
+static int client_gone(fsd_slot_class *slot)
+{
+	pid_t pid = atomic_load(&slot->pid);
+
+	/* pid is still 0 for a client in the middle of attaching */
+	return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec nap = {0, IDLE_NAP_NS};
+	struct sigaction sa;
+	fsd_shared_class *shared;
+	char *diskname, *name;
+	int shm_fd, idle = 0;
+	int interval = 0;
+	int segment = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:l:")) != -1) {
+		switch (opt) {
+		case 'f':
+			interval = atoi(optarg);
+			break;
+		case 'l':
+			segment = atoi(optarg);
+			break;
+		default:
+			die("Usage: %s [-f interval] [-l segment] <diskname> <shm name>", argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		die("Usage: %s [-f interval] [-l segment] <diskname> <shm name>", argv[0]);
+	diskname = argv[optind];
+	name = argv[optind + 1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Changes reach the disk every interval milliseconds, not only on exit */
+	if (interval > 0 && fs_flush_interval(interval)) {
+		fs_umount();
+		die("Cannot start the flusher");
+	}
+
+	/* Random writes of clients go to a log of segment blocks */
+	if (segment > 0 && fs_log(segment)) {
+		fs_umount();
+		die("Cannot write in log-structured mode");
+	}
+
+	shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shm_fd < 0) {
+		fs_umount();
+		die("Cannot create %s: %s", name, strerror(errno));
+	}
+	if (ftruncate(shm_fd, sizeof(fsd_shared_class)) < 0) {
+		close(shm_fd);
+		shm_unlink(name);
+		fs_umount();
+		die("Cannot size %s", name);
+	}
+	shared = mmap(NULL, sizeof(fsd_shared_class), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (shared == MAP_FAILED) {
+		shm_unlink(name);
+		fs_umount();
+		die("Cannot map %s", name);
+	}
+
+	/* The object starts zeroed: every slot is free and its rings empty */
+	shared->magic = FSD_MAGIC;
+	shared->version = FSD_VERSION;
+	atomic_store_explicit(&shared->running, 1, memory_order_release);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop) {
+		int served = 0;
+
+		for (int i = 0; i < FSD_SLOT_COUNT; i++) {
+			fsd_slot_class *slot = &shared->slots[i];
+			__uint32_t state = atomic_load_explicit(&slot->state,
+						memory_order_acquire);
+
+			if (state == FSD_SLOT_ATTACHED)
+				served += serve_slot(slot, &files[i]);
+			else if (state == FSD_SLOT_DETACHING)
+				reclaim_slot(slot, &files[i]);
+		}
+
+		if (served) {
+			idle = 0;
+			continue;
+		}
+		if (++idle % REAP_INTERVAL == 0) {
+			for (int i = 0; i < FSD_SLOT_COUNT; i++) {
+				fsd_slot_class *slot = &shared->slots[i];
+				if (atomic_load(&slot->state) == FSD_SLOT_ATTACHED &&
+				    client_gone(slot))
+					reclaim_slot(slot, &files[i]);
+			}
+		}
+		if (idle > IDLE_SPIN)
+			nanosleep(&nap, NULL);
+	}
+
+	/* Wake up waiting clients before the object goes away */
+	atomic_store_explicit(&shared->running, 0, memory_order_release);
+	for (int i = 0; i < FSD_SLOT_COUNT; i++) {
+		for (int j = 0; j < files[i].count; j++)
+			fs_close(files[i].fds[j]);
+		free(files[i].fds);
+	}
+	munmap(shared, sizeof(fsd_shared_class));
+	shm_unlink(name);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
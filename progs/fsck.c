@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fsck_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsck_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+/*
+ * Exit status: 0 if the volume is clean, 1 if problems were found (and, with
+ * -r, repaired where possible), 2 if the volume could not be checked.
+ */
+int main(int argc, char **argv)
+{
+	char *diskname;
+	int repair = 0, threads = 0;
+	int opt, problems;
+
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			die("Usage: %s [-r] [-j threads] <diskname>", argv[0]);
+		}
+	}
+	if (optind >= argc)
+		die("Usage: %s [-r] [-j threads] <diskname>", argv[0]);
+	diskname = argv[optind];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	problems = fs_check(repair, threads);
+	if (problems < 0) {
+		fs_umount();
+		die("Cannot check diskname");
+	}
+	printf("%s: %d problem%s found\n", diskname, problems,
+	       problems == 1 ? "" : "s");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return problems ? 1 : 0;
+}
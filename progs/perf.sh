@@ -0,0 +1,256 @@
+#!/bin/sh
+#
+# Performance regression harness: run fixed workloads through test_fs.x and
+# fs_ref.x on freshly formatted images, check that both print the same thing,
+# and compare what test_fs.x costs against a stored baseline.
+#
+# Usage: ./perf.sh [-u] [-r reps] [-b baseline]
+#	-u: write the measurements as the new baseline instead of checking them
+#	-r: timed runs per workload, the fastest one is kept (default 5)
+#	-b: baseline file (default perf.baseline next to this script)
+#
+# For each workload, the number of system calls and of bytes read and written
+# must stay within PERF_THRESHOLD percent of the baseline (default 10), and the
+# wall time relative to fs_ref.x within PERF_TIME_THRESHOLD percent (default
+# 25). Timing against fs_ref.x on the same machine keeps the baseline valid
+# across machines.
+
+set -e
+
+dir=$(cd "$(dirname "$0")" && pwd)
+ours=$dir/test_fs.x
+ref=$dir/fs_ref.x
+make=$dir/fs_make.x
+run=$dir/perf_run.x
+
+update=0
+reps=5
+baseline=$dir/perf.baseline
+threshold=${PERF_THRESHOLD:-10}
+time_threshold=${PERF_TIME_THRESHOLD:-25}
+
+while getopts "ur:b:" opt; do
+	case $opt in
+	u) update=1 ;;
+	r) reps=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	*) echo "Usage: $0 [-u] [-r reps] [-b baseline]" >&2; exit 2 ;;
+	esac
+done
+
+for prog in "$ours" "$ref" "$make" "$run"; do
+	if [ ! -x "$prog" ]; then
+		echo "$0: missing $prog" >&2
+		exit 2
+	fi
+done
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+# Deterministic file contents, so that every run moves the same bytes
+gen() {
+	awk -v n="$2" -v seed="$3" 'BEGIN {
+		srand(seed)
+		for (i = 0; i < n; i++)
+			printf "%c", 32 + int(rand() * 95)
+	}' > "$1"
+}
+
+# Run one file system command of the current workload
+fs() {
+	$run $counted -o stats "$prog" "$@" >> out 2>&1 || true
+}
+
+# Many small files in the root directory
+setup_small() {
+	i=0
+	while [ $i -lt 64 ]; do
+		gen small$i $((i * 97 + 1)) $i
+		i=$((i + 1))
+	done
+}
+workload_small() {
+	$make disk.fs 2048 > /dev/null
+	i=0
+	while [ $i -lt 64 ]; do
+		fs add disk.fs small$i
+		i=$((i + 1))
+	done
+	fs ls disk.fs
+	fs info disk.fs
+	i=0
+	while [ $i -lt 64 ]; do
+		fs cat disk.fs small$i
+		fs stat disk.fs small$i
+		i=$((i + 2))
+	done
+	i=1
+	while [ $i -lt 64 ]; do
+		fs rm disk.fs small$i
+		i=$((i + 2))
+	done
+	fs ls disk.fs
+	fs info disk.fs
+}
+
+# A few files of several megabytes
+setup_large() {
+	gen large0 4194304 1
+	gen large1 6291456 2
+	gen large2 1048699 3
+}
+workload_large() {
+	$make disk.fs 8192 > /dev/null
+	fs add disk.fs large0
+	fs add disk.fs large1
+	fs add disk.fs large2
+	fs cat disk.fs large0
+	fs cat disk.fs large1
+	fs cat disk.fs large2
+	fs rm disk.fs large1
+	fs add disk.fs large1
+	fs stat disk.fs large1
+	fs info disk.fs
+}
+
+# Files of mixed sizes added and removed until free space is fragmented
+setup_churn() {
+	i=0
+	while [ $i -lt 16 ]; do
+		gen churn$i $((i * i * 1531 + 17)) $((i + 100))
+		i=$((i + 1))
+	done
+}
+workload_churn() {
+	$make disk.fs 1024 > /dev/null
+	round=0
+	while [ $round -lt 8 ]; do
+		i=$((round % 2))
+		while [ $i -lt 16 ]; do
+			fs add disk.fs churn$i
+			i=$((i + 2))
+		done
+		i=$(((round + 1) % 2))
+		while [ $i -lt 16 ]; do
+			fs rm disk.fs churn$i
+			i=$((i + 4))
+		done
+		round=$((round + 1))
+	done
+	fs ls disk.fs
+	i=0
+	while [ $i -lt 16 ]; do
+		fs cat disk.fs churn$i
+		i=$((i + 1))
+	done
+	fs info disk.fs
+}
+
+# Sum the columns of the stats file
+total() {
+	awk '{ w += $1; s += $2; r += $3; x += $4 }
+	     END { printf "%d %d %d %d\n", w, s, r, x }' stats
+}
+
+# Time a workload with one program, keep the fastest of the runs
+timed() {
+	prog=$1
+	counted=
+	best=
+	n=0
+	while [ $n -lt $reps ]; do
+		rm -f stats out
+		workload_$name
+		wall=$(total | cut -d' ' -f1)
+		if [ -z "$best" ] || [ "$wall" -lt "$best" ]; then
+			best=$wall
+		fi
+		n=$((n + 1))
+	done
+	echo "$best"
+}
+
+# Count what a workload costs with one program, and keep what it printed
+counted() {
+	prog=$1
+	counted=-c
+	rm -f stats out
+	workload_$name
+	# Column widths of ls differ in trailing spaces only
+	sed 's/ *$//' out > "out.$2"
+	total | cut -d' ' -f2-
+}
+
+results=$work/results
+status=0
+: > "$results"
+
+for name in small large churn; do
+	setup_$name
+
+	counts=$(counted "$ours" ours)
+	counted "$ref" ref > /dev/null
+	if ! cmp -s out.ours out.ref; then
+		echo "$name: output differs from fs_ref.x" >&2
+		diff out.ref out.ours | head -20 >&2
+		status=1
+	fi
+
+	wall_ours=$(timed "$ours")
+	wall_ref=$(timed "$ref")
+	ratio=$(awk -v a="$wall_ours" -v b="$wall_ref" \
+		'BEGIN { printf "%.3f", b ? a / b : 0 }')
+
+	echo "$name $counts $ratio" >> "$results"
+	printf "%-6s syscalls %s read %s written %s time %.1fms (%sx fs_ref.x)\n" \
+		"$name" $counts "$(awk -v w="$wall_ours" 'BEGIN { print w / 1e6 }')" \
+		"$ratio"
+	rm -f small* large* churn*
+done
+
+if [ $update -eq 1 ]; then
+	{
+		echo "# workload syscalls bytes_read bytes_written time_vs_fs_ref"
+		cat "$results"
+	} > "$baseline"
+	echo "Baseline written to $baseline"
+	exit $status
+fi
+
+if [ ! -f "$baseline" ]; then
+	echo "$0: no baseline, create one with -u" >&2
+	exit 2
+fi
+
+# Compare every measurement with the baseline of its workload
+awk -v t="$threshold" -v tt="$time_threshold" '
+	NR == FNR {
+		if ($1 !~ /^#/)
+			for (i = 2; i <= 5; i++)
+				base[$1, i] = $i
+		next
+	}
+	{
+		split("syscalls bytes_read bytes_written time_vs_fs_ref", what)
+		for (i = 2; i <= 5; i++) {
+			if (!(($1, i) in base)) {
+				printf "%s: not in baseline\n", $1
+				break
+			}
+			limit = base[$1, i] * (1 + (i == 5 ? tt : t) / 100)
+			if ($i > limit) {
+				printf "%s: %s regressed, %s against %s\n",
+				       $1, what[i - 1], $i, base[$1, i]
+				bad = 1
+			}
+		}
+	}
+	END { exit bad }
+' "$baseline" "$results" >&2 || status=1
+
+if [ $status -eq 0 ]; then
+	echo "No regression"
+fi
+exit $status
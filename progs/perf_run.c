@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define perf_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	perf_error(__VA_ARGS__);	\
+	exit(127);					\
+} while (0)
+
+/* What one run of a command costs */
+struct perf_stats {
+	uint64_t wall_ns;
+	uint64_t syscalls;
+	uint64_t rchar;
+	uint64_t wchar;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bytes moved by read and write calls, as accounted in /proc/<pid>/io */
+static void read_io(pid_t pid, struct perf_stats *stats)
+{
+	char path[64], line[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "rchar: %" SCNu64, &stats->rchar);
+		sscanf(line, "wchar: %" SCNu64, &stats->wchar);
+	}
+	fclose(f);
+}
+
+static pid_t spawn(char **argv, int traced)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("Cannot fork");
+	if (!pid) {
+		if (traced) {
+			ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+			raise(SIGSTOP);
+		}
+		execvp(argv[0], argv);
+		perf_error("Cannot run %s", argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+/*
+ * Run the command under ptrace, stopping on every system call of every thread.
+ * Only entries are counted. The byte counts are read when the main thread is
+ * about to exit, the last moment /proc still has them.
+ */
+static int run_traced(char **argv, struct perf_stats *stats)
+{
+	pid_t pid = spawn(argv, 1), tid;
+	int status, code = 127;
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		die("Cannot trace %s", argv[0]);
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	       PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXIT |
+	       PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+	while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+		int signo = 0;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == pid)
+				code = WIFEXITED(status) ? WEXITSTATUS(status) :
+					128 + WTERMSIG(status);
+			continue;
+		}
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			struct __ptrace_syscall_info info;
+
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info),
+				   &info) > 0 &&
+			    info.op == PTRACE_SYSCALL_INFO_ENTRY)
+				stats->syscalls++;
+		} else if (status >> 8 == (SIGTRAP | PTRACE_EVENT_EXIT << 8)) {
+			if (tid == pid)
+				read_io(pid, stats);
+		} else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP &&
+			   WSTOPSIG(status) != SIGTRAP) {
+			/* Pass real signals on to the command */
+			signo = WSTOPSIG(status);
+		}
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(intptr_t)signo);
+	}
+	return code;
+}
+
+static int run_timed(char **argv, struct perf_stats *stats)
+{
+	uint64_t start = now_ns();
+	pid_t pid = spawn(argv, 0);
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			die("Cannot wait for %s", argv[0]);
+	stats->wall_ns = now_ns() - start;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Run a command and append what it cost to a file, as one line of
+ * "<wall ns> <syscalls> <bytes read> <bytes written>". Timing and counting are
+ * separate runs, since tracing slows the command down: the counts are zero
+ * without -c, and the wall time is zero with it. The command's output is left
+ * alone and its exit status returned.
+ */
+int main(int argc, char **argv)
+{
+	struct perf_stats stats = { 0 };
+	const char *output = NULL;
+	int counted = 0;
+	int opt, code;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "+co:")) != -1) {
+		switch (opt) {
+		case 'c':
+			counted = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			die("Usage: %s [-c] [-o statfile] <command> [<arg>...]", argv[0]);
+		}
+	}
+	if (optind >= argc)
+		die("Usage: %s [-c] [-o statfile] <command> [<arg>...]", argv[0]);
+
+	if (counted)
+		code = run_traced(argv + optind, &stats);
+	else
+		code = run_timed(argv + optind, &stats);
+
+	f = output ? fopen(output, "a") : stderr;
+	if (!f)
+		die("Cannot open %s", output);
+	fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+		stats.wall_ns, stats.syscalls, stats.rchar, stats.wchar);
+	if (output)
+		fclose(f);
+
+	return code;
+}
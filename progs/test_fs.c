@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +12,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +38,32 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Whether a cache image was given with -c or -C */
+static int cached;
+
+/* Blocks per log segment given with -l, 0 to write files in place */
+static unsigned int log_segment;
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+/* Mount the disk, in log-structured mode if -l was given */
+static int mount_disk(const char *diskname)
+{
+	if (fs_mount(diskname))
+		return -1;
+	if (log_segment && fs_log(log_segment)) {
+		fs_umount();
+		return -1;
+	}
+	return 0;
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -163,6 +193,56 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		fs_umount();
+		die("Cannot delete directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -195,7 +275,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -226,6 +306,143 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_write(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *host, *buf;
+	int fd, fs_fd;
+	struct stat st;
+	size_t offset;
+	int written;
+
+	if (t_arg->argc < 4)
+		die("Usage: <diskname> <filename> <host filename> <offset>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	host = t_arg->argv[2];
+	offset = get_argv(t_arg->argv[3]);
+
+	/* Open file on host computer */
+	fd = open(host, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode) || !st.st_size)
+		die("Not a non-empty regular file: %s\n", host);
+
+	/* Map file into buffer */
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	/* Write the host file over the file at @offset, which may lie past its end */
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	written = fs_pwrite(fs_fd, buf, st.st_size, offset);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (written != st.st_size)
+		die("Cannot write file");
+
+	printf("Wrote '%s' at offset %zu of file '%s' (%d/%zu bytes)\n", host,
+	       offset, filename, written, st.st_size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_compress(fs_fd)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot compress file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compressed file '%s'\n", filename);
+}
+
+void thread_fs_extent(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_extent(fs_fd)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot map file by extents");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Mapped file '%s' by extents\n", filename);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -245,10 +462,617 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_lsdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_lsdir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_checksum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_checksum()) {
+		fs_umount();
+		die("Cannot enable checksums");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled checksums on '%s'\n", diskname);
+}
+
+void thread_fs_scrub(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int rate = 0;
+	int bad;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per second>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		rate = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	bad = fs_scrub(rate);
+	if (bad < 0) {
+		fs_umount();
+		die("Cannot scrub diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Scrubbed '%s': %d corrupted blocks\n", diskname, bad);
+	if (bad)
+		exit(1);
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int saved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	saved = fs_dedup();
+	if (saved < 0) {
+		fs_umount();
+		die("Cannot deduplicate diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deduplicated '%s': %d blocks freed\n", diskname, saved);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <source> <destination>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+	int src_fd, dst_fd, stat, copied;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <source> <destination>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	src_fd = fs_open(src);
+	if (src_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_create(dst)) {
+		fs_close(src_fd);
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	dst_fd = fs_open(dst);
+	if (dst_fd < 0) {
+		fs_close(src_fd);
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(src_fd);
+	copied = fs_copy_range(src_fd, dst_fd, 0, stat);
+	if (copied < 0) {
+		fs_close(dst_fd);
+		fs_close(src_fd);
+		fs_umount();
+		die("Cannot copy file");
+	}
+
+	if (fs_close(dst_fd) || fs_close(src_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s' (%d/%d bytes)\n", src, dst, copied,
+	       stat);
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Took snapshot '%s'\n", name);
+}
+
+void thread_fs_snapdel(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deleted snapshot '%s'\n", name);
+}
+
+/* Bulk transfers hand whole files between the fs side and host-side workers */
+#define BULK_WORKERS	4
+#define BULK_QUEUE	8
+
+struct bulk_file {
+	char *host;
+	char *path;
+	char *buf;
+	size_t size;
+	int failed;
+};
+
+struct bulk {
+	struct bulk_file *files;
+	size_t count;
+	size_t capacity;
+	size_t next;		/* next file for a worker to take */
+	size_t popped;		/* files taken out of the queue */
+	struct bulk_file *queue[BULK_QUEUE];
+	size_t head;
+	size_t tail;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_t workers[BULK_WORKERS];
+};
+
+static char *bulk_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path = malloc(len + strlen(name) + 2);
+
+	if (!path)
+		die_perror("malloc");
+	if (len && dir[len - 1] != '/')
+		sprintf(path, "%s/%s", dir, name);
+	else
+		sprintf(path, "%s%s", dir, name);
+	return path;
+}
+
+static void bulk_init(struct bulk *bulk)
+{
+	memset(bulk, 0, sizeof(*bulk));
+	pthread_mutex_init(&bulk->lock, NULL);
+	pthread_cond_init(&bulk->not_empty, NULL);
+	pthread_cond_init(&bulk->not_full, NULL);
+}
+
+static void bulk_destroy(struct bulk *bulk)
+{
+	for (size_t i = 0; i < bulk->count; i++) {
+		free(bulk->files[i].host);
+		free(bulk->files[i].path);
+	}
+	free(bulk->files);
+	pthread_mutex_destroy(&bulk->lock);
+	pthread_cond_destroy(&bulk->not_empty);
+	pthread_cond_destroy(&bulk->not_full);
+}
+
+static void bulk_add(struct bulk *bulk, char *host, char *path, size_t size)
+{
+	if (bulk->count == bulk->capacity) {
+		bulk->capacity = bulk->capacity ? bulk->capacity * 2 : 64;
+		bulk->files = realloc(bulk->files,
+				      bulk->capacity * sizeof(*bulk->files));
+		if (!bulk->files)
+			die_perror("realloc");
+	}
+	bulk->files[bulk->count++] = (struct bulk_file) {
+		.host = host, .path = path, .size = size
+	};
+}
+
+static void bulk_push(struct bulk *bulk, struct bulk_file *file)
+{
+	pthread_mutex_lock(&bulk->lock);
+	while (bulk->tail - bulk->head == BULK_QUEUE)
+		pthread_cond_wait(&bulk->not_full, &bulk->lock);
+	bulk->queue[bulk->tail++ % BULK_QUEUE] = file;
+	pthread_cond_signal(&bulk->not_empty);
+	pthread_mutex_unlock(&bulk->lock);
+}
+
+/* Return NULL once every file of the transfer went through the queue */
+static struct bulk_file *bulk_pop(struct bulk *bulk)
+{
+	struct bulk_file *file = NULL;
+
+	pthread_mutex_lock(&bulk->lock);
+	while (bulk->head == bulk->tail && bulk->popped < bulk->count)
+		pthread_cond_wait(&bulk->not_empty, &bulk->lock);
+	if (bulk->popped < bulk->count) {
+		file = bulk->queue[bulk->head++ % BULK_QUEUE];
+		bulk->popped++;
+		pthread_cond_signal(&bulk->not_full);
+	}
+	/* Let the other consumers see that the transfer is over */
+	if (bulk->popped == bulk->count)
+		pthread_cond_broadcast(&bulk->not_empty);
+	pthread_mutex_unlock(&bulk->lock);
+	return file;
+}
+
+static struct bulk_file *bulk_take(struct bulk *bulk)
+{
+	struct bulk_file *file = NULL;
+
+	pthread_mutex_lock(&bulk->lock);
+	if (bulk->next < bulk->count)
+		file = &bulk->files[bulk->next++];
+	pthread_mutex_unlock(&bulk->lock);
+	return file;
+}
+
+static void bulk_start(struct bulk *bulk, void *(*worker)(void *))
+{
+	for (int i = 0; i < BULK_WORKERS; i++)
+		if (pthread_create(&bulk->workers[i], NULL, worker, bulk))
+			die("Cannot create worker thread");
+}
+
+static void bulk_wait(struct bulk *bulk)
+{
+	for (int i = 0; i < BULK_WORKERS; i++)
+		pthread_join(bulk->workers[i], NULL);
+}
+
+/* Create the directories on the file system, and list the files to import */
+static void import_scan(struct bulk *bulk, const char *host, const char *path)
+{
+	struct dirent *dent;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(host);
+	if (!dir)
+		die_perror("opendir");
+
+	while ((dent = readdir(dir))) {
+		char *sub_host, *sub_path;
+
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+
+		sub_host = bulk_join(host, dent->d_name);
+		sub_path = bulk_join(path, dent->d_name);
+		if (stat(sub_host, &st))
+			die_perror("stat");
+
+		if (S_ISDIR(st.st_mode)) {
+			if (fs_mkdir(sub_path))
+				test_fs_error("Cannot create directory '%s'",
+					      sub_path);
+			else
+				import_scan(bulk, sub_host, sub_path);
+			free(sub_host);
+			free(sub_path);
+		} else if (S_ISREG(st.st_mode)) {
+			bulk_add(bulk, sub_host, sub_path, st.st_size);
+		} else {
+			free(sub_host);
+			free(sub_path);
+		}
+	}
+	closedir(dir);
+}
+
+/* Read host files while the main thread writes the previous ones */
+static void *import_worker(void *arg)
+{
+	struct bulk *bulk = arg;
+	struct bulk_file *file;
+
+	while ((file = bulk_take(bulk))) {
+		size_t done = 0;
+		int fd;
+
+		file->buf = malloc(file->size ? file->size : 1);
+		fd = open(file->host, O_RDONLY);
+		while (file->buf && fd >= 0 && done < file->size) {
+			ssize_t ret = read(fd, file->buf + done,
+					   file->size - done);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		file->failed = !file->buf || fd < 0 || done < file->size;
+		if (fd >= 0)
+			close(fd);
+		bulk_push(bulk, file);
+	}
+	return NULL;
+}
+
+void thread_fs_import_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *host, *path;
+	struct bulk_file *file;
+	struct bulk bulk;
+	size_t bytes = 0;
+	int fs_fd, failed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host dirname> [<dirname>]");
+
+	diskname = t_arg->argv[0];
+	host = t_arg->argv[1];
+	path = t_arg->argc > 2 ? t_arg->argv[2] : "";
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	bulk_init(&bulk);
+	import_scan(&bulk, host, path);
+
+	/*
+	 * Each file is written with a single fs_write(), which allocates all
+	 * its blocks at once, and the FAT is only flushed by fs_umount()
+	 */
+	bulk_start(&bulk, import_worker);
+	while ((file = bulk_pop(&bulk))) {
+		if (file->failed || fs_create(file->path) ||
+		    (fs_fd = fs_open(file->path)) < 0) {
+			test_fs_error("Cannot import '%s'", file->host);
+			failed++;
+		} else {
+			int written = fs_write(fs_fd, file->buf, file->size);
+			if (written != (int)file->size) {
+				test_fs_error("Cannot write '%s'", file->path);
+				failed++;
+			}
+			if (written > 0)
+				bytes += written;
+			fs_close(fs_fd);
+		}
+		free(file->buf);
+	}
+	bulk_wait(&bulk);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %zu files (%zu bytes), %d failed\n",
+	       bulk.count - failed, bytes, failed);
+	bulk_destroy(&bulk);
+	if (failed)
+		exit(1);
+}
+
+struct export_scan {
+	struct bulk *bulk;
+	const char *host;
+	const char *path;
+};
+
+static int export_visit(const char *name, int size, int is_dir, void *arg)
+{
+	struct export_scan *scan = arg;
+	char *sub_host = bulk_join(scan->host, name);
+	char *sub_path = bulk_join(scan->path, name);
+
+	if (!is_dir) {
+		bulk_add(scan->bulk, sub_host, sub_path, size);
+		return 0;
+	}
+
+	/* Reading the file system from the callback is allowed */
+	struct export_scan sub = { scan->bulk, sub_host, sub_path };
+	if (mkdir(sub_host, 0755) && errno != EEXIST)
+		test_fs_error("Cannot create directory '%s'", sub_host);
+	else if (fs_readdir(sub_path, export_visit, &sub))
+		test_fs_error("Cannot list directory '%s'", sub_path);
+	free(sub_host);
+	free(sub_path);
+	return 0;
+}
+
+/* Write host files while the main thread reads the next ones */
+static void *export_worker(void *arg)
+{
+	struct bulk *bulk = arg;
+	struct bulk_file *file;
+
+	while ((file = bulk_pop(bulk))) {
+		size_t done = 0;
+		int fd = -1;
+
+		if (!file->failed)
+			fd = open(file->host, O_WRONLY | O_CREAT | O_TRUNC,
+				  0644);
+		while (fd >= 0 && done < file->size) {
+			ssize_t ret = write(fd, file->buf + done,
+					    file->size - done);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		if (fd < 0 || done < file->size || close(fd)) {
+			test_fs_error("Cannot export '%s'", file->path);
+			/* Only this worker touches the file from now on */
+			file->failed = 1;
+		}
+		free(file->buf);
+	}
+	return NULL;
+}
+
+void thread_fs_export_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *host, *path;
+	struct export_scan scan;
+	struct bulk bulk;
+	size_t bytes = 0;
+	int failed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host dirname> [<dirname>]");
+
+	diskname = t_arg->argv[0];
+	host = t_arg->argv[1];
+	path = t_arg->argc > 2 ? t_arg->argv[2] : "";
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (mkdir(host, 0755) && errno != EEXIST) {
+		fs_umount();
+		die_perror("mkdir");
+	}
+
+	bulk_init(&bulk);
+	scan = (struct export_scan) { &bulk, host, path };
+	if (fs_readdir(path, export_visit, &scan)) {
+		fs_umount();
+		die("Cannot list directory");
+	}
+
+	bulk_start(&bulk, export_worker);
+	for (size_t i = 0; i < bulk.count; i++) {
+		struct bulk_file *file = &bulk.files[i];
+		int fs_fd = fs_open(file->path);
+
+		file->buf = malloc(file->size ? file->size : 1);
+		if (fs_fd < 0 || !file->buf ||
+		    fs_pread(fs_fd, file->buf, file->size, 0) !=
+		    (int)file->size)
+			file->failed = 1;
+		else
+			bytes += file->size;
+		if (fs_fd >= 0)
+			fs_close(fs_fd);
+		bulk_push(&bulk, file);
+	}
+	bulk_wait(&bulk);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (size_t i = 0; i < bulk.count; i++)
+		failed += bulk.files[i].failed;
+	printf("Exported %zu files (%zu bytes), %d failed\n",
+	       bulk.count - failed, bytes, failed);
+	bulk_destroy(&bulk);
+	if (failed)
+		exit(1);
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
+	size_t hits, misses;
 
 	if (t_arg->argc < 1)
 		die("Usage: <diskname>");
@@ -259,17 +1083,22 @@ void thread_fs_info(void *arg)
 		die("Cannot mount diskname");
 
 	fs_info();
+	if (cached && !block_cache_stats(&hits, &misses))
+		printf("cache_hits=%zu cache_misses=%zu\n", hits, misses);
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+void thread_fs_mkcache(void *arg)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <cache image> <block count>");
+
+	if (block_cache_create(t_arg->argv[0], get_argv(t_arg->argv[1])))
+		die("Cannot create cache image");
 }
 
 static struct {
@@ -279,15 +1108,36 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "write",	thread_fs_write },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "lsdir",	thread_fs_lsdir },
+	{ "compress",	thread_fs_compress },
+	{ "extent",	thread_fs_extent },
+	{ "checksum",	thread_fs_checksum },
+	{ "scrub",	thread_fs_scrub },
+	{ "dedup",	thread_fs_dedup },
+	{ "clone",	thread_fs_clone },
+	{ "copy",	thread_fs_copy },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "snapdel",	thread_fs_snapdel },
+	{ "import-dir",	thread_fs_import_dir },
+	{ "export-dir",	thread_fs_export_dir },
+	{ "mkcache",	thread_fs_mkcache }
 };
 
 void usage(char *program)
 {
 	size_t i;
-	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Usage: %s [-m] [-c|-C <cache image>] [-l <segment>] "
+		"<command> [<arg>]\n", program);
+	fprintf(stderr, "\t-m: disk loaded in memory, changes are dropped\n");
+	fprintf(stderr, "\t-c: cache image written through\n");
+	fprintf(stderr, "\t-C: cache image written back\n");
+	fprintf(stderr, "\t-l: files written in log-structured mode\n");
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
@@ -310,6 +1160,35 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	/* Measure the file system alone, without the cost of the disk */
+	if (argc >= 1 && !strcmp(argv[0], "-m")) {
+		block_disk_select(&block_backend_ram);
+		argc--;
+		argv++;
+	}
+
+	/* Every disk the command opens goes through the cache image */
+	if (argc >= 2 && (!strcmp(argv[0], "-c") || !strcmp(argv[0], "-C"))) {
+		if (block_cache_select(argv[1], argv[0][1] == 'c' ?
+				       BLOCK_CACHE_WRITE_THROUGH :
+				       BLOCK_CACHE_WRITE_BACK))
+			usage(program);
+		cached = 1;
+		argc -= 2;
+		argv += 2;
+	}
+
+	/* Commands writing files append them to a log of such segments */
+	if (argc >= 2 && !strcmp(argv[0], "-l")) {
+		log_segment = get_argv(argv[1]);
+		if (!log_segment)
+			usage(program);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc == 0)
+		usage(program);
+
 	cmd = argv[0];
 	arg.argc = --argc;
 	arg.argv = &argv[1];